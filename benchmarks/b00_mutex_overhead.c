@@ -0,0 +1,90 @@
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+/*
+ * This benchmark measures the cost of uncontended mutex operations, so the
+ * overhead of lockdep can be compared against the native pthread functions:
+ *
+ *   ./b00_mutex_overhead
+ *   LOCKDEP_DISABLE=1 LD_PRELOAD=./liblockdep_interpose.so ./b00_mutex_overhead
+ *   LD_PRELOAD=./liblockdep_interpose.so ./b00_mutex_overhead > /dev/null
+ *
+ * Results go to stderr so that lockdep's output on stdout (LOCKDEP_TRACE=1)
+ * can be discarded.
+ */
+
+#define MANY_LOCKS 1024
+
+pthread_mutex_t outer = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t inner = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t many[MANY_LOCKS];
+
+static double now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// Lock/unlock pairs on `inner`, optionally nested under `outer`.
+static double bench_lock_unlock(long iterations, bool nested)
+{
+    if (nested) pthread_mutex_lock(&outer);
+
+    double start = now_ns();
+    for (long i = 0; i < iterations; i++) {
+        pthread_mutex_lock(&inner);
+        pthread_mutex_unlock(&inner);
+    }
+    double elapsed = now_ns() - start;
+
+    if (nested) pthread_mutex_unlock(&outer);
+    return elapsed / iterations;
+}
+
+// Lock/unlock pairs cycling through more locks than lockdep caches per thread,
+// with nothing held.
+static double bench_many_locks(long iterations)
+{
+    double start = now_ns();
+    for (long i = 0; i < iterations; i++) {
+        pthread_mutex_lock(&many[i % MANY_LOCKS]);
+        pthread_mutex_unlock(&many[i % MANY_LOCKS]);
+    }
+    return (now_ns() - start) / iterations;
+}
+
+// Successful trylock/unlock pairs on `inner`.
+static double bench_trylock(long iterations)
+{
+    double start = now_ns();
+    for (long i = 0; i < iterations; i++) {
+        if (pthread_mutex_trylock(&inner) == 0) pthread_mutex_unlock(&inner);
+    }
+    return (now_ns() - start) / iterations;
+}
+
+int main(int argc, char** argv)
+{
+    long iterations = argc > 1 ? atol(argv[1]) : 1000000;
+    if (iterations <= 0) {
+        fprintf(stderr, "usage: %s [iterations]\n", argv[0]);
+        return 1;
+    }
+
+    for (int i = 0; i < MANY_LOCKS; i++) pthread_mutex_init(&many[i], NULL);
+
+    // Warm up caches, lazy binding and lockdep's graph.
+    bench_lock_unlock(iterations / 10 + 1, false);
+    bench_lock_unlock(iterations / 10 + 1, true);
+    bench_many_locks(MANY_LOCKS);
+
+    fprintf(stderr, "lock/unlock, no lock held:  %8.1f ns/op\n", bench_lock_unlock(iterations, false));
+    fprintf(stderr, "lock/unlock, one lock held: %8.1f ns/op\n", bench_lock_unlock(iterations, true));
+    fprintf(stderr, "lock/unlock, %d locks:    %8.1f ns/op\n", MANY_LOCKS, bench_many_locks(iterations));
+    fprintf(stderr, "trylock/unlock:             %8.1f ns/op\n", bench_trylock(iterations));
+    return 0;
+}
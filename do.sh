@@ -25,3 +25,23 @@ for test_binary in $TEST_BINARIES; do
 
   echo "===================================="
 done
+
+BENCHMARK_BINARIES=$(find . -maxdepth 1 -executable -regex '\.\/b[0-9][0-9].*' | sort)
+
+echo "============================"
+echo "== RUNNING BENCHMARK SET =="
+echo "============================"
+for benchmark_binary in $BENCHMARK_BINARIES; do
+
+  echo "===================================="
+  echo "== BENCHMARKING $benchmark_binary =="
+
+  echo "-- native"
+  $benchmark_binary
+  echo "-- lockdep disabled (LOCKDEP_DISABLE=1)"
+  LOCKDEP_DISABLE=1 LD_PRELOAD=./liblockdep_interpose_bench.so $benchmark_binary
+  echo "-- lockdep enabled"
+  LD_PRELOAD=./liblockdep_interpose_bench.so $benchmark_binary 100000 > /dev/null
+
+  echo "===================================="
+done
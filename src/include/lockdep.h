@@ -16,43 +16,67 @@
 
 #include <pthread.h>
 #include <semaphore.h>
+#include <stdatomic.h>
 #include <stdbool.h>
-
-typedef struct adjacent_locks adjacency_locks_t;
+#include <stdint.h>
+#include <sys/types.h>
 
 // Types of synchronization
 typedef enum sync_type {
     SYNC_MUTEX,
     SYNC_RWLOCK,
     SYNC_SEMAPHORE,
-    SYNC_CONDVAR
+    SYNC_CONDVAR,
+    SYNC_SPINLOCK
 } sync_type_t;
 
-// Node representing a lock in the lock dependency graph.
+// Validation modes, switchable at runtime.
+typedef enum lockdep_mode {
+    LOCKDEP_MODE_OFF,     // Lock operations are not tracked.
+    LOCKDEP_MODE_RECORD,  // Held locks and orderings are recorded, not validated.
+    LOCKDEP_MODE_SAMPLED, // One acquisition in every `sample rate` is validated.
+    LOCKDEP_MODE_FULL,    // Every acquisition is validated.
+    LOCKDEP_MODE_DEFERRED, // Operations are queued and validated by a lockdep thread.
+    LOCKDEP_MODE_FROZEN    // Acquisitions are validated against a topological order.
+} lockdep_mode_t;
+
+// Size, in 64-bit words, of the per-node reachability summary.
+#define LOCKDEP_SUMMARY_WORDS 4
+
+// Node representing a lock in the lock dependency graph. Nodes are addressed
+// by their dense id and their edges are stored as arrays of ids, so the graph
+// holds no pointers between nodes.
 typedef struct lock_node {
-    const void* lock_addr;       // Address of the lock.
-    sync_type_t type;            // Type of synchronization primitive
-    adjacency_locks_t* children; // List of adjacent (child) locks.
-    struct lock_node* next;      // Next lock node in the list.
+    const void* lock_addr; // Address of the lock.
+    sync_type_t type;      // Type of synchronization primitive
+    uint32_t id;           // Dense index, in creation order.
+    unsigned rank;         // Declared lock level, 0 when unranked.
+    uint32_t out_degree;   // Number of adjacent (child) locks.
+    uint32_t* edges;       // Child ids, followed by the matching edge ids.
+    const void* callsite;  // Code address of the first acquisition.
+    uint64_t class_key;    // Run-independent key, 0 until computed.
+    bool exclusive;        // Acquired other than for reading at least once.
+    // Bloom filter of the locks from which this one can be reached.
+    uint64_t ancestors[LOCKDEP_SUMMARY_WORDS];
 } lock_node_t;
 
-// Represents an adjacency (edge) in the lock dependency graph.
-typedef struct adjacent_locks {
-    lock_node_t* lock;           // Pointer to the adjacent lock node.
-    struct adjacent_locks* next; // Next adjacency in the list.
-} adjacency_locks_t;
-
 // Represents a lock currently held by a thread.
 typedef struct held_lock {
     lock_node_t* lock;      // Pointer to the held lock node.
+    bool read;              // Held shared, by an rwlock read acquisition.
     struct held_lock* next; // Next held lock in the list.
 } held_lock_t;
 
 // Context information for a thread, including held locks.
 typedef struct thread_context {
-    pthread_t thread_id;         // Thread identifier.
-    held_lock_t* held_locks;     // List of locks currently held by the thread.
-    struct thread_context* next; // Next thread context in the list.
+    pthread_t thread_id;          // Thread identifier.
+    held_lock_t* held_locks;      // List of locks currently held by the thread.
+    unsigned max_held_rank;       // Highest rank among the held locks.
+    unsigned unranked_held;       // Number of held locks without a rank.
+    unsigned epoch;               // Tracking epoch the held locks belong to.
+    held_lock_t* free_held;       // Released entries, reused by later acquisitions.
+    _Atomic uint64_t order_epoch; // Epoch of the frozen order being read, 0 when none.
+    struct thread_context* next;  // Next thread context in the list.
 } thread_context_t;
 
 // Memory arena interface
@@ -64,35 +88,185 @@ typedef struct memory_arena {
 } memory_arena_t;
 
 void lockdep_init(void);
+void lockdep_fini(void);
+
+// Switches the validation mode at runtime. Turning tracking back on discards
+// the held-lock state recorded before it was turned off, since lock
+// operations in between went unseen. `LOCKDEP_MODE` selects the initial mode,
+// `LOCKDEP_SAMPLE_RATE` the sampling rate and `LOCKDEP_CONTROL` a Unix socket
+// path ("%p" expands to the pid) on which a lockdep thread accepts the
+// commands "off", "record", "sampled [rate]", "full", "deferred", "frozen" and
+// "status".
+//
+// In deferred mode a lock operation only appends an event to a ring of the
+// calling thread, and an analyzer thread validates them and reports cycles
+// after the fact: nothing is ever refused. `LOCKDEP_DEFERRED_RING` sets the
+// ring size in events (4096 by default) and `LOCKDEP_DEFERRED_FULL` what a
+// thread does when its ring is full: "drop" the event (the default) or
+// "block" until the analyzer catches up.
+//
+// In frozen mode the graph is sorted topologically once, and an acquisition
+// is valid if every held lock comes earlier in that order: a comparison per
+// held lock, without the graph or its lock. An acquisition the order cannot
+// vouch for is validated against the graph. A new lock is placed before or
+// after all the others, and an ordering between placed locks that does not
+// fit the order switches back to full validation, the learning mode. With
+// `LOCKDEP_FREEZE_MS` set, full validation switches to frozen mode by itself
+// once no new ordering has been seen for that many milliseconds.
+void lockdep_set_mode(lockdep_mode_t mode);
+lockdep_mode_t lockdep_get_mode(void);
+void lockdep_set_sample_rate(unsigned rate);
 
 // Register the acquisition of a lock by the current thread. `lock_addr` is the
-// address of the lock being acquired. Returns true if acquisition is allowed,
-// false if it would cause a deadlock.
-bool lockdep_acquire_lock(const void* lock_addr, sync_type_t type);
+// address of the lock being acquired and `ip` the code address that acquires
+// it. Returns true if acquisition is allowed, false if it would cause a
+// deadlock.
+bool lockdep_acquire_lock(const void* lock_addr, sync_type_t type, const void* ip);
 
 // Register the release of a lock by the current thread. `lock_addr` is the
 // lock being released.
 void lockdep_release_lock(const void* lock_addr);
 
-// Functions for each type of primitive
-bool lockdep_acquire_mutex(const void* mutex_addr);
-bool lockdep_acquire_rwlock_read(const void* rwlock_addr);
-bool lockdep_acquire_rwlock_write(const void* rwlock_addr);
-bool lockdep_acquire_semaphore(const void* sem_addr);
-bool lockdep_wait_condvar(const void* condvar_addr, const void* mutex_addr);
+// Functions for each type of primitive. Read acquisitions of an rwlock are
+// treated as recursive reads, as glibc's default rwlocks let a reader in while
+// a writer waits: an ordering only closes a cycle if each lock on it makes the
+// next thread wait, so cycles made of readers alone are not deadlocks.
+bool lockdep_acquire_mutex(const void* mutex_addr, const void* ip);
+bool lockdep_acquire_rwlock_read(const void* rwlock_addr, const void* ip);
+bool lockdep_acquire_rwlock_write(const void* rwlock_addr, const void* ip);
+bool lockdep_acquire_semaphore(const void* sem_addr, const void* ip);
+bool lockdep_wait_condvar(const void* condvar_addr, const void* mutex_addr, const void* ip);
+
+// Spinlock variants never sleep inside lockdep: while the graph is busy the
+// operation is recorded later, without validation. pthread_spinlock_t is
+// volatile, hence the qualified address.
+bool lockdep_acquire_spinlock(const volatile void* spin_addr, const void* ip);
+void lockdep_release_spinlock(const volatile void* spin_addr);
+
+// Registers a successful trylock. It is pushed onto the thread's held locks
+// without ordering it after them, since a trylock cannot wait; it is never
+// refused.
+void lockdep_acquire_trylock(const volatile void* lock_addr, sync_type_t type, const void* ip);
+void lockdep_acquire_trylock_read(const volatile void* rwlock_addr, const void* ip);
 
 void lockdep_release_mutex(const void* mutex_addr);
 void lockdep_release_rwlock(const void* rwlock_addr);
 void lockdep_release_semaphore(const void* sem_addr);
 void lockdep_signal_condvar(const void* condvar_addr);
 
+// Prints "DEADLOCK DETECTED on `operation`" for an acquisition the calling
+// thread just had refused, unless the problem was already reported: each
+// cycle or rank violation is reported once and only counted afterwards.
+// `LOCKDEP_REPORT_FILE` also writes every report to a file, as JSON lines.
+void lockdep_report_refusal(const char* operation);
+
+// Wait-for graph, scanned for deadlocked threads by a watchdog thread when
+// `LOCKDEP_WATCHDOG_MS` sets its interval. Instrumentation layers publish the
+// lock a thread is about to block on before the real operation, and whether it
+// got it afterwards, which also updates the ownership table. These take no
+// lock. Addresses are volatile-qualified so spinlocks can be passed as they are.
+void lockdep_publish_wait(const volatile void* lock_addr);
+void lockdep_publish_acquired(const volatile void* lock_addr, bool acquired, const void* ip);
+void lockdep_publish_release(const volatile void* lock_addr);
+
+// Current owner of a lock, from a lock-free table updated on every acquisition
+// and release. The table is only kept with `LOCKDEP_OWNERS=1` or
+// `LOCKDEP_WATCHDOG_MS` set. With several holders (readers of an rwlock) the
+// most recent one is reported.
+typedef struct lockdep_owner {
+    pthread_t thread_id;
+    pid_t tid;
+    unsigned holders;     // Threads holding the lock.
+    uint64_t acquired_ns; // CLOCK_MONOTONIC_COARSE time of the acquisition.
+    const void* callsite; // Code that acquired the lock.
+} lockdep_owner_t;
+
+// Returns false if the lock is free or its owner is unknown.
+bool lockdep_lock_owner(const void* lock_addr, lockdep_owner_t* owner);
+
+// Prints, on stderr, the locks the thread `tid` (the calling thread if 0)
+// holds according to the ownership table, and returns how many there are.
+// Takes no lock. Locks taken without the instrumentation layers are unknown.
+unsigned lockdep_dump_held(pid_t tid);
+
+// Prints lockdep's statistics on stderr: the size of the graph, per-event
+// counts summed over all threads and, when `LOCKDEP_STATS` is set, histograms
+// of the time spent in lockdep_acquire_lock(), lockdep_release_lock() and
+// lockdep_wait_condvar(). `LOCKDEP_STATS` also prints them at exit.
+void lockdep_print_stats(void);
+
+// Reports, on stderr, every group of locks with circular dependencies in the
+// learned graph, with their full cycles, and returns how many groups there
+// are. Runs in time linear in the size of the graph. `LOCKDEP_CYCLE_REPORT=1`
+// runs it at exit.
+unsigned lockdep_report_cycles(void);
+
+// Graph queries, answered from the graph as learned so far. Each one holds the
+// graph lock for a single search, linear in the size of the graph at worst.
+//
+// lockdep_find_path() finds a shortest chain of orderings from `from` to `to`,
+// each lock acquired while holding the previous one, and writes the addresses
+// of up to `max` of its locks, both ends included, to `path`. Returns the full
+// length of the chain, 1 if `from` is `to`, or 0 if `to` is never acquired
+// after `from`.
+size_t lockdep_find_path(const void* from, const void* to, const void** path, size_t max);
+
+typedef struct lockdep_lock_stats {
+    sync_type_t type;
+    unsigned rank;
+    const void* callsite; // Code address of the first acquisition.
+    bool exclusive;       // Acquired other than for reading at least once.
+    uint32_t orderings;   // Locks acquired while this one was held.
+    uint32_t inversions;  // Of those orderings, the ones refused as closing a cycle.
+    uint64_t nested;      // Acquisitions made while this lock was held.
+} lockdep_lock_stats_t;
+
+// Returns false if the lock was never acquired.
+bool lockdep_lock_stats(const void* lock_addr, lockdep_lock_stats_t* stats);
+
+// Graph export for external tools. The graph is streamed to `path` with
+// bounded memory, so it can be dumped from a live process whatever its size.
+// lockdep's lock is only held while a batch of records is copied, not while
+// the file is written. Nodes are labelled with their type, address and class,
+// edges with the number of acquisitions that went through them. An unknown
+// format is rejected. `LOCKDEP_EXPORT_FILE` exports at exit, in the format
+// given by its extension (.dot, .graphml or .json).
+typedef enum lockdep_export_format {
+    LOCKDEP_EXPORT_DOT,
+    LOCKDEP_EXPORT_GRAPHML,
+    LOCKDEP_EXPORT_JSON
+} lockdep_export_format_t;
+
+bool lockdep_export_graph(const char* path, lockdep_export_format_t format);
+
+// Dependency graph persistence. The graph is stored keyed by lock class (the
+// module offset of a static lock, or the acquisition callsite of a dynamic
+// one) so orderings learned by one run are validated against the next.
+// `LOCKDEP_GRAPH_FILE` loads the file at startup and saves it at exit.
+bool lockdep_save_graph(const char* path);
+bool lockdep_load_graph(const char* path);
+
+// Declared lock ordering. Ranked locks must be acquired in strictly increasing
+// rank, which is validated with a single comparison instead of a graph search.
+// A rank of 0 makes the lock unranked again. `LOCKDEP_RANK_FILE` names a file
+// of "<lock> <rank>" lines loaded at startup, where <lock> is an exported
+// symbol, a hexadecimal address or "<module>+<hex offset>".
+void lockdep_set_rank(const void* lock_addr, unsigned rank);
+bool lockdep_load_ranks(const char* path);
+
 // Memory arena
 void* arena_alloc(size_t size);
 void arena_reset(void);
 void arena_destroy(void);
 
-// For disabling lockdep without recompilation.
-extern bool lockdep_enabled;
+// For disabling lockdep without recompilation. Kept in sync with the mode:
+// false when the mode is LOCKDEP_MODE_OFF and no watchdog runs.
+extern _Atomic bool lockdep_enabled;
+
+// Non-zero while the current thread runs inside lockdep. Instrumentation
+// layers must not validate lock operations made while it is raised. lockdep is
+// either preloaded or linked statically, so the initial-exec model applies.
+extern __thread unsigned lockdep_recursion __attribute__((tls_model("initial-exec")));
 
 #endif // LOCKDEP_H
 
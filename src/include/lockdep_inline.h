@@ -0,0 +1,534 @@
+// Inline instrumentation for programs that link lockdep directly instead of
+// preloading it. Each `lockdep_*` wrapper validates the operation and then
+// calls the pthread function, so with LTO the fast path is inlined into the
+// caller with no PLT or dlsym indirection.
+//
+// Defining LOCKDEP_DISABLED turns every wrapper into the plain pthread call,
+// so instrumented code compiles to exactly what it would be without lockdep.
+//
+// Defining LOCKDEP_WRAP declares that the program is linked with
+// -Wl,--wrap=<function> for the pthread functions (as the `lockdep` CMake
+// target does). The wrappers then call the `__real_` symbols so the lock is
+// not validated twice.
+//
+// The clock-based variants are only available when the program defines
+// _GNU_SOURCE, like their pthread counterparts.
+
+#ifndef LOCKDEP_INLINE_H
+#define LOCKDEP_INLINE_H
+
+#include <errno.h>
+#include <pthread.h>
+#include <semaphore.h>
+
+#ifdef LOCKDEP_DISABLED
+
+#define lockdep_mutex_lock(mutex) pthread_mutex_lock(mutex)
+#define lockdep_mutex_unlock(mutex) pthread_mutex_unlock(mutex)
+#define lockdep_mutex_trylock(mutex) pthread_mutex_trylock(mutex)
+#define lockdep_mutex_timedlock(mutex, abstime) pthread_mutex_timedlock(mutex, abstime)
+#define lockdep_mutex_clocklock(mutex, clock, abstime) pthread_mutex_clocklock(mutex, clock, abstime)
+#define lockdep_rwlock_rdlock(rwlock) pthread_rwlock_rdlock(rwlock)
+#define lockdep_rwlock_wrlock(rwlock) pthread_rwlock_wrlock(rwlock)
+#define lockdep_rwlock_unlock(rwlock) pthread_rwlock_unlock(rwlock)
+#define lockdep_rwlock_tryrdlock(rwlock) pthread_rwlock_tryrdlock(rwlock)
+#define lockdep_rwlock_trywrlock(rwlock) pthread_rwlock_trywrlock(rwlock)
+#define lockdep_rwlock_timedrdlock(rwlock, abstime) pthread_rwlock_timedrdlock(rwlock, abstime)
+#define lockdep_rwlock_timedwrlock(rwlock, abstime) pthread_rwlock_timedwrlock(rwlock, abstime)
+#define lockdep_sem_wait(sem) sem_wait(sem)
+#define lockdep_sem_trywait(sem) sem_trywait(sem)
+#define lockdep_sem_timedwait(sem, abstime) sem_timedwait(sem, abstime)
+#define lockdep_sem_post(sem) sem_post(sem)
+#define lockdep_spin_lock(lock) pthread_spin_lock(lock)
+#define lockdep_spin_trylock(lock) pthread_spin_trylock(lock)
+#define lockdep_spin_unlock(lock) pthread_spin_unlock(lock)
+#define lockdep_cond_wait(cond, mutex) pthread_cond_wait(cond, mutex)
+#define lockdep_cond_timedwait(cond, mutex, abstime) pthread_cond_timedwait(cond, mutex, abstime)
+#define lockdep_cond_signal(cond) pthread_cond_signal(cond)
+#define lockdep_cond_broadcast(cond) pthread_cond_broadcast(cond)
+
+#else // !LOCKDEP_DISABLED
+
+#include "lockdep.h"
+
+#ifdef LOCKDEP_WRAP
+#define LOCKDEP_REAL(function) __real_##function
+
+int __real_pthread_mutex_lock(pthread_mutex_t* mutex);
+int __real_pthread_mutex_unlock(pthread_mutex_t* mutex);
+int __real_pthread_mutex_trylock(pthread_mutex_t* mutex);
+int __real_pthread_mutex_timedlock(pthread_mutex_t* mutex, const struct timespec* abstime);
+#ifdef _GNU_SOURCE
+int __real_pthread_mutex_clocklock(pthread_mutex_t* mutex, clockid_t clock, const struct timespec* abstime);
+#endif
+int __real_pthread_rwlock_rdlock(pthread_rwlock_t* rwlock);
+int __real_pthread_rwlock_wrlock(pthread_rwlock_t* rwlock);
+int __real_pthread_rwlock_unlock(pthread_rwlock_t* rwlock);
+int __real_pthread_rwlock_tryrdlock(pthread_rwlock_t* rwlock);
+int __real_pthread_rwlock_trywrlock(pthread_rwlock_t* rwlock);
+int __real_pthread_rwlock_timedrdlock(pthread_rwlock_t* rwlock, const struct timespec* abstime);
+int __real_pthread_rwlock_timedwrlock(pthread_rwlock_t* rwlock, const struct timespec* abstime);
+int __real_sem_wait(sem_t* sem);
+int __real_sem_trywait(sem_t* sem);
+int __real_sem_timedwait(sem_t* sem, const struct timespec* abstime);
+int __real_sem_post(sem_t* sem);
+int __real_pthread_spin_lock(pthread_spinlock_t* lock);
+int __real_pthread_spin_trylock(pthread_spinlock_t* lock);
+int __real_pthread_spin_unlock(pthread_spinlock_t* lock);
+int __real_pthread_cond_wait(pthread_cond_t* cond, pthread_mutex_t* mutex);
+int __real_pthread_cond_timedwait(pthread_cond_t* cond, pthread_mutex_t* mutex, const struct timespec* abstime);
+int __real_pthread_cond_signal(pthread_cond_t* cond);
+int __real_pthread_cond_broadcast(pthread_cond_t* cond);
+#else
+#define LOCKDEP_REAL(function) function
+#endif
+
+// Address of the code the wrapper got inlined into, used as the callsite.
+#define LOCKDEP_THIS_IP                                                                                                \
+    ({                                                                                                                 \
+        __label__ __here;                                                                                              \
+    __here:                                                                                                            \
+        (const void*)&&__here;                                                                                         \
+    })
+
+#define LOCKDEP_LIKELY_IDLE()                                                                                          \
+    __builtin_expect(!atomic_load_explicit(&lockdep_enabled, memory_order_relaxed) || lockdep_recursion, 1)
+
+// ==================== MUTEX FUNCTIONS ====================
+
+static inline int lockdep_mutex_lock_at(pthread_mutex_t* mutex, const void* ip)
+{
+    bool tracked = !LOCKDEP_LIKELY_IDLE();
+    if (tracked) {
+        lockdep_recursion++;
+        if (!lockdep_acquire_mutex(mutex, ip)) {
+            lockdep_report_refusal("mutex_lock");
+            lockdep_recursion--;
+            return EDEADLK;
+        }
+        lockdep_publish_wait(mutex);
+        lockdep_recursion--;
+    }
+
+    int result = LOCKDEP_REAL(pthread_mutex_lock)(mutex);
+    if (tracked) lockdep_publish_acquired(mutex, result == 0, ip);
+    return result;
+}
+
+static inline int lockdep_mutex_unlock_at(pthread_mutex_t* mutex)
+{
+    int result = LOCKDEP_REAL(pthread_mutex_unlock)(mutex);
+    if (!LOCKDEP_LIKELY_IDLE()) {
+        lockdep_recursion++;
+        lockdep_publish_release(mutex);
+        lockdep_release_mutex(mutex);
+        lockdep_recursion--;
+    }
+
+    return result;
+}
+
+static inline int lockdep_mutex_trylock_at(pthread_mutex_t* mutex, const void* ip)
+{
+    int result = LOCKDEP_REAL(pthread_mutex_trylock)(mutex);
+    if (result == 0 && !LOCKDEP_LIKELY_IDLE()) {
+        lockdep_recursion++;
+        lockdep_acquire_trylock(mutex, SYNC_MUTEX, ip);
+        lockdep_recursion--;
+        lockdep_publish_acquired(mutex, true, ip);
+    }
+
+    return result;
+}
+
+static inline int lockdep_mutex_timedlock_at(pthread_mutex_t* mutex, const struct timespec* abstime, const void* ip)
+{
+    bool tracked = !LOCKDEP_LIKELY_IDLE();
+    if (tracked) {
+        lockdep_recursion++;
+        if (!lockdep_acquire_mutex(mutex, ip)) {
+            lockdep_report_refusal("mutex_timedlock");
+            lockdep_recursion--;
+            return EDEADLK;
+        }
+        lockdep_publish_wait(mutex);
+        lockdep_recursion--;
+    }
+
+    int result = LOCKDEP_REAL(pthread_mutex_timedlock)(mutex, abstime);
+    if (tracked) lockdep_publish_acquired(mutex, result == 0, ip);
+    if (result != 0 && tracked) {
+        // The wait timed out: the mutex was never taken.
+        lockdep_recursion++;
+        lockdep_release_mutex(mutex);
+        lockdep_recursion--;
+    }
+
+    return result;
+}
+
+#ifdef _GNU_SOURCE
+static inline int lockdep_mutex_clocklock_at(pthread_mutex_t* mutex, clockid_t clock, const struct timespec* abstime,
+                                             const void* ip)
+{
+    bool tracked = !LOCKDEP_LIKELY_IDLE();
+    if (tracked) {
+        lockdep_recursion++;
+        if (!lockdep_acquire_mutex(mutex, ip)) {
+            lockdep_report_refusal("mutex_clocklock");
+            lockdep_recursion--;
+            return EDEADLK;
+        }
+        lockdep_publish_wait(mutex);
+        lockdep_recursion--;
+    }
+
+    int result = LOCKDEP_REAL(pthread_mutex_clocklock)(mutex, clock, abstime);
+    if (tracked) lockdep_publish_acquired(mutex, result == 0, ip);
+    if (result != 0 && tracked) {
+        lockdep_recursion++;
+        lockdep_release_mutex(mutex);
+        lockdep_recursion--;
+    }
+
+    return result;
+}
+#endif
+
+// ==================== RWLOCK FUNCTIONS ====================
+
+static inline int lockdep_rwlock_rdlock_at(pthread_rwlock_t* rwlock, const void* ip)
+{
+    bool tracked = !LOCKDEP_LIKELY_IDLE();
+    if (tracked) {
+        lockdep_recursion++;
+        if (!lockdep_acquire_rwlock_read(rwlock, ip)) {
+            lockdep_report_refusal("rwlock_rdlock");
+            lockdep_recursion--;
+            return EDEADLK;
+        }
+        lockdep_publish_wait(rwlock);
+        lockdep_recursion--;
+    }
+
+    int result = LOCKDEP_REAL(pthread_rwlock_rdlock)(rwlock);
+    if (tracked) lockdep_publish_acquired(rwlock, result == 0, ip);
+    return result;
+}
+
+static inline int lockdep_rwlock_wrlock_at(pthread_rwlock_t* rwlock, const void* ip)
+{
+    bool tracked = !LOCKDEP_LIKELY_IDLE();
+    if (tracked) {
+        lockdep_recursion++;
+        if (!lockdep_acquire_rwlock_write(rwlock, ip)) {
+            lockdep_report_refusal("rwlock_wrlock");
+            lockdep_recursion--;
+            return EDEADLK;
+        }
+        lockdep_publish_wait(rwlock);
+        lockdep_recursion--;
+    }
+
+    int result = LOCKDEP_REAL(pthread_rwlock_wrlock)(rwlock);
+    if (tracked) lockdep_publish_acquired(rwlock, result == 0, ip);
+    return result;
+}
+
+static inline int lockdep_rwlock_unlock_at(pthread_rwlock_t* rwlock)
+{
+    int result = LOCKDEP_REAL(pthread_rwlock_unlock)(rwlock);
+    if (!LOCKDEP_LIKELY_IDLE()) {
+        lockdep_recursion++;
+        lockdep_publish_release(rwlock);
+        lockdep_release_rwlock(rwlock);
+        lockdep_recursion--;
+    }
+
+    return result;
+}
+
+static inline int lockdep_rwlock_tryrdlock_at(pthread_rwlock_t* rwlock, const void* ip)
+{
+    int result = LOCKDEP_REAL(pthread_rwlock_tryrdlock)(rwlock);
+    if (result == 0 && !LOCKDEP_LIKELY_IDLE()) {
+        lockdep_recursion++;
+        lockdep_acquire_trylock_read(rwlock, ip);
+        lockdep_recursion--;
+        lockdep_publish_acquired(rwlock, true, ip);
+    }
+
+    return result;
+}
+
+static inline int lockdep_rwlock_trywrlock_at(pthread_rwlock_t* rwlock, const void* ip)
+{
+    int result = LOCKDEP_REAL(pthread_rwlock_trywrlock)(rwlock);
+    if (result == 0 && !LOCKDEP_LIKELY_IDLE()) {
+        lockdep_recursion++;
+        lockdep_acquire_trylock(rwlock, SYNC_RWLOCK, ip);
+        lockdep_recursion--;
+        lockdep_publish_acquired(rwlock, true, ip);
+    }
+
+    return result;
+}
+
+static inline int lockdep_rwlock_timedrdlock_at(pthread_rwlock_t* rwlock, const struct timespec* abstime,
+                                                const void* ip)
+{
+    bool tracked = !LOCKDEP_LIKELY_IDLE();
+    if (tracked) {
+        lockdep_recursion++;
+        if (!lockdep_acquire_rwlock_read(rwlock, ip)) {
+            lockdep_report_refusal("rwlock_timedrdlock");
+            lockdep_recursion--;
+            return EDEADLK;
+        }
+        lockdep_publish_wait(rwlock);
+        lockdep_recursion--;
+    }
+
+    int result = LOCKDEP_REAL(pthread_rwlock_timedrdlock)(rwlock, abstime);
+    if (tracked) lockdep_publish_acquired(rwlock, result == 0, ip);
+    if (result != 0 && tracked) {
+        lockdep_recursion++;
+        lockdep_release_rwlock(rwlock);
+        lockdep_recursion--;
+    }
+
+    return result;
+}
+
+static inline int lockdep_rwlock_timedwrlock_at(pthread_rwlock_t* rwlock, const struct timespec* abstime,
+                                                const void* ip)
+{
+    bool tracked = !LOCKDEP_LIKELY_IDLE();
+    if (tracked) {
+        lockdep_recursion++;
+        if (!lockdep_acquire_rwlock_write(rwlock, ip)) {
+            lockdep_report_refusal("rwlock_timedwrlock");
+            lockdep_recursion--;
+            return EDEADLK;
+        }
+        lockdep_publish_wait(rwlock);
+        lockdep_recursion--;
+    }
+
+    int result = LOCKDEP_REAL(pthread_rwlock_timedwrlock)(rwlock, abstime);
+    if (tracked) lockdep_publish_acquired(rwlock, result == 0, ip);
+    if (result != 0 && tracked) {
+        lockdep_recursion++;
+        lockdep_release_rwlock(rwlock);
+        lockdep_recursion--;
+    }
+
+    return result;
+}
+
+// ==================== SEMAPHORE FUNCTIONS ====================
+
+static inline int lockdep_sem_wait_at(sem_t* sem, const void* ip)
+{
+    if (!LOCKDEP_LIKELY_IDLE()) {
+        lockdep_recursion++;
+        if (!lockdep_acquire_semaphore(sem, ip)) {
+            lockdep_report_refusal("sem_wait");
+            lockdep_recursion--;
+            return EDEADLK;
+        }
+        lockdep_recursion--;
+    }
+
+    return LOCKDEP_REAL(sem_wait)(sem);
+}
+
+static inline int lockdep_sem_trywait_at(sem_t* sem, const void* ip)
+{
+    int result = LOCKDEP_REAL(sem_trywait)(sem);
+    if (result == 0 && !LOCKDEP_LIKELY_IDLE()) {
+        lockdep_recursion++;
+        lockdep_acquire_trylock(sem, SYNC_SEMAPHORE, ip);
+        lockdep_recursion--;
+    }
+
+    return result;
+}
+
+static inline int lockdep_sem_post_at(sem_t* sem)
+{
+    int result = LOCKDEP_REAL(sem_post)(sem);
+    if (!LOCKDEP_LIKELY_IDLE()) {
+        lockdep_recursion++;
+        lockdep_release_semaphore(sem);
+        lockdep_recursion--;
+    }
+
+    return result;
+}
+
+static inline int lockdep_sem_timedwait_at(sem_t* sem, const struct timespec* abstime, const void* ip)
+{
+    bool tracked = !LOCKDEP_LIKELY_IDLE();
+    if (tracked) {
+        lockdep_recursion++;
+        if (!lockdep_acquire_semaphore(sem, ip)) {
+            lockdep_report_refusal("sem_timedwait");
+            lockdep_recursion--;
+            return EDEADLK;
+        }
+        lockdep_recursion--;
+    }
+
+    int result = LOCKDEP_REAL(sem_timedwait)(sem, abstime);
+    if (result != 0 && tracked) {
+        lockdep_recursion++;
+        lockdep_release_semaphore(sem);
+        lockdep_recursion--;
+    }
+
+    return result;
+}
+
+// ==================== SPINLOCK FUNCTIONS ====================
+
+static inline int lockdep_spin_lock_at(pthread_spinlock_t* lock, const void* ip)
+{
+    bool tracked = !LOCKDEP_LIKELY_IDLE();
+    if (tracked) {
+        lockdep_recursion++;
+        if (!lockdep_acquire_spinlock(lock, ip)) {
+            lockdep_report_refusal("spin_lock");
+            lockdep_recursion--;
+            return EDEADLK;
+        }
+        lockdep_publish_wait(lock);
+        lockdep_recursion--;
+    }
+
+    int result = LOCKDEP_REAL(pthread_spin_lock)(lock);
+    if (tracked) lockdep_publish_acquired(lock, result == 0, ip);
+    return result;
+}
+
+static inline int lockdep_spin_trylock_at(pthread_spinlock_t* lock, const void* ip)
+{
+    int result = LOCKDEP_REAL(pthread_spin_trylock)(lock);
+    if (result == 0 && !LOCKDEP_LIKELY_IDLE()) {
+        lockdep_recursion++;
+        lockdep_acquire_trylock(lock, SYNC_SPINLOCK, ip);
+        lockdep_recursion--;
+        lockdep_publish_acquired(lock, true, ip);
+    }
+
+    return result;
+}
+
+static inline int lockdep_spin_unlock_at(pthread_spinlock_t* lock)
+{
+    int result = LOCKDEP_REAL(pthread_spin_unlock)(lock);
+    if (!LOCKDEP_LIKELY_IDLE()) {
+        lockdep_recursion++;
+        lockdep_publish_release(lock);
+        lockdep_release_spinlock(lock);
+        lockdep_recursion--;
+    }
+
+    return result;
+}
+
+// ==================== CONDITION VARIABLE FUNCTIONS ====================
+
+static inline int lockdep_cond_wait_at(pthread_cond_t* cond, pthread_mutex_t* mutex, const void* ip)
+{
+    bool tracked = !LOCKDEP_LIKELY_IDLE();
+    if (tracked) {
+        lockdep_recursion++;
+        if (!lockdep_wait_condvar(cond, mutex, ip)) {
+            lockdep_report_refusal("cond_wait");
+            lockdep_recursion--;
+            return EDEADLK;
+        }
+        lockdep_publish_release(mutex);
+        lockdep_recursion--;
+    }
+
+    int result = LOCKDEP_REAL(pthread_cond_wait)(cond, mutex);
+    if (tracked) lockdep_publish_acquired(mutex, true, ip);
+    return result;
+}
+
+static inline int lockdep_cond_timedwait_at(pthread_cond_t* cond, pthread_mutex_t* mutex,
+                                            const struct timespec* abstime, const void* ip)
+{
+    bool tracked = !LOCKDEP_LIKELY_IDLE();
+    if (tracked) {
+        lockdep_recursion++;
+        if (!lockdep_wait_condvar(cond, mutex, ip)) {
+            lockdep_report_refusal("cond_timedwait");
+            lockdep_recursion--;
+            return EDEADLK;
+        }
+        lockdep_publish_release(mutex);
+        lockdep_recursion--;
+    }
+
+    int result = LOCKDEP_REAL(pthread_cond_timedwait)(cond, mutex, abstime);
+    if (tracked) lockdep_publish_acquired(mutex, true, ip);
+    return result;
+}
+
+static inline int lockdep_cond_signal_at(pthread_cond_t* cond)
+{
+    int result = LOCKDEP_REAL(pthread_cond_signal)(cond);
+    if (!LOCKDEP_LIKELY_IDLE()) {
+        lockdep_recursion++;
+        lockdep_signal_condvar(cond);
+        lockdep_recursion--;
+    }
+
+    return result;
+}
+
+static inline int lockdep_cond_broadcast_at(pthread_cond_t* cond)
+{
+    int result = LOCKDEP_REAL(pthread_cond_broadcast)(cond);
+    if (!LOCKDEP_LIKELY_IDLE()) {
+        lockdep_recursion++;
+        lockdep_signal_condvar(cond);
+        lockdep_recursion--;
+    }
+
+    return result;
+}
+
+// ==================== WRAPPERS ====================
+
+#define lockdep_mutex_lock(mutex) lockdep_mutex_lock_at((mutex), LOCKDEP_THIS_IP)
+#define lockdep_mutex_unlock(mutex) lockdep_mutex_unlock_at(mutex)
+#define lockdep_mutex_trylock(mutex) lockdep_mutex_trylock_at((mutex), LOCKDEP_THIS_IP)
+#define lockdep_mutex_timedlock(mutex, abstime) lockdep_mutex_timedlock_at((mutex), (abstime), LOCKDEP_THIS_IP)
+#define lockdep_mutex_clocklock(mutex, clock, abstime)                                                                 \
+    lockdep_mutex_clocklock_at((mutex), (clock), (abstime), LOCKDEP_THIS_IP)
+#define lockdep_rwlock_rdlock(rwlock) lockdep_rwlock_rdlock_at((rwlock), LOCKDEP_THIS_IP)
+#define lockdep_rwlock_wrlock(rwlock) lockdep_rwlock_wrlock_at((rwlock), LOCKDEP_THIS_IP)
+#define lockdep_rwlock_unlock(rwlock) lockdep_rwlock_unlock_at(rwlock)
+#define lockdep_rwlock_tryrdlock(rwlock) lockdep_rwlock_tryrdlock_at((rwlock), LOCKDEP_THIS_IP)
+#define lockdep_rwlock_trywrlock(rwlock) lockdep_rwlock_trywrlock_at((rwlock), LOCKDEP_THIS_IP)
+#define lockdep_rwlock_timedrdlock(rwlock, abstime) lockdep_rwlock_timedrdlock_at((rwlock), (abstime), LOCKDEP_THIS_IP)
+#define lockdep_rwlock_timedwrlock(rwlock, abstime) lockdep_rwlock_timedwrlock_at((rwlock), (abstime), LOCKDEP_THIS_IP)
+#define lockdep_sem_wait(sem) lockdep_sem_wait_at((sem), LOCKDEP_THIS_IP)
+#define lockdep_sem_trywait(sem) lockdep_sem_trywait_at((sem), LOCKDEP_THIS_IP)
+#define lockdep_sem_timedwait(sem, abstime) lockdep_sem_timedwait_at((sem), (abstime), LOCKDEP_THIS_IP)
+#define lockdep_sem_post(sem) lockdep_sem_post_at(sem)
+#define lockdep_spin_lock(lock) lockdep_spin_lock_at((lock), LOCKDEP_THIS_IP)
+#define lockdep_spin_trylock(lock) lockdep_spin_trylock_at((lock), LOCKDEP_THIS_IP)
+#define lockdep_spin_unlock(lock) lockdep_spin_unlock_at(lock)
+#define lockdep_cond_wait(cond, mutex) lockdep_cond_wait_at((cond), (mutex), LOCKDEP_THIS_IP)
+#define lockdep_cond_timedwait(cond, mutex, abstime) lockdep_cond_timedwait_at(cond, mutex, abstime, LOCKDEP_THIS_IP)
+#define lockdep_cond_signal(cond) lockdep_cond_signal_at(cond)
+#define lockdep_cond_broadcast(cond) lockdep_cond_broadcast_at(cond)
+
+#endif // LOCKDEP_DISABLED
+
+#endif // LOCKDEP_INLINE_H
@@ -1,126 +1,159 @@
+#define _GNU_SOURCE
 #include <asm-generic/errno-base.h>
 #include <asm-generic/errno.h>
 #include <dlfcn.h>
 #include <pthread.h>
 #include <semaphore.h>
+#include <stdatomic.h>
 #include <stdio.h>
+#include <stdlib.h>
 
 #include "../include/lockdep.h"
 
-static int (*real_pthread_mutex_lock)(pthread_mutex_t*) = NULL;
-static int (*real_pthread_mutex_unlock)(pthread_mutex_t*) = NULL;
-static int (*real_pthread_mutex_trylock)(pthread_mutex_t*) = NULL;
-
-static int (*real_pthread_rwlock_rdlock)(pthread_rwlock_t*) = NULL;
-static int (*real_pthread_rwlock_wrlock)(pthread_rwlock_t*) = NULL;
-static int (*real_pthread_rwlock_unlock)(pthread_rwlock_t*) = NULL;
-static int (*real_pthread_rwlock_tryrdlock)(pthread_rwlock_t*) = NULL;
-static int (*real_pthread_rwlock_trywrlock)(pthread_rwlock_t*) = NULL;
-
-static int (*real_sem_wait)(sem_t*) = NULL;
-static int (*real_sem_trywait)(sem_t*) = NULL;
-static int (*real_sem_post)(sem_t*) = NULL;
+/// The real functions are resolved once, by the constructor. Until then each
+/// pointer targets a bootstrap stub that resolves them all and forwards the
+/// call, which covers locks taken by constructors that run before ours.
+#define REAL_FUNCTION(name, params, args)                                                                              \
+    static int bootstrap_##name params;                                                                                \
+    static int(*real_##name) params = bootstrap_##name;                                                                \
+    static int bootstrap_##name params                                                                                 \
+    {                                                                                                                  \
+        init_real_functions();                                                                                         \
+        return real_##name args;                                                                                       \
+    }
 
-static int (*real_pthread_cond_wait)(pthread_cond_t*, pthread_mutex_t*) = NULL;
-static int (*real_pthread_cond_timedwait)(pthread_cond_t*, pthread_mutex_t*, const struct timespec*) = NULL;
-static int (*real_pthread_cond_signal)(pthread_cond_t*) = NULL;
-static int (*real_pthread_cond_broadcast)(pthread_cond_t*) = NULL;
+static void init_real_functions(void);
+
+REAL_FUNCTION(pthread_mutex_lock, (pthread_mutex_t * mutex), (mutex))
+REAL_FUNCTION(pthread_mutex_unlock, (pthread_mutex_t * mutex), (mutex))
+REAL_FUNCTION(pthread_mutex_trylock, (pthread_mutex_t * mutex), (mutex))
+REAL_FUNCTION(pthread_mutex_timedlock, (pthread_mutex_t * mutex, const struct timespec* abstime), (mutex, abstime))
+REAL_FUNCTION(pthread_mutex_clocklock, (pthread_mutex_t * mutex, clockid_t clock, const struct timespec* abstime),
+              (mutex, clock, abstime))
+
+REAL_FUNCTION(pthread_rwlock_rdlock, (pthread_rwlock_t * rwlock), (rwlock))
+REAL_FUNCTION(pthread_rwlock_wrlock, (pthread_rwlock_t * rwlock), (rwlock))
+REAL_FUNCTION(pthread_rwlock_unlock, (pthread_rwlock_t * rwlock), (rwlock))
+REAL_FUNCTION(pthread_rwlock_tryrdlock, (pthread_rwlock_t * rwlock), (rwlock))
+REAL_FUNCTION(pthread_rwlock_trywrlock, (pthread_rwlock_t * rwlock), (rwlock))
+REAL_FUNCTION(pthread_rwlock_timedrdlock, (pthread_rwlock_t * rwlock, const struct timespec* abstime),
+              (rwlock, abstime))
+REAL_FUNCTION(pthread_rwlock_timedwrlock, (pthread_rwlock_t * rwlock, const struct timespec* abstime),
+              (rwlock, abstime))
+
+REAL_FUNCTION(sem_wait, (sem_t * sem), (sem))
+REAL_FUNCTION(sem_trywait, (sem_t * sem), (sem))
+REAL_FUNCTION(sem_timedwait, (sem_t * sem, const struct timespec* abstime), (sem, abstime))
+REAL_FUNCTION(sem_post, (sem_t * sem), (sem))
+
+REAL_FUNCTION(pthread_spin_lock, (pthread_spinlock_t * lock), (lock))
+REAL_FUNCTION(pthread_spin_trylock, (pthread_spinlock_t * lock), (lock))
+REAL_FUNCTION(pthread_spin_unlock, (pthread_spinlock_t * lock), (lock))
+
+REAL_FUNCTION(pthread_cond_wait, (pthread_cond_t * cond, pthread_mutex_t* mutex), (cond, mutex))
+REAL_FUNCTION(pthread_cond_timedwait, (pthread_cond_t * cond, pthread_mutex_t* mutex, const struct timespec* abstime),
+              (cond, mutex, abstime))
+REAL_FUNCTION(pthread_cond_signal, (pthread_cond_t * cond), (cond))
+REAL_FUNCTION(pthread_cond_broadcast, (pthread_cond_t * cond), (cond))
+
+static void* resolve(const char* name)
+{
+    void* function = dlsym(RTLD_NEXT, name);
+    if (!function) {
+        fprintf(stderr, "[LOCKDEP] Cannot resolve %s, aborting\n", name);
+        abort();
+    }
+    return function;
+}
 
 /// This interposes the real pthread functions to add lockdep validation
 static void init_real_functions(void)
 {
-    if (!real_pthread_mutex_lock) {
-        real_pthread_mutex_lock = dlsym(RTLD_NEXT, "pthread_mutex_lock");
-    }
-    if (!real_pthread_mutex_unlock) {
-        real_pthread_mutex_unlock = dlsym(RTLD_NEXT, "pthread_mutex_unlock");
-    }
-    if (!real_pthread_mutex_trylock) {
-        real_pthread_mutex_trylock = dlsym(RTLD_NEXT, "pthread_mutex_trylock");
-    }
+    real_pthread_mutex_lock = resolve("pthread_mutex_lock");
+    real_pthread_mutex_unlock = resolve("pthread_mutex_unlock");
+    real_pthread_mutex_trylock = resolve("pthread_mutex_trylock");
+    real_pthread_mutex_timedlock = resolve("pthread_mutex_timedlock");
+    real_pthread_mutex_clocklock = resolve("pthread_mutex_clocklock");
 
     // RWLock functions
-    if (!real_pthread_rwlock_rdlock) {
-        real_pthread_rwlock_rdlock = dlsym(RTLD_NEXT, "pthread_rwlock_rdlock");
-    }
-    if (!real_pthread_rwlock_wrlock) {
-        real_pthread_rwlock_wrlock = dlsym(RTLD_NEXT, "pthread_rwlock_wrlock");
-    }
-    if (!real_pthread_rwlock_unlock) {
-        real_pthread_rwlock_unlock = dlsym(RTLD_NEXT, "pthread_rwlock_unlock");
-    }
-    if (!real_pthread_rwlock_tryrdlock) {
-        real_pthread_rwlock_tryrdlock = dlsym(RTLD_NEXT, "pthread_rwlock_tryrdlock");
-    }
-    if (!real_pthread_rwlock_trywrlock) {
-        real_pthread_rwlock_trywrlock = dlsym(RTLD_NEXT, "pthread_rwlock_trywrlock");
-    }
+    real_pthread_rwlock_rdlock = resolve("pthread_rwlock_rdlock");
+    real_pthread_rwlock_wrlock = resolve("pthread_rwlock_wrlock");
+    real_pthread_rwlock_unlock = resolve("pthread_rwlock_unlock");
+    real_pthread_rwlock_tryrdlock = resolve("pthread_rwlock_tryrdlock");
+    real_pthread_rwlock_trywrlock = resolve("pthread_rwlock_trywrlock");
+    real_pthread_rwlock_timedrdlock = resolve("pthread_rwlock_timedrdlock");
+    real_pthread_rwlock_timedwrlock = resolve("pthread_rwlock_timedwrlock");
 
     // Semaphore functions
-    if (!real_sem_wait) {
-        real_sem_wait = dlsym(RTLD_NEXT, "sem_wait");
-    }
-    if (!real_sem_trywait) {
-        real_sem_trywait = dlsym(RTLD_NEXT, "sem_trywait");
-    }
-    if (!real_sem_post) {
-        real_sem_post = dlsym(RTLD_NEXT, "sem_post");
-    }
+    real_sem_wait = resolve("sem_wait");
+    real_sem_trywait = resolve("sem_trywait");
+    real_sem_timedwait = resolve("sem_timedwait");
+    real_sem_post = resolve("sem_post");
+
+    // Spinlock functions
+    real_pthread_spin_lock = resolve("pthread_spin_lock");
+    real_pthread_spin_trylock = resolve("pthread_spin_trylock");
+    real_pthread_spin_unlock = resolve("pthread_spin_unlock");
 
     // Condition variable functions
-    if (!real_pthread_cond_wait) {
-        real_pthread_cond_wait = dlsym(RTLD_NEXT, "pthread_cond_wait");
-    }
-    if (!real_pthread_cond_timedwait) {
-        real_pthread_cond_timedwait = dlsym(RTLD_NEXT, "pthread_cond_timedwait");
-    }
-    if (!real_pthread_cond_signal) {
-        real_pthread_cond_signal = dlsym(RTLD_NEXT, "pthread_cond_signal");
-    }
-    if (!real_pthread_cond_broadcast) {
-        real_pthread_cond_broadcast = dlsym(RTLD_NEXT, "pthread_cond_broadcast");
-    }
+    real_pthread_cond_wait = resolve("pthread_cond_wait");
+    real_pthread_cond_timedwait = resolve("pthread_cond_timedwait");
+    real_pthread_cond_signal = resolve("pthread_cond_signal");
+    real_pthread_cond_broadcast = resolve("pthread_cond_broadcast");
 }
 
+/// A single, well-predicted branch decides whether lockdep has anything to do.
+/// When it does not, the interposer tail-calls the real function.
+#define LOCKDEP_IDLE() __builtin_expect(!atomic_load_explicit(&lockdep_enabled, memory_order_relaxed), 1)
+
 __attribute__((constructor)) static void lockdep_constructor(void)
 {
-    lockdep_init();
     init_real_functions();
+
+    lockdep_recursion++;
+    lockdep_init();
+    lockdep_recursion--;
 }
 
-/// The lockdep uses a mutex to protect its internal state, so we use this to
-/// avoid recursing lockdep validation across itself.
-static __thread bool in_interpose = false;
+__attribute__((destructor)) static void lockdep_destructor(void)
+{
+    lockdep_recursion++;
+    lockdep_fini();
+    lockdep_recursion--;
+}
 
 // ==================== MUTEX FUNCTIONS ====================
 
 int pthread_mutex_lock(pthread_mutex_t* mutex)
 {
-    init_real_functions();
+    if (LOCKDEP_IDLE()) return real_pthread_mutex_lock(mutex);
 
-    if (lockdep_enabled && !in_interpose) {
-        in_interpose = true;
-        if (!lockdep_acquire_mutex(mutex)) {
-            fprintf(stderr, "[LOCKDEP] DEADLOCK DETECTED\n");
-            in_interpose = false;
+    if (!lockdep_recursion) {
+        lockdep_recursion++;
+        if (!lockdep_acquire_mutex(mutex, __builtin_return_address(0))) {
+            lockdep_report_refusal("mutex_lock");
+            lockdep_recursion--;
             return EDEADLK;
         }
-        in_interpose = false;
+        lockdep_publish_wait(mutex);
+        lockdep_recursion--;
     }
 
     int result = real_pthread_mutex_lock(mutex);
+    if (!lockdep_recursion) lockdep_publish_acquired(mutex, result == 0, __builtin_return_address(0));
     return result;
 }
 
 int pthread_mutex_unlock(pthread_mutex_t* mutex)
 {
-    init_real_functions();
+    if (LOCKDEP_IDLE()) return real_pthread_mutex_unlock(mutex);
 
     int result = real_pthread_mutex_unlock(mutex);
-    if (lockdep_enabled && !in_interpose) {
-        in_interpose = true;
+    if (!lockdep_recursion) {
+        lockdep_recursion++;
+        lockdep_publish_release(mutex);
         lockdep_release_mutex(mutex);
-        in_interpose = false;
+        lockdep_recursion--;
     }
 
     return result;
@@ -128,18 +161,69 @@ int pthread_mutex_unlock(pthread_mutex_t* mutex)
 
 int pthread_mutex_trylock(pthread_mutex_t* mutex)
 {
-    init_real_functions();
+    if (LOCKDEP_IDLE()) return real_pthread_mutex_trylock(mutex);
 
     int result = real_pthread_mutex_trylock(mutex);
-    if (result == 0 && lockdep_enabled && !in_interpose) {
-        in_interpose = true;
-        if (!lockdep_acquire_mutex(mutex)) {
-            fprintf(stderr, "[LOCKDEP] DEADLOCK DETECTED on trylock - unlocking and failing\n");
-            real_pthread_mutex_unlock(mutex);
-            in_interpose = false;
-            return EBUSY;
+    if (result == 0 && !lockdep_recursion) {
+        lockdep_recursion++;
+        lockdep_acquire_trylock(mutex, SYNC_MUTEX, __builtin_return_address(0));
+        lockdep_publish_acquired(mutex, true, __builtin_return_address(0));
+        lockdep_recursion--;
+    }
+
+    return result;
+}
+
+int pthread_mutex_timedlock(pthread_mutex_t* mutex, const struct timespec* abstime)
+{
+    if (LOCKDEP_IDLE()) return real_pthread_mutex_timedlock(mutex, abstime);
+
+    bool tracked = !lockdep_recursion;
+    if (tracked) {
+        lockdep_recursion++;
+        if (!lockdep_acquire_mutex(mutex, __builtin_return_address(0))) {
+            lockdep_report_refusal("mutex_timedlock");
+            lockdep_recursion--;
+            return EDEADLK;
+        }
+        lockdep_publish_wait(mutex);
+        lockdep_recursion--;
+    }
+
+    int result = real_pthread_mutex_timedlock(mutex, abstime);
+    if (tracked) lockdep_publish_acquired(mutex, result == 0, __builtin_return_address(0));
+    if (result != 0 && tracked) {
+        // The wait timed out: the mutex was never taken.
+        lockdep_recursion++;
+        lockdep_release_mutex(mutex);
+        lockdep_recursion--;
+    }
+
+    return result;
+}
+
+int pthread_mutex_clocklock(pthread_mutex_t* mutex, clockid_t clock, const struct timespec* abstime)
+{
+    if (LOCKDEP_IDLE()) return real_pthread_mutex_clocklock(mutex, clock, abstime);
+
+    bool tracked = !lockdep_recursion;
+    if (tracked) {
+        lockdep_recursion++;
+        if (!lockdep_acquire_mutex(mutex, __builtin_return_address(0))) {
+            lockdep_report_refusal("mutex_clocklock");
+            lockdep_recursion--;
+            return EDEADLK;
         }
-        in_interpose = false;
+        lockdep_publish_wait(mutex);
+        lockdep_recursion--;
+    }
+
+    int result = real_pthread_mutex_clocklock(mutex, clock, abstime);
+    if (tracked) lockdep_publish_acquired(mutex, result == 0, __builtin_return_address(0));
+    if (result != 0 && tracked) {
+        lockdep_recursion++;
+        lockdep_release_mutex(mutex);
+        lockdep_recursion--;
     }
 
     return result;
@@ -149,49 +233,54 @@ int pthread_mutex_trylock(pthread_mutex_t* mutex)
 
 int pthread_rwlock_rdlock(pthread_rwlock_t* rwlock)
 {
-    init_real_functions();
+    if (LOCKDEP_IDLE()) return real_pthread_rwlock_rdlock(rwlock);
 
-    if (lockdep_enabled && !in_interpose) {
-        in_interpose = true;
-        if (!lockdep_acquire_rwlock_read(rwlock)) {
-            fprintf(stderr, "[LOCKDEP] DEADLOCK DETECTED on rwlock_rdlock\n");
-            in_interpose = false;
+    if (!lockdep_recursion) {
+        lockdep_recursion++;
+        if (!lockdep_acquire_rwlock_read(rwlock, __builtin_return_address(0))) {
+            lockdep_report_refusal("rwlock_rdlock");
+            lockdep_recursion--;
             return EDEADLK;
         }
-        in_interpose = false;
+        lockdep_publish_wait(rwlock);
+        lockdep_recursion--;
     }
 
     int result = real_pthread_rwlock_rdlock(rwlock);
+    if (!lockdep_recursion) lockdep_publish_acquired(rwlock, result == 0, __builtin_return_address(0));
     return result;
 }
 
 int pthread_rwlock_wrlock(pthread_rwlock_t* rwlock)
 {
-    init_real_functions();
+    if (LOCKDEP_IDLE()) return real_pthread_rwlock_wrlock(rwlock);
 
-    if (lockdep_enabled && !in_interpose) {
-        in_interpose = true;
-        if (!lockdep_acquire_rwlock_write(rwlock)) {
-            fprintf(stderr, "[LOCKDEP] DEADLOCK DETECTED on rwlock_wrlock\n");
-            in_interpose = false;
+    if (!lockdep_recursion) {
+        lockdep_recursion++;
+        if (!lockdep_acquire_rwlock_write(rwlock, __builtin_return_address(0))) {
+            lockdep_report_refusal("rwlock_wrlock");
+            lockdep_recursion--;
             return EDEADLK;
         }
-        in_interpose = false;
+        lockdep_publish_wait(rwlock);
+        lockdep_recursion--;
     }
 
     int result = real_pthread_rwlock_wrlock(rwlock);
+    if (!lockdep_recursion) lockdep_publish_acquired(rwlock, result == 0, __builtin_return_address(0));
     return result;
 }
 
 int pthread_rwlock_unlock(pthread_rwlock_t* rwlock)
 {
-    init_real_functions();
+    if (LOCKDEP_IDLE()) return real_pthread_rwlock_unlock(rwlock);
 
     int result = real_pthread_rwlock_unlock(rwlock);
-    if (lockdep_enabled && !in_interpose) {
-        in_interpose = true;
+    if (!lockdep_recursion) {
+        lockdep_recursion++;
+        lockdep_publish_release(rwlock);
         lockdep_release_rwlock(rwlock);
-        in_interpose = false;
+        lockdep_recursion--;
     }
 
     return result;
@@ -199,18 +288,14 @@ int pthread_rwlock_unlock(pthread_rwlock_t* rwlock)
 
 int pthread_rwlock_tryrdlock(pthread_rwlock_t* rwlock)
 {
-    init_real_functions();
+    if (LOCKDEP_IDLE()) return real_pthread_rwlock_tryrdlock(rwlock);
 
     int result = real_pthread_rwlock_tryrdlock(rwlock);
-    if (result == 0 && lockdep_enabled && !in_interpose) {
-        in_interpose = true;
-        if (!lockdep_acquire_rwlock_read(rwlock)) {
-            fprintf(stderr, "[LOCKDEP] DEADLOCK DETECTED on rwlock_tryrdlock - unlocking and failing\n");
-            real_pthread_rwlock_unlock(rwlock);
-            in_interpose = false;
-            return EBUSY;
-        }
-        in_interpose = false;
+    if (result == 0 && !lockdep_recursion) {
+        lockdep_recursion++;
+        lockdep_acquire_trylock_read(rwlock, __builtin_return_address(0));
+        lockdep_publish_acquired(rwlock, true, __builtin_return_address(0));
+        lockdep_recursion--;
     }
 
     return result;
@@ -218,18 +303,68 @@ int pthread_rwlock_tryrdlock(pthread_rwlock_t* rwlock)
 
 int pthread_rwlock_trywrlock(pthread_rwlock_t* rwlock)
 {
-    init_real_functions();
+    if (LOCKDEP_IDLE()) return real_pthread_rwlock_trywrlock(rwlock);
 
     int result = real_pthread_rwlock_trywrlock(rwlock);
-    if (result == 0 && lockdep_enabled && !in_interpose) {
-        in_interpose = true;
-        if (!lockdep_acquire_rwlock_write(rwlock)) {
-            fprintf(stderr, "[LOCKDEP] DEADLOCK DETECTED on rwlock_trywrlock - unlocking and failing\n");
-            real_pthread_rwlock_unlock(rwlock);
-            in_interpose = false;
-            return EBUSY;
+    if (result == 0 && !lockdep_recursion) {
+        lockdep_recursion++;
+        lockdep_acquire_trylock(rwlock, SYNC_RWLOCK, __builtin_return_address(0));
+        lockdep_publish_acquired(rwlock, true, __builtin_return_address(0));
+        lockdep_recursion--;
+    }
+
+    return result;
+}
+
+int pthread_rwlock_timedrdlock(pthread_rwlock_t* rwlock, const struct timespec* abstime)
+{
+    if (LOCKDEP_IDLE()) return real_pthread_rwlock_timedrdlock(rwlock, abstime);
+
+    bool tracked = !lockdep_recursion;
+    if (tracked) {
+        lockdep_recursion++;
+        if (!lockdep_acquire_rwlock_read(rwlock, __builtin_return_address(0))) {
+            lockdep_report_refusal("rwlock_timedrdlock");
+            lockdep_recursion--;
+            return EDEADLK;
+        }
+        lockdep_publish_wait(rwlock);
+        lockdep_recursion--;
+    }
+
+    int result = real_pthread_rwlock_timedrdlock(rwlock, abstime);
+    if (tracked) lockdep_publish_acquired(rwlock, result == 0, __builtin_return_address(0));
+    if (result != 0 && tracked) {
+        lockdep_recursion++;
+        lockdep_release_rwlock(rwlock);
+        lockdep_recursion--;
+    }
+
+    return result;
+}
+
+int pthread_rwlock_timedwrlock(pthread_rwlock_t* rwlock, const struct timespec* abstime)
+{
+    if (LOCKDEP_IDLE()) return real_pthread_rwlock_timedwrlock(rwlock, abstime);
+
+    bool tracked = !lockdep_recursion;
+    if (tracked) {
+        lockdep_recursion++;
+        if (!lockdep_acquire_rwlock_write(rwlock, __builtin_return_address(0))) {
+            lockdep_report_refusal("rwlock_timedwrlock");
+            lockdep_recursion--;
+            return EDEADLK;
         }
-        in_interpose = false;
+        lockdep_publish_wait(rwlock);
+        lockdep_recursion--;
+    }
+
+    int result = real_pthread_rwlock_timedwrlock(rwlock, abstime);
+    if (tracked) lockdep_publish_acquired(rwlock, result == 0, __builtin_return_address(0));
+    if (result != 0 && tracked) {
+        lockdep_recursion++;
+        lockdep_release_rwlock(rwlock);
+        lockdep_recursion--;
     }
 
     return result;
@@ -239,16 +374,16 @@ int pthread_rwlock_trywrlock(pthread_rwlock_t* rwlock)
 
 int sem_wait(sem_t* sem)
 {
-    init_real_functions();
+    if (LOCKDEP_IDLE()) return real_sem_wait(sem);
 
-    if (lockdep_enabled && !in_interpose) {
-        in_interpose = true;
-        if (!lockdep_acquire_semaphore(sem)) {
-            fprintf(stderr, "[LOCKDEP] DEADLOCK DETECTED on sem_wait\n");
-            in_interpose = false;
+    if (!lockdep_recursion) {
+        lockdep_recursion++;
+        if (!lockdep_acquire_semaphore(sem, __builtin_return_address(0))) {
+            lockdep_report_refusal("sem_wait");
+            lockdep_recursion--;
             return EDEADLK;
         }
-        in_interpose = false;
+        lockdep_recursion--;
     }
 
     int result = real_sem_wait(sem);
@@ -257,17 +392,13 @@ int sem_wait(sem_t* sem)
 
 int sem_trywait(sem_t* sem)
 {
-    init_real_functions();
+    if (LOCKDEP_IDLE()) return real_sem_trywait(sem);
 
     int result = real_sem_trywait(sem);
-    if (result == 0 && lockdep_enabled && !in_interpose) {
-        in_interpose = true;
-        if (!lockdep_acquire_semaphore(sem)) {
-            fprintf(stderr, "[LOCKDEP] DEADLOCK DETECTED on sem_trywait\n");
-            in_interpose = false;
-            return EAGAIN;
-        }
-        in_interpose = false;
+    if (result == 0 && !lockdep_recursion) {
+        lockdep_recursion++;
+        lockdep_acquire_trylock(sem, SYNC_SEMAPHORE, __builtin_return_address(0));
+        lockdep_recursion--;
     }
 
     return result;
@@ -275,13 +406,90 @@ int sem_trywait(sem_t* sem)
 
 int sem_post(sem_t* sem)
 {
-    init_real_functions();
+    if (LOCKDEP_IDLE()) return real_sem_post(sem);
 
     int result = real_sem_post(sem);
-    if (lockdep_enabled && !in_interpose) {
-        in_interpose = true;
+    if (!lockdep_recursion) {
+        lockdep_recursion++;
+        lockdep_release_semaphore(sem);
+        lockdep_recursion--;
+    }
+
+    return result;
+}
+
+int sem_timedwait(sem_t* sem, const struct timespec* abstime)
+{
+    if (LOCKDEP_IDLE()) return real_sem_timedwait(sem, abstime);
+
+    bool tracked = !lockdep_recursion;
+    if (tracked) {
+        lockdep_recursion++;
+        if (!lockdep_acquire_semaphore(sem, __builtin_return_address(0))) {
+            lockdep_report_refusal("sem_timedwait");
+            lockdep_recursion--;
+            return EDEADLK;
+        }
+        lockdep_recursion--;
+    }
+
+    int result = real_sem_timedwait(sem, abstime);
+    if (result != 0 && tracked) {
+        lockdep_recursion++;
         lockdep_release_semaphore(sem);
-        in_interpose = false;
+        lockdep_recursion--;
+    }
+
+    return result;
+}
+
+// ==================== SPINLOCK FUNCTIONS ====================
+
+int pthread_spin_lock(pthread_spinlock_t* lock)
+{
+    if (LOCKDEP_IDLE()) return real_pthread_spin_lock(lock);
+
+    if (!lockdep_recursion) {
+        lockdep_recursion++;
+        if (!lockdep_acquire_spinlock(lock, __builtin_return_address(0))) {
+            lockdep_report_refusal("spin_lock");
+            lockdep_recursion--;
+            return EDEADLK;
+        }
+        lockdep_publish_wait(lock);
+        lockdep_recursion--;
+    }
+
+    int result = real_pthread_spin_lock(lock);
+    if (!lockdep_recursion) lockdep_publish_acquired(lock, result == 0, __builtin_return_address(0));
+    return result;
+}
+
+int pthread_spin_trylock(pthread_spinlock_t* lock)
+{
+    if (LOCKDEP_IDLE()) return real_pthread_spin_trylock(lock);
+
+    int result = real_pthread_spin_trylock(lock);
+    if (result == 0 && !lockdep_recursion) {
+        lockdep_recursion++;
+        lockdep_acquire_trylock(lock, SYNC_SPINLOCK, __builtin_return_address(0));
+        lockdep_publish_acquired(lock, true, __builtin_return_address(0));
+        lockdep_recursion--;
+    }
+
+    return result;
+}
+
+int pthread_spin_unlock(pthread_spinlock_t* lock)
+{
+    if (LOCKDEP_IDLE()) return real_pthread_spin_unlock(lock);
+
+    int result = real_pthread_spin_unlock(lock);
+    if (!lockdep_recursion) {
+        lockdep_recursion++;
+        lockdep_publish_release(lock);
+        lockdep_release_spinlock(lock);
+        lockdep_recursion--;
     }
 
     return result;
@@ -291,49 +499,53 @@ int sem_post(sem_t* sem)
 
 int pthread_cond_wait(pthread_cond_t* cond, pthread_mutex_t* mutex)
 {
-    init_real_functions();
+    if (LOCKDEP_IDLE()) return real_pthread_cond_wait(cond, mutex);
 
-    if (lockdep_enabled && !in_interpose) {
-        in_interpose = true;
-        if (!lockdep_wait_condvar(cond, mutex)) {
-            fprintf(stderr, "[LOCKDEP] DEADLOCK DETECTED on cond_wait\n");
-            in_interpose = false;
+    if (!lockdep_recursion) {
+        lockdep_recursion++;
+        if (!lockdep_wait_condvar(cond, mutex, __builtin_return_address(0))) {
+            lockdep_report_refusal("cond_wait");
+            lockdep_recursion--;
             return EDEADLK;
         }
-        in_interpose = false;
+        lockdep_publish_release(mutex);
+        lockdep_recursion--;
     }
 
     int result = real_pthread_cond_wait(cond, mutex);
+    if (!lockdep_recursion) lockdep_publish_acquired(mutex, true, __builtin_return_address(0));
     return result;
 }
 
 int pthread_cond_timedwait(pthread_cond_t* cond, pthread_mutex_t* mutex, const struct timespec* abstime)
 {
-    init_real_functions();
+    if (LOCKDEP_IDLE()) return real_pthread_cond_timedwait(cond, mutex, abstime);
 
-    if (lockdep_enabled && !in_interpose) {
-        in_interpose = true;
-        if (!lockdep_wait_condvar(cond, mutex)) {
-            fprintf(stderr, "[LOCKDEP] DEADLOCK DETECTED on cond_timedwait\n");
-            in_interpose = false;
+    if (!lockdep_recursion) {
+        lockdep_recursion++;
+        if (!lockdep_wait_condvar(cond, mutex, __builtin_return_address(0))) {
+            lockdep_report_refusal("cond_timedwait");
+            lockdep_recursion--;
             return EDEADLK;
         }
-        in_interpose = false;
+        lockdep_publish_release(mutex);
+        lockdep_recursion--;
     }
 
     int result = real_pthread_cond_timedwait(cond, mutex, abstime);
+    if (!lockdep_recursion) lockdep_publish_acquired(mutex, true, __builtin_return_address(0));
     return result;
 }
 
 int pthread_cond_signal(pthread_cond_t* cond)
 {
-    init_real_functions();
+    if (LOCKDEP_IDLE()) return real_pthread_cond_signal(cond);
 
     int result = real_pthread_cond_signal(cond);
-    if (lockdep_enabled && !in_interpose) {
-        in_interpose = true;
+    if (!lockdep_recursion) {
+        lockdep_recursion++;
         lockdep_signal_condvar(cond);
-        in_interpose = false;
+        lockdep_recursion--;
     }
 
     return result;
@@ -341,13 +553,13 @@ int pthread_cond_signal(pthread_cond_t* cond)
 
 int pthread_cond_broadcast(pthread_cond_t* cond)
 {
-    init_real_functions();
+    if (LOCKDEP_IDLE()) return real_pthread_cond_broadcast(cond);
 
     int result = real_pthread_cond_broadcast(cond);
-    if (lockdep_enabled && !in_interpose) {
-        in_interpose = true;
+    if (!lockdep_recursion) {
+        lockdep_recursion++;
         lockdep_signal_condvar(cond);
-        in_interpose = false;
+        lockdep_recursion--;
     }
 
     return result;
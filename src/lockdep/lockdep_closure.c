@@ -0,0 +1,164 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+#include "lockdep_internal.h"
+
+// Dense cycle-check engine. While the graph is small enough, the transitive
+// closure is kept as a bit matrix: row `i` holds the nodes reachable from node
+// `i`. Whether an edge closes a cycle is then a single bit test, and inserting
+// `parent -> child` ORs the child's row into the row of every node that
+// reaches the parent. Rows are ORed with AVX2 or SSE2 when available.
+//
+// The matrix costs n^2 bits and each insertion O(n^2 / 64) word operations, so
+// past `closure_max_nodes` nodes it is dropped for good and the sparse engine
+// (reachability summaries and DFS) takes over.
+//
+// Only called with the graph lock held.
+
+#define DEFAULT_MAX_NODES 4096
+#define MIN_CAPACITY 256 // A multiple of 256 keeps rows 32-byte aligned.
+
+static uint64_t* closure;      // capacity rows of `stride` words.
+static size_t closure_stride;  // Words per row.
+static uint32_t closure_capacity;
+static uint32_t closure_nodes; // Nodes created so far.
+static uint32_t closure_max_nodes = DEFAULT_MAX_NODES;
+static bool closure_disabled;
+
+static void (*or_row)(uint64_t* dst, const uint64_t* src, size_t words);
+
+static void or_row_scalar(uint64_t* dst, const uint64_t* src, size_t words)
+{
+    for (size_t i = 0; i < words; i++) dst[i] |= src[i];
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse2"))) static void or_row_sse2(uint64_t* dst, const uint64_t* src, size_t words)
+{
+    for (size_t i = 0; i < words; i += 2) {
+        __m128i value =
+            _mm_or_si128(_mm_load_si128((const __m128i*)(dst + i)), _mm_load_si128((const __m128i*)(src + i)));
+        _mm_store_si128((__m128i*)(dst + i), value);
+    }
+}
+
+__attribute__((target("avx2"))) static void or_row_avx2(uint64_t* dst, const uint64_t* src, size_t words)
+{
+    for (size_t i = 0; i < words; i += 4) {
+        __m256i value =
+            _mm256_or_si256(_mm256_load_si256((const __m256i*)(dst + i)), _mm256_load_si256((const __m256i*)(src + i)));
+        _mm256_store_si256((__m256i*)(dst + i), value);
+    }
+}
+#endif
+
+static void select_or_row(void)
+{
+    or_row = or_row_scalar;
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        or_row = or_row_avx2;
+    } else if (__builtin_cpu_supports("sse2")) {
+        or_row = or_row_sse2;
+    }
+#endif
+}
+
+static inline uint64_t* closure_row(uint32_t id)
+{
+    return closure + (size_t)id * closure_stride;
+}
+
+static inline bool row_test(const uint64_t* row, uint32_t id)
+{
+    return row[id / 64] >> (id % 64) & 1;
+}
+
+static inline void row_set(uint64_t* row, uint32_t id)
+{
+    row[id / 64] |= 1ull << (id % 64);
+}
+
+static void closure_drop(void)
+{
+    if (closure) munmap(closure, (size_t)closure_capacity * closure_stride * sizeof(uint64_t));
+    closure = NULL;
+    closure_capacity = 0;
+    closure_stride = 0;
+    closure_disabled = true;
+}
+
+/// Doubles the matrix, copying the first `rows` rows into their wider
+/// replacements.
+static bool closure_grow(uint32_t rows)
+{
+    uint32_t capacity = closure_capacity ? closure_capacity * 2 : MIN_CAPACITY;
+    size_t stride = capacity / 64;
+    size_t bytes = (size_t)capacity * stride * sizeof(uint64_t);
+
+    uint64_t* grown = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (grown == MAP_FAILED) return false;
+
+    for (uint32_t id = 0; id < rows; id++) {
+        memcpy(grown + (size_t)id * stride, closure_row(id), closure_stride * sizeof(uint64_t));
+    }
+    if (closure) munmap(closure, (size_t)closure_capacity * closure_stride * sizeof(uint64_t));
+
+    closure = grown;
+    closure_capacity = capacity;
+    closure_stride = stride;
+    return true;
+}
+
+void lockdep_closure_configure(uint32_t max_nodes)
+{
+    closure_max_nodes = max_nodes;
+    if (closure_nodes > max_nodes) closure_drop();
+}
+
+void lockdep_closure_node_added(uint32_t id)
+{
+    closure_nodes = id + 1;
+    if (closure_disabled) return;
+
+    if (closure_nodes > closure_max_nodes) {
+        fprintf(stderr, "[LOCKDEP] More than %u locks: switching to sparse cycle checks\n", closure_max_nodes);
+        closure_drop();
+        return;
+    }
+
+    if (!or_row) select_or_row();
+    if (closure_nodes > closure_capacity && !closure_grow(id)) {
+        fprintf(stderr, "[LOCKDEP] Failed to grow the reachability matrix: switching to sparse cycle checks\n");
+        closure_drop();
+    }
+}
+
+void lockdep_closure_edge_added(uint32_t parent, uint32_t child)
+{
+    if (!closure) return;
+
+    // Everything that reaches `parent`, and `parent` itself, now also reaches
+    // `child` and all of its descendants.
+    const uint64_t* child_row = closure_row(child);
+    for (uint32_t id = 0; id < closure_nodes; id++) {
+        uint64_t* row = closure_row(id);
+        if (id != parent && !row_test(row, parent)) continue;
+        or_row(row, child_row, closure_stride);
+        row_set(row, child);
+    }
+}
+
+bool lockdep_closure_reaches(uint32_t from, uint32_t to, bool* reaches)
+{
+    if (!closure) return false;
+    *reaches = from == to || row_test(closure_row(from), to);
+    return true;
+}
@@ -0,0 +1,219 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "lockdep_internal.h"
+
+// A client that stops sending or reading is dropped after this long, so that it
+// cannot hold up the clients behind it.
+#define CLIENT_TIMEOUT_MS 1000
+
+static int control_fd = -1;
+static char control_path[sizeof(((struct sockaddr_un*)0)->sun_path)];
+static const char* control_pattern;
+
+/// Applies one command line and writes the reply into `reply`.
+static void handle_command(char* command, char* reply, size_t size)
+{
+    char name[16];
+    unsigned rate;
+    int fields = sscanf(command, "%15s %u", name, &rate);
+
+    if (fields <= 0) {
+        snprintf(reply, size, "error: empty command\n");
+        return;
+    }
+
+    if (strcmp(name, "cycles") == 0) {
+        snprintf(reply, size, "cycles %u\n", lockdep_report_cycles());
+        return;
+    }
+
+    if (strcmp(name, "stats") == 0) {
+        lockdep_print_stats();
+        snprintf(reply, size, "stats printed\n");
+        return;
+    }
+
+    if (strcmp(name, "status") != 0) {
+        lockdep_mode_t mode;
+        if (!lockdep_mode_from_string(name, &mode)) {
+            snprintf(reply, size, "error: unknown command '%s'\n", name);
+            return;
+        }
+        if (fields == 2 && mode == LOCKDEP_MODE_SAMPLED) lockdep_set_sample_rate(rate);
+        lockdep_set_mode(mode);
+        fprintf(stderr, "[LOCKDEP] Mode switched to %s\n", lockdep_mode_to_string(lockdep_get_mode()));
+    }
+
+    lockdep_mode_t mode = lockdep_get_mode();
+    if (mode == LOCKDEP_MODE_SAMPLED) {
+        snprintf(reply, size, "mode sampled 1/%u\n", lockdep_get_sample_rate());
+    } else {
+        snprintf(reply, size, "mode %s\n", lockdep_mode_to_string(mode));
+    }
+}
+
+/// Serves one client: every newline-terminated command gets a one-line reply.
+static void serve_client(int client)
+{
+    char buffer[256];
+    size_t used = 0;
+    ssize_t received;
+
+    while ((received = read(client, buffer + used, sizeof(buffer) - 1 - used)) > 0) {
+        used += received;
+        buffer[used] = '\0';
+
+        char* line = buffer;
+        char* newline;
+        while ((newline = strchr(line, '\n'))) {
+            *newline = '\0';
+            char reply[64];
+            handle_command(line, reply, sizeof(reply));
+            if (write(client, reply, strlen(reply)) < 0) return;
+            line = newline + 1;
+        }
+
+        used = strlen(line);
+        memmove(buffer, line, used);
+        if (used == sizeof(buffer) - 1) used = 0; // Overlong line, drop it.
+    }
+
+    // A final command without a newline, as sent by `printf full | nc -U`.
+    if (used) {
+        buffer[used] = '\0';
+        char reply[64];
+        handle_command(buffer, reply, sizeof(reply));
+        if (write(client, reply, strlen(reply)) < 0) return;
+    }
+}
+
+static void* control_thread(void* arg)
+{
+    int fd = (int)(intptr_t)arg;
+
+    // Locks taken by this thread belong to lockdep, not to the program.
+    lockdep_recursion++;
+
+    for (;;) {
+        int client = accept(fd, NULL, NULL);
+        if (client < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        struct timeval timeout = {CLIENT_TIMEOUT_MS / 1000, CLIENT_TIMEOUT_MS % 1000 * 1000};
+        setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        serve_client(client);
+        close(client);
+    }
+    return NULL;
+}
+
+/// Expands "%p" in `pattern` to the process id, so that child processes that
+/// inherit the environment get sockets of their own.
+static bool expand_path(const char* pattern, char* path, size_t size)
+{
+    size_t used = 0;
+    for (const char* c = pattern; *c; c++) {
+        int written = (c[0] == '%' && c[1] == 'p') ? snprintf(path + used, size - used, "%d", (int)getpid())
+                                                   : snprintf(path + used, size - used, "%c", *c);
+        if (written < 0 || (size_t)written >= size - used) return false;
+        used += written;
+        if (c[0] == '%' && c[1] == 'p') c++;
+    }
+    return true;
+}
+
+/// Tells whether another process is already serving `addr`.
+static bool socket_in_use(const struct sockaddr_un* addr)
+{
+    int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (probe < 0) return false;
+    bool in_use = connect(probe, (const struct sockaddr*)addr, sizeof(*addr)) == 0;
+    close(probe);
+    return in_use;
+}
+
+bool lockdep_control_start(const char* pattern)
+{
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    if (!expand_path(pattern, addr.sun_path, sizeof(addr.sun_path))) {
+        fprintf(stderr, "[LOCKDEP] Control socket path too long: %s\n", pattern);
+        return false;
+    }
+    const char* path = addr.sun_path;
+
+    if (socket_in_use(&addr)) {
+        fprintf(stderr, "[LOCKDEP] Control socket %s is in use by another process\n", path);
+        return false;
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        fprintf(stderr, "[LOCKDEP] Failed to create control socket: %s\n", strerror(errno));
+        return false;
+    }
+
+    // Only the owner of the process may switch its mode. Connections are
+    // refused until listen(), so restricting the path in between leaves no
+    // window for other users.
+    unlink(path);
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || chmod(path, S_IRUSR | S_IWUSR) < 0 ||
+        listen(fd, 4) < 0) {
+        fprintf(stderr, "[LOCKDEP] Failed to listen on %s: %s\n", path, strerror(errno));
+        close(fd);
+        return false;
+    }
+
+    // The thread's own mutex operations must not be tracked either.
+    lockdep_recursion++;
+    pthread_t thread;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    int err = pthread_create(&thread, &attr, control_thread, (void*)(intptr_t)fd);
+    pthread_attr_destroy(&attr);
+    lockdep_recursion--;
+
+    if (err) {
+        fprintf(stderr, "[LOCKDEP] Failed to start control thread: %s\n", strerror(err));
+        close(fd);
+        unlink(path);
+        return false;
+    }
+
+    control_fd = fd;
+    control_pattern = pattern;
+    strcpy(control_path, path);
+    fprintf(stderr, "[LOCKDEP] Control socket listening on %s\n", path);
+    return true;
+}
+
+void lockdep_control_stop(void)
+{
+    if (control_fd < 0) return;
+
+    // The detached thread is left blocked in accept(); removing the path is
+    // enough to stop new clients from reaching it.
+    unlink(control_path);
+    control_fd = -1;
+}
+
+void lockdep_control_atfork_child(void)
+{
+    if (control_fd < 0) return;
+
+    // The serving thread stayed in the parent, along with the socket path.
+    close(control_fd);
+    control_fd = -1;
+    if (strstr(control_pattern, "%p")) lockdep_control_start(control_pattern);
+}
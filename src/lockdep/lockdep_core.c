@@ -1,18 +1,114 @@
+#define _GNU_SOURCE
 #include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "../include/lockdep.h"
+#include "lockdep_internal.h"
 
-bool lockdep_enabled = true;
+_Atomic bool lockdep_enabled = true;
+__thread unsigned lockdep_recursion __attribute__((tls_model("initial-exec"))) = 0;
+
+#define DEFAULT_SAMPLE_RATE 100
+
+static _Atomic lockdep_mode_t lockdep_mode = LOCKDEP_MODE_FULL;
+static _Atomic unsigned sample_rate = DEFAULT_SAMPLE_RATE;
+static _Atomic unsigned held_epoch = 0;
+static __thread unsigned sample_tick;
+static bool trace_enabled; // Every lock operation is printed on stdout.
 
-static lock_node_t* lock_registry;
 static thread_context_t* thread_registry;
 static pthread_mutex_t lockdep_mutex = PTHREAD_MUTEX_INITIALIZER;
 
+// Contexts of exited threads, handed to new threads. A thread finds its own
+// context through `current_context`; `context_key` only exists for its
+// destructor, which runs when the thread exits.
+static thread_context_t* free_contexts;
+static __thread thread_context_t* current_context;
+static pthread_key_t context_key;
+static pthread_once_t context_key_once = PTHREAD_ONCE_INIT;
+
+// Spinlock operations made while the graph lock was busy, applied by the next
+// lockdep call of the same thread that gets the graph lock.
+#define SPIN_DEFERRED_MAX 16
+
+typedef enum spin_op_kind {
+    SPIN_ACQUIRE,
+    SPIN_TRYLOCK,
+    SPIN_RELEASE
+} spin_op_kind_t;
+
+typedef struct spin_op {
+    const void* lock_addr;
+    const void* ip;
+    spin_op_kind_t kind;
+} spin_op_t;
+
+static __thread spin_op_t spin_deferred[SPIN_DEFERRED_MAX];
+static __thread unsigned spin_deferred_count;
+
+static void apply_deferred_spin_ops(void);
+
+// Orderings recorded without validation, queued per thread and inserted into
+// the graph in batches by the thread's next graph lock.
+#define EDGE_BUFFER_MAX 32
+#define EDGE_BUFFER_MAX_AGE_NS 10000000 // 10ms
+
+typedef struct pending_edge {
+    lock_node_t* parent;
+    lock_node_t* child;
+    uint8_t type; // LOCKDEP_EDGE_EN, ER, SN or SR.
+} pending_edge_t;
+
+static __thread pending_edge_t edge_buffer[EDGE_BUFFER_MAX];
+static __thread unsigned edge_buffer_count;
+static __thread uint64_t edge_buffer_since;
+
+static void flush_pending_edges(void);
+
+/// lockdep's own mutex is taken through the instrumented pthread functions,
+/// which skip validation while `lockdep_recursion` is raised. Raising it here
+/// also covers public entry points called directly by the program.
+static void graph_lock(void)
+{
+    lockdep_recursion++;
+    pthread_mutex_lock(&lockdep_mutex);
+    if (spin_deferred_count) apply_deferred_spin_ops();
+    if (edge_buffer_count) flush_pending_edges();
+}
+
+static bool graph_trylock(void)
+{
+    lockdep_recursion++;
+    if (pthread_mutex_trylock(&lockdep_mutex) != 0) {
+        lockdep_recursion--;
+        return false;
+    }
+    if (spin_deferred_count) apply_deferred_spin_ops();
+    if (edge_buffer_count) flush_pending_edges();
+    return true;
+}
+
+static void graph_unlock(void)
+{
+    pthread_mutex_unlock(&lockdep_mutex);
+    lockdep_recursion--;
+}
+
+void lockdep_graph_lock(void)
+{
+    graph_lock();
+}
+
+void lockdep_graph_unlock(void)
+{
+    graph_unlock();
+}
+
 // ==================== MEMORY ARENA ====================
 
 #define ARENA_SIZE (1024 * 1024) // 1MB por arena
@@ -110,7 +206,7 @@ void arena_destroy(void)
 
 // ==================== ALLOCATION FUNCTIONS ====================
 
-static void* smalloc(const size_t bytes)
+void* lockdep_alloc(size_t bytes)
 {
     void* ptr = arena_alloc(bytes);
     if (!ptr) {
@@ -126,7 +222,7 @@ static void* smalloc(const size_t bytes)
 
 // ==================== LOCK MANIPULATION FUNCTIONS ====================
 
-static const char* sync_type_to_string(sync_type_t type)
+const char* lockdep_sync_type_to_string(sync_type_t type)
 {
     switch (type) {
     case SYNC_MUTEX:
@@ -137,105 +233,628 @@ static const char* sync_type_to_string(sync_type_t type)
         return "SEMAPHORE";
     case SYNC_CONDVAR:
         return "CONDVAR";
+    case SYNC_SPINLOCK:
+        return "SPINLOCK";
     default:
         return "UNKNOWN";
     }
 }
 
-static lock_node_t* find_or_create_lock(const void* lock_addr, sync_type_t type)
+static lock_node_t* find_or_create_lock(const void* lock_addr, sync_type_t type, const void* ip)
 {
-    lock_node_t* lock = lock_registry;
-
-    while (lock) {
-        if (lock->lock_addr == lock_addr) {
-            if (lock->type != type) {
-                lock->type = type;
-            }
-            return lock;
+    lock_node_t* lock = lockdep_graph_lookup(lock_addr);
+    if (lock) {
+        if (lock->type != type) {
+            lock->type = type;
+        }
+        if (!lock->callsite) {
+            lock->callsite = ip;
         }
-        lock = lock->next;
+        return lock;
     }
 
-    lock = smalloc(sizeof(lock_node_t));
-    lock->children = NULL;
+    lock = lockdep_graph_new_node();
+    lockdep_count(LOCKDEP_EVENT_NEW_NODE);
     lock->lock_addr = lock_addr;
     lock->type = type;
-    lock->next = lock_registry;
-    return lock_registry = lock;
+    lock->callsite = ip;
+    lockdep_graph_index_node(lock);
+    lockdep_closure_node_added(lock->id);
+
+    lockdep_shm_bind(lock);
+    lockdep_persist_bind(lock);
+    return lock;
 }
 
-static thread_context_t* find_thread_context(const pthread_t thread_id)
+// Scratch space of the graph searches, one entry per node, reused across
+// searches and only grown with the graph.
+static uint64_t* search_visited;
+static uint32_t* search_stack;
+static uint32_t* search_parent;
+static uint32_t search_capacity;
+
+// Set once an ordering involves a read acquisition. Until then every cycle
+// found is a deadlock, and the read-aware search is skipped.
+static bool shared_orderings;
+
+/// Makes room for a search of the whole graph and clears the visited bitmap.
+static void reset_search(uint32_t count)
 {
-    thread_context_t* ctx = thread_registry;
-    while (ctx) {
-        if (ctx->thread_id == thread_id) return ctx;
-        ctx = ctx->next;
+    if (count > search_capacity) {
+        uint32_t capacity = count > 2 * search_capacity ? count : 2 * search_capacity;
+        uint64_t* visited = realloc(search_visited, (capacity + 63) / 64 * sizeof(uint64_t));
+        if (visited) search_visited = visited;
+        uint32_t* stack = realloc(search_stack, capacity * sizeof(uint32_t));
+        if (stack) search_stack = stack;
+        uint32_t* parent = realloc(search_parent, capacity * sizeof(uint32_t));
+        if (parent) search_parent = parent;
+        if (!visited || !stack || !parent) {
+            fprintf(stderr, "[LOCKDEP] Out of memory, aborting\n");
+            exit(EXIT_FAILURE);
+        }
+        search_capacity = capacity;
     }
-    return NULL;
+    memset(search_visited, 0, (count + 63) / 64 * sizeof(uint64_t));
 }
 
-static void add_dependency(lock_node_t* parent, lock_node_t* child)
+// ==================== REACHABILITY SUMMARIES ====================
+
+// Every node keeps a Bloom filter of its ancestors, the nodes from which it can
+// be reached. Filters only grow, and an edge insertion propagates the parent's
+// filter down the child's descendants until nothing changes. A lock missing
+// from the filter of another is certainly not one of its ancestors, so most
+// cycle checks are answered with a few bit operations and the exact search
+// only runs on possible hits.
+
+#define SUMMARY_BITS (LOCKDEP_SUMMARY_WORDS * 64)
+
+static inline void summary_positions(const lock_node_t* lock, unsigned* first, unsigned* second)
+{
+    uint64_t hash = ((uintptr_t)lock >> 3) * 0x9E3779B97F4A7C15ull;
+    *first = (unsigned)(hash >> 32) % SUMMARY_BITS;
+    *second = (unsigned)(hash >> 48) % SUMMARY_BITS;
+}
+
+static inline bool summary_may_contain(const uint64_t* summary, const lock_node_t* lock)
+{
+    unsigned first, second;
+    summary_positions(lock, &first, &second);
+    return (summary[first / 64] >> (first % 64) & 1) && (summary[second / 64] >> (second % 64) & 1);
+}
+
+/// Merges `parent` and its ancestors into the filter of `node`. Returns whether
+/// the filter grew.
+static bool merge_ancestors(lock_node_t* node, const lock_node_t* parent)
+{
+    uint64_t merged[LOCKDEP_SUMMARY_WORDS];
+    memcpy(merged, parent->ancestors, sizeof(merged));
+
+    unsigned first, second;
+    summary_positions(parent, &first, &second);
+    merged[first / 64] |= 1ull << (first % 64);
+    merged[second / 64] |= 1ull << (second % 64);
+
+    bool grew = false;
+    for (unsigned i = 0; i < LOCKDEP_SUMMARY_WORDS; i++) {
+        grew |= (merged[i] & ~node->ancestors[i]) != 0;
+        node->ancestors[i] |= merged[i];
+    }
+    return grew;
+}
+
+/// Merges `parent` into the filter of `node`, and into those of the nodes below
+/// it that gain bits. Chains of orderings can be as long as the graph, so the
+/// nodes left to update are kept on `search_stack` rather than the call stack;
+/// a node is queued at most once at a time, so the stack never outgrows the
+/// graph.
+static void propagate_ancestors(lock_node_t* node, const lock_node_t* parent)
 {
-    adjacency_locks_t* adj = parent->children;
-    while (adj) {
-        if (adj->lock == child) return;
-        adj = adj->next;
+    if (!merge_ancestors(node, parent)) return;
+
+    reset_search(lockdep_graph_node_count());
+    uint32_t depth = 0;
+    search_stack[depth++] = node->id;
+    search_visited[node->id / 64] |= 1ull << (node->id % 64);
+
+    while (depth) {
+        const lock_node_t* current = lockdep_graph_node(search_stack[--depth]);
+        search_visited[current->id / 64] &= ~(1ull << (current->id % 64));
+
+        for (uint32_t i = 0; i < current->out_degree; i++) {
+            uint32_t child = current->edges[i];
+            if (!merge_ancestors(lockdep_graph_node(child), current)) continue;
+            if (search_visited[child / 64] >> (child % 64) & 1) continue;
+            search_visited[child / 64] |= 1ull << (child % 64);
+            search_stack[depth++] = child;
+        }
     }
+}
+
+static void frozen_edge_added(const lock_node_t* parent, const lock_node_t* child);
 
-    adj = smalloc(sizeof(adjacency_locks_t));
-    adj->lock = child;
-    adj->next = parent->children;
-    parent->children = adj;
+static uint32_t add_dependency(lock_node_t* parent, lock_node_t* child)
+{
+    uint32_t edge = lockdep_graph_add_edge(parent, child);
+    lockdep_count(LOCKDEP_EVENT_NEW_EDGE);
+    frozen_edge_added(parent, child);
+    propagate_ancestors(child, parent);
+    lockdep_closure_edge_added(parent->id, child->id);
+    return edge;
 }
 
-static bool has_cycle_dfs(lock_node_t* node, lock_node_t* target, lock_node_t** visited, int* visit_count)
+/// Tells whether `to` can be reached from `from`, with an iterative DFS that
+/// marks visited nodes in a bitmap.
+static bool reaches_sparse(const lock_node_t* from, const lock_node_t* to)
 {
-    for (int i = 0; i < *visit_count; i++) {
-        if (visited[i] == node) return false;
+    uint32_t count = lockdep_graph_node_count();
+    reset_search(count);
+
+    // Nodes are marked when pushed, so the stack never holds more than
+    // `count` of them.
+    uint32_t depth = 0;
+    search_stack[depth++] = from->id;
+    search_visited[from->id / 64] |= 1ull << (from->id % 64);
+
+    while (depth) {
+        const lock_node_t* node = lockdep_graph_node(search_stack[--depth]);
+        if (node == to) return true;
+
+        for (uint32_t i = 0; i < node->out_degree; i++) {
+            uint32_t child = node->edges[i];
+            if (search_visited[child / 64] >> (child % 64) & 1) continue;
+            search_visited[child / 64] |= 1ull << (child % 64);
+            search_stack[depth++] = child;
+        }
     }
+    return false;
+}
+
+/// Finds a shortest path from `from` to `to` with a BFS, and writes the ids of
+/// its nodes, both ends included, to the start of `search_stack`. Returns its
+/// length, or 0 if there is no path.
+static uint32_t find_path(const lock_node_t* from, const lock_node_t* to)
+{
+    uint32_t count = lockdep_graph_node_count();
+    reset_search(count);
+
+    // The stack is used as the BFS queue; every node enters it at most once.
+    uint32_t head = 0, tail = 0;
+    search_stack[tail++] = from->id;
+    search_visited[from->id / 64] |= 1ull << (from->id % 64);
+
+    while (head < tail) {
+        const lock_node_t* node = lockdep_graph_node(search_stack[head++]);
+        if (node != to) {
+            for (uint32_t i = 0; i < node->out_degree; i++) {
+                uint32_t child = node->edges[i];
+                if (search_visited[child / 64] >> (child % 64) & 1) continue;
+                search_visited[child / 64] |= 1ull << (child % 64);
+                search_parent[child] = node->id;
+                search_stack[tail++] = child;
+            }
+            continue;
+        }
 
-    visited[(*visit_count)++] = node;
+        uint32_t length = 1;
+        for (uint32_t id = to->id; id != from->id; id = search_parent[id]) length++;
+        uint32_t id = to->id;
+        for (uint32_t i = length - 1; i > 0; i--) {
+            search_stack[i] = id;
+            id = search_parent[id];
+        }
+        search_stack[0] = from->id;
+        return length;
+    }
+    return 0;
+}
 
-    if (node == target) return true;
+/// Finds the shortest path from `to` back to `from` that closes, with the
+/// ordering `from -> to` of LOCKDEP_EDGE_* types `types`, a cycle on which
+/// every lock makes the next thread wait. A lock acquired as a recursive read
+/// on the way in and held shared on the way out lets both threads through, so
+/// a path with such a step is no deadlock. The BFS runs over (lock, reached by
+/// a recursive read) states. Writes the path like find_path() and returns its
+/// length, or 0 if there is none.
+static uint32_t find_blocking_path(const lock_node_t* from, const lock_node_t* to, uint8_t types)
+{
+    // An ordering seen several ways is searched with the types least likely
+    // to break the cycle.
+    bool read = !(types & (LOCKDEP_EDGE_EN | LOCKDEP_EDGE_SN));
+    bool held_shared = !(types & (LOCKDEP_EDGE_EN | LOCKDEP_EDGE_ER));
+
+    uint32_t count = lockdep_graph_node_count();
+    reset_search(2 * count);
+
+    uint32_t head = 0, tail = 0;
+    uint32_t start = to->id * 2 + read;
+    search_stack[tail++] = start;
+    search_visited[start / 64] |= 1ull << (start % 64);
+
+    uint32_t end = UINT32_MAX;
+    while (head < tail) {
+        uint32_t state = search_stack[head++];
+        const lock_node_t* node = lockdep_graph_node(state / 2);
+        bool reached_by_read = state & 1;
+        if (node == from && !(reached_by_read && held_shared)) {
+            end = state;
+            break;
+        }
 
-    adjacency_locks_t* adj = node->children;
-    while (adj) {
-        if (has_cycle_dfs(adj->lock, target, visited, visit_count)) {
-            return true;
+        for (uint32_t i = 0; i < node->out_degree; i++) {
+            uint8_t edge_types = *lockdep_edge_flags(lockdep_edge_id(node, i)) & LOCKDEP_EDGE_TYPES;
+            // Past a lock taken as a recursive read, only the orderings seen
+            // with the lock held exclusive lead on.
+            if (reached_by_read) edge_types &= LOCKDEP_EDGE_EN | LOCKDEP_EDGE_ER;
+
+            for (uint32_t by_read = 0; by_read < 2; by_read++) {
+                uint8_t mask = by_read ? LOCKDEP_EDGE_ER | LOCKDEP_EDGE_SR : LOCKDEP_EDGE_EN | LOCKDEP_EDGE_SN;
+                uint32_t next = node->edges[i] * 2 + by_read;
+                if (!(edge_types & mask) || search_visited[next / 64] >> (next % 64) & 1) continue;
+                search_visited[next / 64] |= 1ull << (next % 64);
+                search_parent[next] = state;
+                search_stack[tail++] = next;
+            }
         }
-        adj = adj->next;
     }
+    if (end == UINT32_MAX) return 0;
+
+    uint32_t length = 1;
+    for (uint32_t state = end; state != start; state = search_parent[state]) length++;
+    uint32_t state = end;
+    for (uint32_t i = length - 1; i > 0; i--) {
+        search_stack[i] = state / 2;
+        state = search_parent[state];
+    }
+    search_stack[0] = to->id;
+    return length;
+}
 
-    return false;
+static bool would_create_cycle(lock_node_t* from, lock_node_t* to, uint8_t types)
+{
+    // Acquiring `to` after `from` closes a cycle if `to` already reaches `from`.
+    lockdep_count(LOCKDEP_EVENT_CYCLE_CHECK);
+    bool reaches;
+    if (lockdep_closure_reaches(to->id, from->id, &reaches)) {
+        lockdep_count(LOCKDEP_EVENT_DENSE_CHECK);
+    } else if (from != to && !summary_may_contain(from->ancestors, to)) {
+        lockdep_count(LOCKDEP_EVENT_QUICK_REJECT);
+        return false;
+    } else {
+        reaches = reaches_sparse(to, from);
+    }
+
+    // Reachability ignores how the locks are held. Once readers are in the
+    // graph, the cycle found may not be a deadlock.
+    return reaches && (!shared_orderings || find_blocking_path(from, to, types));
+}
+
+/// Reports the cycle that `edge`, from `parent` to `child`, closes. When it is
+/// seen for the first time, returns its length and leaves its locks, from
+/// `child` to `parent`, at the start of `search_stack`; returns 0 otherwise. A
+/// cycle found only through the persisted or shared graphs is reported as the
+/// two locks of the edge.
+static uint32_t report_cycle(const lock_node_t* parent, const lock_node_t* child, uint32_t edge, const void* ip)
+{
+    if (lockdep_report_repeat(edge)) return 0;
+
+    uint32_t length = 0;
+    if (shared_orderings) length = find_blocking_path(parent, child, *lockdep_edge_flags(edge));
+    if (!length) length = find_path(child, parent);
+    if (!length) {
+        search_stack[0] = child->id;
+        search_stack[1] = parent->id;
+        length = 2;
+    }
+    return lockdep_report_cycle(edge, search_stack, length, ip) ? length : 0;
+}
+
+/// Prints the cycle left in `search_stack` by report_cycle(), each lock
+/// followed by the one acquired after it.
+static void print_cycle(uint32_t length)
+{
+    printf("[LOCKDEP] Cycle:");
+    for (uint32_t i = 0; i <= length; i++) {
+        const lock_node_t* lock = lockdep_graph_node(search_stack[i % length]);
+        printf("%s %s %p", i ? " ->" : "", lockdep_sync_type_to_string(lock->type), lock->lock_addr);
+    }
+    printf("\n");
+}
+
+/// Counts an acquisition that went through the ordering. Threads validating
+/// from their caches count without the graph lock.
+static inline void count_hit(uint32_t edge)
+{
+    atomic_fetch_add_explicit(lockdep_edge_hits(edge), 1, memory_order_relaxed);
+}
+
+/// Adds `type` to the ways the ordering was seen. Returns whether it is new.
+static bool add_edge_type(uint8_t* flags, uint8_t type)
+{
+    if (*flags & type) return false;
+    *flags |= type;
+    if (type != LOCKDEP_EDGE_EN) shared_orderings = true;
+    return true;
+}
+
+/// Records the ordering, seen by an acquisition, without searching for cycles.
+/// `checked` tells whether the order is already guaranteed (by declared
+/// ranks); otherwise the edge is searched the first time a validating
+/// acquisition goes through it.
+static uint32_t record_dependency(lock_node_t* parent, lock_node_t* child, uint8_t type, bool checked)
+{
+    uint32_t edge;
+    if (!lockdep_graph_find_edge(parent, child, &edge)) edge = add_dependency(parent, child);
+    uint8_t* flags = lockdep_edge_flags(edge);
+    if (add_edge_type(flags, type) && !checked) *flags &= ~LOCKDEP_EDGE_CHECKED;
+    if (checked && !(*flags & LOCKDEP_EDGE_CHECKED)) lockdep_shm_edge_checked(parent, child);
+    if (checked) *flags |= LOCKDEP_EDGE_CHECKED;
+    count_hit(edge);
+    return edge;
+}
+
+/// Orderings that are already part of the graph were validated when they were
+/// added, so only new edges, or edges seen with a new mix of read and write
+/// acquisitions, pay for the cycle search. Edges that closed a cycle stay in
+/// the graph flagged, and keep failing validation.
+static bool link_dependency(lock_node_t* parent, lock_node_t* child, uint8_t type, uint32_t* edge)
+{
+    if (!lockdep_graph_find_edge(parent, child, edge)) *edge = add_dependency(parent, child);
+    uint8_t* flags = lockdep_edge_flags(*edge);
+    if (*flags & LOCKDEP_EDGE_INVERSION) return false;
+    if (!add_edge_type(flags, type) && (*flags & LOCKDEP_EDGE_CHECKED)) return true;
+
+    *flags |= LOCKDEP_EDGE_CHECKED;
+    if (would_create_cycle(parent, child, *flags) || lockdep_persist_would_create_cycle(parent, child) ||
+        lockdep_shm_would_create_cycle(parent, child)) {
+        *flags |= LOCKDEP_EDGE_INVERSION;
+        return false;
+    }
+    lockdep_shm_edge_checked(parent, child);
+    return true;
+}
+
+bool lockdep_link_locks(lock_node_t* parent, lock_node_t* child)
+{
+    uint32_t edge;
+    return link_dependency(parent, child, LOCKDEP_EDGE_EN, &edge);
+}
+
+// ==================== PER-THREAD CACHES ====================
+
+// Nodes and edges are never removed from the graph, and an edge that passed
+// the cycle search stays valid. Each thread therefore remembers the nodes it
+// looked up and the orderings it already saw in small direct-mapped tables,
+// and an acquisition that only goes through known orderings is validated and
+// recorded without the graph lock. A miss just falls back to the slow path.
+
+#define NODE_CACHE_SIZE 64
+#define EDGE_FILTER_SIZE 256
+#define NO_EDGE UINT32_MAX
+
+typedef struct node_cache_entry {
+    const void* lock_addr;
+    sync_type_t type;
+    lock_node_t* lock;
+} node_cache_entry_t;
+
+typedef struct edge_filter_entry {
+    const lock_node_t* parent;
+    const lock_node_t* child;
+    uint8_t type;          // How the ordering was seen, see LOCKDEP_EDGE_EN.
+    uint32_t edge;         // NO_EDGE while the ordering waits in the edge buffer.
+    unsigned pending_hits; // Hits seen while it waits there.
+    bool checked;          // The ordering passed the cycle search.
+} edge_filter_entry_t;
+
+static __thread node_cache_entry_t node_cache[NODE_CACHE_SIZE];
+static __thread edge_filter_entry_t edge_filter[EDGE_FILTER_SIZE];
+
+static inline size_t pointer_hash(const void* ptr)
+{
+    return (size_t)(((uintptr_t)ptr >> 3) * 0x9E3779B97F4A7C15ull >> 32);
+}
+
+static inline node_cache_entry_t* node_cache_slot(const void* lock_addr)
+{
+    return &node_cache[pointer_hash(lock_addr) & (NODE_CACHE_SIZE - 1)];
+}
+
+static inline edge_filter_entry_t* edge_filter_slot(const lock_node_t* parent, const lock_node_t* child)
+{
+    return &edge_filter[(pointer_hash(parent) ^ (pointer_hash(child) * 31)) & (EDGE_FILTER_SIZE - 1)];
+}
+
+static void cache_node(lock_node_t* lock)
+{
+    *node_cache_slot(lock->lock_addr) = (node_cache_entry_t){lock->lock_addr, lock->type, lock};
+}
+
+/// Finds the node of a lock without the graph lock: in the thread's cache, then
+/// in the graph's address index. Returns NULL if the node does not exist yet, or
+/// if the slow path has to update it.
+static lock_node_t* cached_node(const void* lock_addr, sync_type_t type)
+{
+    const node_cache_entry_t* entry = node_cache_slot(lock_addr);
+    if (entry->lock_addr == lock_addr && entry->type == type) return entry->lock;
+
+    lock_node_t* lock = lockdep_graph_lookup(lock_addr);
+    if (!lock || lock->type != type || !lock->callsite) return NULL;
+    cache_node(lock);
+    return lock;
+}
+
+/// Returns the filter entry of `parent -> child` seen as `type`, or NULL if the
+/// thread has not seen that ordering.
+static edge_filter_entry_t* filtered_edge(const lock_node_t* parent, const lock_node_t* child, uint8_t type)
+{
+    edge_filter_entry_t* entry = edge_filter_slot(parent, child);
+    return entry->parent == parent && entry->child == child && entry->type == type ? entry : NULL;
+}
+
+static void remember_edge(const lock_node_t* parent, const lock_node_t* child, uint8_t type, uint32_t edge,
+                          bool checked)
+{
+    *edge_filter_slot(parent, child) = (edge_filter_entry_t){parent, child, type, edge, 0, checked};
+}
+
+static uint64_t coarse_now_ns(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+    return (uint64_t)now.tv_sec * 1000000000ull + (uint64_t)now.tv_nsec;
+}
+
+/// Queues an unvalidated ordering. A full buffer is flushed right away.
+static void buffer_edge(lock_node_t* parent, lock_node_t* child, uint8_t type)
+{
+    if (edge_buffer_count == EDGE_BUFFER_MAX) {
+        graph_lock(); // Flushes the buffer.
+        graph_unlock();
+    }
+    if (!edge_buffer_count) edge_buffer_since = coarse_now_ns();
+
+    edge_buffer[edge_buffer_count++] = (pending_edge_t){parent, child, type};
+    remember_edge(parent, child, type, NO_EDGE, false);
+}
+
+static void flush_pending_edges(void)
+{
+    for (unsigned i = 0; i < edge_buffer_count; i++) {
+        lock_node_t* parent = edge_buffer[i].parent;
+        lock_node_t* child = edge_buffer[i].child;
+        uint8_t type = edge_buffer[i].type;
+        uint32_t edge = record_dependency(parent, child, type, false);
+
+        edge_filter_entry_t* entry = filtered_edge(parent, child, type);
+        if (entry && entry->edge == NO_EDGE) {
+            atomic_fetch_add_explicit(lockdep_edge_hits(edge), entry->pending_hits, memory_order_relaxed);
+            remember_edge(parent, child, type, edge, false);
+        }
+    }
+    edge_buffer_count = 0;
+}
+
+/// Flushes the buffer once its oldest edge is older than the bound, unless
+/// another thread holds the graph lock, in which case a later call retries.
+static void maybe_flush_pending_edges(void)
+{
+    if (!edge_buffer_count || coarse_now_ns() - edge_buffer_since < EDGE_BUFFER_MAX_AGE_NS) return;
+    if (graph_trylock()) graph_unlock();
+}
+
+static void account_held_rank(thread_context_t* ctx, const lock_node_t* lock)
+{
+    if (!lock->rank) {
+        ctx->unranked_held++;
+    } else if (lock->rank > ctx->max_held_rank) {
+        ctx->max_held_rank = lock->rank;
+    }
 }
 
-static bool would_create_cycle(lock_node_t* from, lock_node_t* to)
+/// Moves every held entry of `ctx` to its free list.
+static void drop_held_locks(thread_context_t* ctx)
 {
-    lock_node_t** visited = smalloc(sizeof(lock_node_t*) * 1000); // Limite arbitrário
-    int visit_count = 0;
+    while (ctx->held_locks) {
+        held_lock_t* held = ctx->held_locks;
+        ctx->held_locks = held->next;
+        held->next = ctx->free_held;
+        ctx->free_held = held;
+    }
+    ctx->max_held_rank = 0;
+    ctx->unranked_held = 0;
+}
 
-    bool cycle_found = has_cycle_dfs(to, from, visited, &visit_count);
+static void thread_context_destructor(void* data);
 
-    return cycle_found;
+static void create_context_key(void)
+{
+    pthread_key_create(&context_key, thread_context_destructor);
 }
 
-static thread_context_t* add_lock_to_thread_context(thread_context_t* ctx, lock_node_t* lock)
+static thread_context_t* create_thread_context(void)
 {
+    thread_context_t* ctx = free_contexts;
     if (ctx) {
-        held_lock_t* new_held = smalloc(sizeof(held_lock_t));
-        new_held->lock = lock;
-        new_held->next = ctx->held_locks;
-        ctx->held_locks = new_held;
-        return ctx;
+        free_contexts = ctx->next;
+    } else {
+        ctx = lockdep_alloc(sizeof(thread_context_t));
+        ctx->free_held = NULL;
     }
 
-    ctx = smalloc(sizeof(thread_context_t));
-    ctx->held_locks = smalloc(sizeof(held_lock_t));
     ctx->thread_id = pthread_self();
-    ctx->held_locks->lock = lock;
-    ctx->held_locks->next = NULL;
+    ctx->held_locks = NULL;
+    ctx->max_held_rank = 0;
+    ctx->unranked_held = 0;
+    ctx->epoch = atomic_load_explicit(&held_epoch, memory_order_relaxed);
+    atomic_init(&ctx->order_epoch, 0);
     ctx->next = thread_registry;
     thread_registry = ctx;
+
+    pthread_once(&context_key_once, create_context_key);
+    pthread_setspecific(context_key, ctx);
+    current_context = ctx;
+    return ctx;
+}
+
+// Stands for the context of a thread that has none yet but queued spinlock
+// operations, so that the destructor still runs and applies them.
+#define SPIN_OPS_ONLY ((void*)1)
+
+/// Runs when a thread that took locks exits. Its deferred spinlock operations
+/// are applied first, then the locks it still holds are reported; its context
+/// and held-lock entries go back to the free pool.
+static void thread_context_destructor(void* data)
+{
+    // Applying the operations may create the context, which brings the
+    // destructor back for it.
+    if (data == SPIN_OPS_ONLY) {
+        graph_lock();
+        graph_unlock();
+        return;
+    }
+
+    thread_context_t* ctx = data;
+
+    graph_lock();
+
+    if (ctx->held_locks && ctx->epoch == atomic_load_explicit(&held_epoch, memory_order_relaxed)) {
+        fprintf(stderr, "[LOCKDEP] Thread %lu exited while holding locks:\n", ctx->thread_id);
+        for (held_lock_t* held = ctx->held_locks; held; held = held->next) {
+            fprintf(stderr, "[LOCKDEP] - %s %p\n", lockdep_sync_type_to_string(held->lock->type),
+                    held->lock->lock_addr);
+        }
+    }
+    drop_held_locks(ctx);
+
+    for (thread_context_t** link = &thread_registry; *link; link = &(*link)->next) {
+        if (*link == ctx) {
+            *link = ctx->next;
+            break;
+        }
+    }
+    ctx->next = free_contexts;
+    free_contexts = ctx;
+    current_context = NULL;
+
+    graph_unlock();
+}
+
+static thread_context_t* add_lock_to_thread_context(thread_context_t* ctx, lock_node_t* lock, bool read)
+{
+    if (!ctx) ctx = create_thread_context();
+    if (!read && !lock->exclusive) lock->exclusive = true;
+
+    held_lock_t* new_held = ctx->free_held;
+    if (new_held) {
+        ctx->free_held = new_held->next;
+    } else {
+        new_held = lockdep_alloc(sizeof(held_lock_t));
+    }
+    new_held->lock = lock;
+    new_held->read = read;
+    new_held->next = ctx->held_locks;
+    ctx->held_locks = new_held;
+    account_held_rank(ctx, lock);
     return ctx;
 }
 
@@ -246,134 +865,1008 @@ static thread_context_t* release_lock_from_thread_context(thread_context_t* ctx,
     held_lock_t** held = &ctx->held_locks;
     while (*held) {
         if ((*held)->lock->lock_addr == lock_addr) {
-            *held = (*held)->next;
-            // free memory with arena
+            held_lock_t* released = *held;
+            *held = released->next;
+            released->next = ctx->free_held;
+            ctx->free_held = released;
             break;
         }
         held = &(*held)->next;
     }
+
+    // Releases can happen in any order, so the rank summary is recomputed.
+    ctx->max_held_rank = 0;
+    ctx->unranked_held = 0;
+    for (held_lock_t* h = ctx->held_locks; h; h = h->next) {
+        account_held_rank(ctx, h->lock);
+    }
+    return ctx;
+}
+
+/// Returns the calling thread's context, dropping its held locks if they were
+/// recorded before tracking was last turned off: lock operations made while
+/// lockdep was off went unseen, so that state can no longer be trusted.
+static thread_context_t* current_thread_context(void)
+{
+    thread_context_t* ctx = current_context;
+    unsigned epoch = atomic_load_explicit(&held_epoch, memory_order_relaxed);
+
+    if (ctx && ctx->epoch != epoch) {
+        drop_held_locks(ctx);
+        ctx->epoch = epoch;
+    }
     return ctx;
 }
 
+/// Decides whether the current acquisition is validated or only recorded.
+static bool should_validate(void)
+{
+    switch (atomic_load_explicit(&lockdep_mode, memory_order_relaxed)) {
+    case LOCKDEP_MODE_FULL:
+    case LOCKDEP_MODE_FROZEN:
+        return true;
+    case LOCKDEP_MODE_SAMPLED:
+        return ++sample_tick % atomic_load_explicit(&sample_rate, memory_order_relaxed) == 0;
+    default:
+        return false;
+    }
+}
+
+/// In deferred mode, lock operations are only queued for the analyzer thread.
+static inline bool deferred_mode(void)
+{
+    return atomic_load_explicit(&lockdep_mode, memory_order_relaxed) == LOCKDEP_MODE_DEFERRED;
+}
+
+/// Lock operations still reach lockdep while tracking is off if the watchdog
+/// runs, but only to publish waits and owners for it.
+static inline bool tracking_off(void)
+{
+    return atomic_load_explicit(&lockdep_mode, memory_order_relaxed) == LOCKDEP_MODE_OFF;
+}
+
+// ==================== FROZEN ORDER ====================
+
+// Full validation is the learning mode. Once it has gone `freeze_window_ns`
+// without adding an ordering, the graph is sorted topologically and the mode
+// becomes frozen: an acquisition whose held locks all come earlier in the order
+// cannot close a cycle, so it is validated by comparing positions, from the
+// thread caches, without the graph lock. Acquisitions the order cannot vouch
+// for are validated against the graph as before. A lock created since is
+// placed before or after all the others by its first ordering. The first new
+// ordering between two placed locks that does not fit the order switches back
+// to learning, and the order is computed again once the graph has settled.
+//
+// Threads read the order without any lock, so a table that is replaced, by a
+// new order or a bigger copy, is only freed once no thread can still be
+// reading it. A thread announces the epoch it starts reading in, and a table
+// replaced at epoch E is freed once every reading thread started at E or later.
+
+#define DEFAULT_FREEZE_MS 1000 // Window used after a thaw when none was set.
+
+static lockdep_order_t* _Atomic frozen_order;
+static _Atomic uint64_t freeze_window_ns; // 0 when the graph is never frozen by itself.
+static _Atomic uint64_t last_edge_ns;     // When the last ordering was added.
+static _Atomic uint64_t order_epoch = 1;
+static lockdep_order_t* retired_orders;
+
+/// Tells whether every lock `ctx` holds comes before `lock` in the frozen
+/// order. Always false outside frozen mode.
+static bool frozen_ordered(thread_context_t* ctx, const lock_node_t* lock)
+{
+    if (atomic_load_explicit(&lockdep_mode, memory_order_acquire) != LOCKDEP_MODE_FROZEN) return false;
+
+    atomic_store(&ctx->order_epoch, atomic_load(&order_epoch));
+    const lockdep_order_t* order = atomic_load(&frozen_order);
+    uint32_t position = lockdep_order_position(order, lock);
+
+    bool ordered = position != 0;
+    for (held_lock_t* held = ctx->held_locks; ordered && held; held = held->next) {
+        uint32_t held_position = lockdep_order_position(order, held->lock);
+        ordered = held_position && held_position < position;
+    }
+    atomic_store_explicit(&ctx->order_epoch, 0, memory_order_release);
+    return ordered;
+}
+
+/// Frees the replaced tables that no thread can still be reading. Must be
+/// called with the graph lock held.
+static void reclaim_orders(void)
+{
+    uint64_t oldest = UINT64_MAX;
+    for (thread_context_t* ctx = thread_registry; ctx; ctx = ctx->next) {
+        uint64_t epoch = atomic_load(&ctx->order_epoch);
+        if (epoch && epoch < oldest) oldest = epoch;
+    }
+
+    for (lockdep_order_t** link = &retired_orders; *link;) {
+        lockdep_order_t* order = *link;
+        if (order->retired <= oldest) {
+            *link = order->next;
+            free(order);
+        } else {
+            link = &order->next;
+        }
+    }
+}
+
+/// Makes `order` the frozen order, and retires the one it replaces. Must be
+/// called with the graph lock held.
+static void publish_order(lockdep_order_t* order)
+{
+    lockdep_order_t* replaced = atomic_exchange(&frozen_order, order);
+    if (!replaced || replaced == order) return;
+
+    replaced->retired = atomic_fetch_add(&order_epoch, 1) + 1;
+    replaced->next = retired_orders;
+    retired_orders = replaced;
+    reclaim_orders();
+}
+
+/// Computes the order of the current graph and publishes it. Must be called
+/// with the graph lock held.
+static bool freeze_locked(void)
+{
+    lockdep_order_t* order = lockdep_order_compute();
+    if (!order) return false;
+
+    publish_order(order);
+    fprintf(stderr, "[LOCKDEP] Lock graph frozen: %u of %u locks in topological order\n", order->ordered,
+            order->count);
+    return true;
+}
+
+/// Freezes the graph once no ordering has been added for a whole window. Called
+/// by acquisitions, so the graph lock is only tried.
+static void maybe_freeze(void)
+{
+    uint64_t window = atomic_load_explicit(&freeze_window_ns, memory_order_relaxed);
+    if (!window || atomic_load_explicit(&lockdep_mode, memory_order_relaxed) != LOCKDEP_MODE_FULL) return;
+    if (coarse_now_ns() - atomic_load_explicit(&last_edge_ns, memory_order_relaxed) < window) return;
+    if (!graph_trylock()) return;
+
+    // Orderings are only added with the graph lock held, so the window holds.
+    lockdep_mode_t expected = LOCKDEP_MODE_FULL;
+    if (coarse_now_ns() - atomic_load_explicit(&last_edge_ns, memory_order_relaxed) >= window &&
+        atomic_load(&lockdep_mode) == LOCKDEP_MODE_FULL && freeze_locked()) {
+        atomic_compare_exchange_strong(&lockdep_mode, &expected, LOCKDEP_MODE_FROZEN);
+    }
+    graph_unlock();
+}
+
+/// Gives `lock` a position at one end of the frozen order if it was created
+/// since the order was computed. Such a lock is ordered with no placed lock
+/// until then: its first ordering with one would have placed it. Returns its
+/// position, 0 if it has none. Must be called with the graph lock held.
+static uint32_t frozen_place(const lock_node_t* lock, bool first)
+{
+    lockdep_order_t* order = atomic_load_explicit(&frozen_order, memory_order_relaxed);
+    uint32_t position = lockdep_order_position(order, lock);
+    if (position || lock->id < order->count) return position;
+
+    lockdep_order_t* placed = lockdep_order_place(order, lock, first);
+    if (!placed) return 0;
+    publish_order(placed);
+    return lockdep_order_position(placed, lock);
+}
+
+/// Called with the graph lock held for every new ordering. It restarts the
+/// window, places new locks, and ends frozen mode if the order does not vouch
+/// for an ordering between placed locks.
+static void frozen_edge_added(const lock_node_t* parent, const lock_node_t* child)
+{
+    atomic_store_explicit(&last_edge_ns, coarse_now_ns(), memory_order_relaxed);
+    if (atomic_load_explicit(&lockdep_mode, memory_order_relaxed) != LOCKDEP_MODE_FROZEN) return;
+
+    // Orderings with a lock that has no position are validated against the
+    // graph, and do not bind the order.
+    uint32_t parent_position = frozen_place(parent, true);
+    uint32_t child_position = frozen_place(child, false);
+    if (!parent_position || !child_position || parent_position < child_position) return;
+
+    lockdep_mode_t expected = LOCKDEP_MODE_FROZEN;
+    if (!atomic_compare_exchange_strong(&lockdep_mode, &expected, LOCKDEP_MODE_FULL)) return;
+
+    // A graph frozen on request freezes again by itself.
+    uint64_t unset = 0;
+    atomic_compare_exchange_strong(&freeze_window_ns, &unset, DEFAULT_FREEZE_MS * 1000000ull);
+
+    fprintf(stderr, "[LOCKDEP] Ordering %s %p -> %s %p does not fit the frozen order, learning again\n",
+            lockdep_sync_type_to_string(parent->type), parent->lock_addr, lockdep_sync_type_to_string(child->type),
+            child->lock_addr);
+}
+
+// ==================== MODES ====================
+
+static const char* const mode_names[] = {
+    [LOCKDEP_MODE_OFF] = "off",
+    [LOCKDEP_MODE_RECORD] = "record",
+    [LOCKDEP_MODE_SAMPLED] = "sampled",
+    [LOCKDEP_MODE_FULL] = "full",
+    [LOCKDEP_MODE_DEFERRED] = "deferred",
+    [LOCKDEP_MODE_FROZEN] = "frozen",
+};
+
+const char* lockdep_mode_to_string(lockdep_mode_t mode)
+{
+    return (unsigned)mode <= LOCKDEP_MODE_FROZEN ? mode_names[mode] : "unknown";
+}
+
+bool lockdep_mode_from_string(const char* name, lockdep_mode_t* mode)
+{
+    for (unsigned i = 0; i <= LOCKDEP_MODE_FROZEN; i++) {
+        if (strcmp(name, mode_names[i]) == 0) {
+            *mode = (lockdep_mode_t)i;
+            return true;
+        }
+    }
+    return false;
+}
+
+void lockdep_set_mode(lockdep_mode_t mode)
+{
+    // The analyzer runs before the first operation is queued for it.
+    if (mode == LOCKDEP_MODE_DEFERRED && !lockdep_deferred_start()) {
+        fprintf(stderr, "[LOCKDEP] Deferred mode unavailable, using full validation\n");
+        mode = LOCKDEP_MODE_FULL;
+    }
+
+    // Likewise, the order is published before any thread can use it.
+    if (mode == LOCKDEP_MODE_FROZEN) {
+        graph_lock();
+        bool frozen = freeze_locked();
+        graph_unlock();
+        if (!frozen) {
+            fprintf(stderr, "[LOCKDEP] Frozen mode unavailable, using full validation\n");
+            mode = LOCKDEP_MODE_FULL;
+        }
+    }
+
+    // Learning starts over whenever full validation is turned on.
+    if (mode == LOCKDEP_MODE_FULL) atomic_store_explicit(&last_edge_ns, coarse_now_ns(), memory_order_relaxed);
+
+    lockdep_mode_t previous = atomic_exchange(&lockdep_mode, mode);
+
+    // Threads resync their held locks when they see the new epoch, which is
+    // published before tracking resumes. In deferred mode, the held locks are
+    // those the analyzer replays, and operations made outside it went unseen
+    // by one side or the other.
+    if ((previous == LOCKDEP_MODE_OFF && mode != LOCKDEP_MODE_OFF) ||
+        ((previous == LOCKDEP_MODE_DEFERRED) != (mode == LOCKDEP_MODE_DEFERRED))) {
+        atomic_fetch_add(&held_epoch, 1);
+        // The watchdog keeps the owners published while tracking is off.
+        if (!lockdep_watchdog_running()) lockdep_owner_reset();
+    }
+    atomic_store(&lockdep_enabled, mode != LOCKDEP_MODE_OFF || lockdep_watchdog_running());
+
+    if (previous == LOCKDEP_MODE_DEFERRED && mode != LOCKDEP_MODE_DEFERRED) lockdep_deferred_stop();
+}
+
+lockdep_mode_t lockdep_get_mode(void)
+{
+    return atomic_load(&lockdep_mode);
+}
+
+void lockdep_set_sample_rate(unsigned rate)
+{
+    atomic_store(&sample_rate, rate ? rate : 1);
+}
+
+unsigned lockdep_get_sample_rate(void)
+{
+    return atomic_load(&sample_rate);
+}
+
+unsigned lockdep_held_epoch(void)
+{
+    return atomic_load_explicit(&held_epoch, memory_order_relaxed);
+}
+
+// ==================== FORK ====================
+
+// fork() copies only the calling thread. Any lockdep mutex another thread held
+// at that moment would stay locked forever in the child, so both are taken
+// around fork(). The child keeps the learned graph, shared copy-on-write with
+// the parent, and validates against it right away.
+
+static void fork_prepare(void)
+{
+    graph_lock();
+    pthread_mutex_lock(&arena_mutex);
+}
+
+static void fork_parent(void)
+{
+    pthread_mutex_unlock(&arena_mutex);
+    graph_unlock();
+}
+
+/// The other threads do not exist in the child. Their contexts, and the locks
+/// they held, go back to the free pool, so the child reuses them for its own
+/// threads and never reports those locks. The mutexes are reinitialized rather
+/// than unlocked, as the child has no business trusting their copied state.
+static void fork_child(void)
+{
+    pthread_mutex_t unlocked = PTHREAD_MUTEX_INITIALIZER;
+    arena_mutex = unlocked;
+    lockdep_mutex = unlocked;
+    lockdep_recursion--;
+
+    thread_context_t* ctx = thread_registry;
+    while (ctx) {
+        thread_context_t* next = ctx->next;
+        if (ctx != current_context) {
+            drop_held_locks(ctx);
+            ctx->next = free_contexts;
+            free_contexts = ctx;
+        }
+        ctx = next;
+    }
+    thread_registry = current_context;
+    if (current_context) current_context->next = NULL;
+
+    lockdep_owner_atfork_child();
+    lockdep_watchdog_atfork_child();
+    lockdep_control_atfork_child();
+    lockdep_deferred_atfork_child();
+}
+
 // ==================== PUBLIC FUNCTIONS ====================
 
 void lockdep_init(void)
 {
+    pthread_atfork(fork_prepare, fork_parent, fork_child);
+
+    const char* rate = getenv("LOCKDEP_SAMPLE_RATE");
+    if (rate) {
+        lockdep_set_sample_rate(strtoul(rate, NULL, 10));
+    }
+
+    const char* freeze = getenv("LOCKDEP_FREEZE_MS");
+    if (freeze) {
+        atomic_store(&freeze_window_ns, strtoull(freeze, NULL, 10) * 1000000ull);
+    }
+
+    lockdep_mode_t mode = LOCKDEP_MODE_FULL;
+    const char* mode_name = getenv("LOCKDEP_MODE");
+    if (mode_name && !lockdep_mode_from_string(mode_name, &mode)) {
+        fprintf(stderr, "[LOCKDEP] Unknown LOCKDEP_MODE '%s', using full validation\n", mode_name);
+    }
+
     const char* env = getenv("LOCKDEP_DISABLE");
     if (env && strcmp(env, "1") == 0) {
-        lockdep_enabled = false;
-        return;
+        mode = LOCKDEP_MODE_OFF;
+    }
+    // The frozen order is computed once the graph file is loaded.
+    lockdep_set_mode(mode == LOCKDEP_MODE_FROZEN ? LOCKDEP_MODE_FULL : mode);
+
+    // The control channel is served even when lockdep starts disabled, so it
+    // can be turned on in a live process.
+    const char* control = getenv("LOCKDEP_CONTROL");
+    if (control) {
+        lockdep_control_start(control);
+    }
+
+    lockdep_stats_configure(getenv("LOCKDEP_STATS") != NULL);
+
+    const char* trace = getenv("LOCKDEP_TRACE");
+    trace_enabled = trace && strcmp(trace, "1") == 0;
+
+    const char* closure_max = getenv("LOCKDEP_CLOSURE_MAX_NODES");
+    if (closure_max) {
+        lockdep_closure_configure(strtoul(closure_max, NULL, 10));
+    }
+
+    // Shared locks are keyed when their node is created, so the segment is
+    // attached before any graph is loaded.
+    const char* shm = getenv("LOCKDEP_SHM");
+    if (shm) {
+        lockdep_shm_attach(shm);
+    }
+
+    const char* report_file = getenv("LOCKDEP_REPORT_FILE");
+    if (report_file) {
+        lockdep_report_configure(report_file);
+    }
+
+    const char* owners = getenv("LOCKDEP_OWNERS");
+    if (owners && strcmp(owners, "1") == 0) {
+        lockdep_owner_enable();
+    }
+
+    const char* watchdog = getenv("LOCKDEP_WATCHDOG_MS");
+    if (watchdog) {
+        lockdep_watchdog_start(strtoul(watchdog, NULL, 10));
+    }
+
+    if (mode == LOCKDEP_MODE_OFF) return;
+
+    const char* graph_file = getenv("LOCKDEP_GRAPH_FILE");
+    if (graph_file && access(graph_file, R_OK) == 0) {
+        lockdep_load_graph(graph_file);
+    }
+
+    const char* rank_file = getenv("LOCKDEP_RANK_FILE");
+    if (rank_file) {
+        lockdep_load_ranks(rank_file);
+    }
+
+    if (mode == LOCKDEP_MODE_FROZEN) {
+        lockdep_set_mode(mode);
     }
 
     fprintf(stderr, "[LOCKDEP] Lockdep initialized with extended synchronization support\n");
 }
 
-bool lockdep_acquire_lock(const void* lock_addr, sync_type_t type)
+void lockdep_fini(void)
 {
-    printf("[LOCKDEP] Acquiring %s lock %p\n", sync_type_to_string(type), lock_addr);
+    lockdep_control_stop();
+    lockdep_watchdog_stop();
+    lockdep_deferred_stop(); // Replays what is still queued.
+
+    // So are the calling thread's spinlock operations and buffered orderings.
+    if (spin_deferred_count || edge_buffer_count) {
+        graph_lock();
+        graph_unlock();
+    }
 
-    pthread_mutex_lock(&lockdep_mutex);
+    // Nothing was learned if lockdep never got turned on.
+    if (!lockdep_graph_node_count()) return;
+
+    graph_lock();
+    lockdep_report_flush();
+    graph_unlock();
+
+    if (getenv("LOCKDEP_STATS")) {
+        lockdep_print_stats();
+    }
+
+    const char* cycle_report = getenv("LOCKDEP_CYCLE_REPORT");
+    if (cycle_report && strcmp(cycle_report, "1") == 0) {
+        lockdep_report_cycles();
+    }
+
+    const char* graph_file = getenv("LOCKDEP_GRAPH_FILE");
+    if (graph_file) {
+        lockdep_save_graph(graph_file);
+    }
+
+    const char* export_file = getenv("LOCKDEP_EXPORT_FILE");
+    if (export_file) {
+        lockdep_export_format_t format = LOCKDEP_EXPORT_DOT;
+        if (!lockdep_export_format_from_path(export_file, &format)) {
+            fprintf(stderr, "[LOCKDEP] Unknown export format for %s, writing DOT\n", export_file);
+        }
+        lockdep_export_graph(export_file, format);
+    }
+}
+
+void lockdep_print_stats(void)
+{
+    graph_lock();
+    uint32_t nodes = lockdep_graph_node_count(), edges = lockdep_graph_edge_count();
+    size_t bytes = lockdep_graph_bytes();
+    graph_unlock();
+
+    lockdep_stats_report(nodes, edges, bytes);
+}
+
+unsigned lockdep_report_cycles(void)
+{
+    graph_lock();
+    unsigned groups = lockdep_scc_report();
+    graph_unlock();
+    return groups;
+}
+
+size_t lockdep_find_path(const void* from_addr, const void* to_addr, const void** path, size_t max)
+{
+    graph_lock();
+    const lock_node_t* from = lockdep_graph_lookup(from_addr);
+    const lock_node_t* to = lockdep_graph_lookup(to_addr);
+    uint32_t length = from && to ? find_path(from, to) : 0;
+    for (uint32_t i = 0; i < length && i < max; i++) {
+        path[i] = lockdep_graph_node(search_stack[i])->lock_addr;
+    }
+    graph_unlock();
+    return length;
+}
+
+bool lockdep_lock_stats(const void* lock_addr, lockdep_lock_stats_t* stats)
+{
+    graph_lock();
+    const lock_node_t* lock = lockdep_graph_lookup(lock_addr);
+    if (lock) {
+        *stats = (lockdep_lock_stats_t){
+            .type = lock->type,
+            .rank = lock->rank,
+            .callsite = lock->callsite,
+            .exclusive = lock->exclusive,
+            .orderings = lock->out_degree,
+        };
+        for (uint32_t i = 0; i < lock->out_degree; i++) {
+            uint32_t edge = lockdep_edge_id(lock, i);
+            if (*lockdep_edge_flags(edge) & LOCKDEP_EDGE_INVERSION) stats->inversions++;
+            stats->nested += atomic_load_explicit(lockdep_edge_hits(edge), memory_order_relaxed);
+        }
+    }
+    graph_unlock();
+    return lock != NULL;
+}
+
+bool lockdep_export_graph(const char* path, lockdep_export_format_t format)
+{
+    bool exported = lockdep_export_write(path, format);
+
+    if (!exported) fprintf(stderr, "[LOCKDEP] Failed to export lock graph to %s\n", path);
+    return exported;
+}
+
+bool lockdep_save_graph(const char* path)
+{
+    graph_lock();
+    bool saved = lockdep_persist_save(path);
+    graph_unlock();
+
+    if (!saved) fprintf(stderr, "[LOCKDEP] Failed to save lock graph to %s\n", path);
+    return saved;
+}
+
+bool lockdep_load_graph(const char* path)
+{
+    graph_lock();
+
+    bool loaded = lockdep_persist_load(path);
+    if (loaded) {
+        uint32_t count = lockdep_graph_node_count();
+        for (uint32_t id = 0; id < count; id++) {
+            lockdep_persist_bind(lockdep_graph_node(id));
+        }
+    }
+
+    graph_unlock();
+
+    if (!loaded) fprintf(stderr, "[LOCKDEP] Failed to load lock graph from %s\n", path);
+    return loaded;
+}
+
+void lockdep_set_rank(const void* lock_addr, unsigned rank)
+{
+    graph_lock();
+
+    lock_node_t* lock = find_or_create_lock(lock_addr, SYNC_MUTEX, NULL);
+    lock->rank = rank;
+
+    graph_unlock();
+}
 
-    lock_node_t* lock = find_or_create_lock(lock_addr, type);
-    thread_context_t* ctx = find_thread_context(pthread_self());
+static void print_held_locks(const thread_context_t* ctx)
+{
+    if (!trace_enabled) return;
+
+    printf("[LOCKDEP] Thread %lu currently holds locks:\n", ctx->thread_id);
+    for (held_lock_t* held = ctx->held_locks; held; held = held->next) {
+        printf("[LOCKDEP] - %s %p\n", lockdep_sync_type_to_string(held->lock->type), held->lock->lock_addr);
+    }
+}
+
+/// Tells whether the thread already holds `lock` for reading. Another read
+/// acquisition of it is then recursive, and cannot wait.
+static bool holds_for_reading(const thread_context_t* ctx, const lock_node_t* lock)
+{
+    for (const held_lock_t* held = ctx->held_locks; held; held = held->next) {
+        if (held->lock == lock && held->read) return true;
+    }
+    return false;
+}
+
+/// Validates the acquisition against the locks the thread holds and records it.
+/// `read` tells whether it is an rwlock read acquisition. Must be called with
+/// the graph lock held.
+static thread_context_t* acquire_locked(thread_context_t* ctx, const void* lock_addr, sync_type_t type, bool read,
+                                        const void* ip, bool validate, bool* allowed)
+{
+    lock_node_t* lock = find_or_create_lock(lock_addr, type, ip);
+
+    *allowed = false;
+    cache_node(lock);
+
+    // A recursive read adds no ordering: the locks held before the first one
+    // already come before this lock.
+    if (read && ctx && holds_for_reading(ctx, lock)) {
+        lockdep_count(LOCKDEP_EVENT_SHARED);
+        *allowed = true;
+        return add_lock_to_thread_context(ctx, lock, true);
+    }
 
     // Verifica dependências com locks já mantidos
-    if (ctx && ctx->held_locks) {
+    if (ctx && ctx->held_locks && !validate) {
+        for (held_lock_t* held = ctx->held_locks; held; held = held->next) {
+            uint8_t edge_type = lockdep_edge_type(held->read, read);
+            uint32_t edge = record_dependency(held->lock, lock, edge_type, false);
+            remember_edge(held->lock, lock, edge_type, edge, false);
+        }
+    } else if (ctx && ctx->held_locks) {
+        // Ranked locks only need their rank compared against the highest one
+        // held. The graph is searched only if an unranked lock is involved.
+        if (lock->rank && lock->rank <= ctx->max_held_rank) {
+            if (lockdep_report_rank(lock, ctx->max_held_rank, ip)) {
+                printf("[LOCKDEP] Rank violation: %s %p (rank %u) acquired while holding rank %u\n",
+                       lockdep_sync_type_to_string(lock->type), lock->lock_addr, lock->rank, ctx->max_held_rank);
+            }
+            return ctx;
+        }
+        // So do locks that fit the frozen order, and read acquisitions of a
+        // lock never held exclusive: no thread ever waits on it, so no
+        // deadlock goes through it. The first writer's orderings are searched.
+        bool rank_ordered = lock->rank && ctx->unranked_held == 0;
+        if (!rank_ordered && frozen_ordered(ctx, lock)) {
+            lockdep_count(LOCKDEP_EVENT_FROZEN);
+            rank_ordered = true;
+        } else if (!rank_ordered && read && !lock->exclusive) {
+            lockdep_count(LOCKDEP_EVENT_SHARED);
+            rank_ordered = true;
+        }
+
         held_lock_t* held = ctx->held_locks;
         while (held) {
-            // Adiciona dependência: held_lock -> new_lock
-            add_dependency(held->lock, lock);
-
-            // Verifica se criaria um ciclo
-            if (would_create_cycle(held->lock, lock)) {
-                printf("[LOCKDEP] Cycle detected between %s %p and %s %p\n", sync_type_to_string(held->lock->type),
-                       held->lock->lock_addr, sync_type_to_string(lock->type), lock->lock_addr);
-                pthread_mutex_unlock(&lockdep_mutex);
-                return false;
+            uint8_t edge_type = lockdep_edge_type(held->read, read);
+            if (rank_ordered) {
+                uint32_t edge = record_dependency(held->lock, lock, edge_type, true);
+                remember_edge(held->lock, lock, edge_type, edge, true);
+                held = held->next;
+                continue;
+            }
+
+            // Adiciona e valida a dependência: held_lock -> new_lock
+            uint32_t edge;
+            bool linked = link_dependency(held->lock, lock, edge_type, &edge);
+            count_hit(edge);
+            if (!linked) {
+                uint32_t length = report_cycle(held->lock, lock, edge, ip);
+                if (length) {
+                    printf("[LOCKDEP] Cycle detected between %s %p and %s %p\n",
+                           lockdep_sync_type_to_string(held->lock->type), held->lock->lock_addr,
+                           lockdep_sync_type_to_string(lock->type), lock->lock_addr);
+                    print_cycle(length);
+                }
+                return ctx;
             }
+            remember_edge(held->lock, lock, edge_type, edge, true);
 
             held = held->next;
         }
     }
 
-    ctx = add_lock_to_thread_context(ctx, lock);
+    *allowed = true;
+    return add_lock_to_thread_context(ctx, lock, read);
+}
 
-    // Debug: mostra locks atualmente mantidos
-    held_lock_t* held = ctx->held_locks;
-    printf("[LOCKDEP] Thread %lu currently holds locks:\n", ctx->thread_id);
-    while (held) {
-        printf("[LOCKDEP] - %s %p\n", sync_type_to_string(held->lock->type), held->lock->lock_addr);
-        held = held->next;
+/// Validates and records the acquisition from the thread's own caches, without
+/// the graph lock. A thread that holds no other lock only pushes the lock onto
+/// its held stack. Returns NULL when the slow path is needed: the thread or the
+/// lock is new, an ordering still has to be validated, a rank violation has to
+/// be reported, a lock is first held exclusive, or spinlock operations are
+/// waiting to be applied first.
+static thread_context_t* acquire_cached(const void* lock_addr, sync_type_t type, bool read, bool validate)
+{
+    thread_context_t* ctx = current_thread_context();
+    if (!ctx || spin_deferred_count) return NULL;
+
+    lock_node_t* lock = cached_node(lock_addr, type);
+    if (!lock || (!read && !lock->exclusive)) return NULL;
+    if (read && holds_for_reading(ctx, lock)) {
+        lockdep_count(LOCKDEP_EVENT_SHARED);
+        return add_lock_to_thread_context(ctx, lock, true);
+    }
+    if (validate && lock->rank && lock->rank <= ctx->max_held_rank) return NULL;
+
+    // In frozen mode, comparing positions stands for the ordering checks.
+    if (validate && ctx->held_locks && frozen_ordered(ctx, lock)) {
+        lockdep_count(LOCKDEP_EVENT_FROZEN);
+        validate = false;
+    } else if (validate && ctx->held_locks && read && !lock->exclusive) {
+        lockdep_count(LOCKDEP_EVENT_SHARED);
+        validate = false;
     }
 
-    pthread_mutex_unlock(&lockdep_mutex);
-    return true;
+    for (held_lock_t* held = ctx->held_locks; held; held = held->next) {
+        const edge_filter_entry_t* edge = filtered_edge(held->lock, lock, lockdep_edge_type(held->read, read));
+        if (validate && (!edge || !edge->checked)) return NULL;
+    }
+
+    for (held_lock_t* held = ctx->held_locks; held; held = held->next) {
+        uint8_t edge_type = lockdep_edge_type(held->read, read);
+        edge_filter_entry_t* edge = filtered_edge(held->lock, lock, edge_type);
+        if (!edge) {
+            buffer_edge(held->lock, lock, edge_type);
+        } else if (edge->edge != NO_EDGE) {
+            count_hit(edge->edge);
+        } else {
+            edge->pending_hits++;
+        }
+    }
+    if (!validate) maybe_flush_pending_edges();
+
+    return add_lock_to_thread_context(ctx, lock, read);
+}
+
+static bool acquire_lock(const void* lock_addr, sync_type_t type, bool read, const void* ip)
+{
+    if (tracking_off()) return true;
+
+    uint64_t start = lockdep_timer_start();
+    lockdep_count(LOCKDEP_EVENT_ACQUIRE);
+
+    if (deferred_mode()) {
+        lockdep_deferred_push(read ? LOCKDEP_DEFERRED_ACQUIRE_READ : LOCKDEP_DEFERRED_ACQUIRE, lock_addr, type, ip,
+                              NULL);
+        lockdep_timer_stop(LOCKDEP_TIMER_ACQUIRE, start);
+        return true;
+    }
+
+    if (trace_enabled) printf("[LOCKDEP] Acquiring %s lock %p\n", lockdep_sync_type_to_string(type), lock_addr);
+
+    bool validate = should_validate();
+    bool allowed = true;
+    if (validate) lockdep_count(LOCKDEP_EVENT_VALIDATE);
+
+    thread_context_t* ctx = acquire_cached(lock_addr, type, read, validate);
+    if (ctx) {
+        lockdep_count(LOCKDEP_EVENT_CACHE_HIT);
+    } else {
+        lockdep_shm_prepare(lock_addr);
+        graph_lock();
+        ctx = acquire_locked(current_thread_context(), lock_addr, type, read, ip, validate, &allowed);
+        graph_unlock();
+    }
+
+    // Debug: mostra locks atualmente mantidos
+    if (allowed) print_held_locks(ctx);
+
+    maybe_freeze();
+    lockdep_timer_stop(LOCKDEP_TIMER_ACQUIRE, start);
+    return allowed;
+}
+
+bool lockdep_acquire_lock(const void* lock_addr, sync_type_t type, const void* ip)
+{
+    return acquire_lock(lock_addr, type, false, ip);
 }
 
 void lockdep_release_lock(const void* lock_addr)
 {
-    printf("[LOCKDEP] Releasing lock %p\n", lock_addr);
+    if (tracking_off()) return;
 
-    pthread_mutex_lock(&lockdep_mutex);
+    uint64_t start = lockdep_timer_start();
+    lockdep_count(LOCKDEP_EVENT_RELEASE);
+
+    if (deferred_mode()) {
+        lockdep_deferred_push(LOCKDEP_DEFERRED_RELEASE, lock_addr, SYNC_MUTEX, NULL, NULL);
+        lockdep_timer_stop(LOCKDEP_TIMER_RELEASE, start);
+        return;
+    }
+
+    if (trace_enabled) printf("[LOCKDEP] Releasing lock %p\n", lock_addr);
 
-    thread_context_t* ctx = find_thread_context(pthread_self());
+    // The held locks belong to the thread alone. The graph lock is only needed
+    // to apply the spinlock operations that were deferred before this release.
+    bool locked = spin_deferred_count != 0;
+    if (locked) graph_lock();
+
+    thread_context_t* ctx = current_thread_context();
     if (ctx) {
         ctx = release_lock_from_thread_context(ctx, lock_addr);
 
         // Debug: mostra locks atualmente mantidos
-        held_lock_t* held = ctx->held_locks;
-        printf("[LOCKDEP] Thread %lu currently holds locks:\n", ctx->thread_id);
-        while (held) {
-            printf("[LOCKDEP] - %s %p\n", sync_type_to_string(held->lock->type), held->lock->lock_addr);
-            held = held->next;
+        print_held_locks(ctx);
+    }
+
+    if (locked) graph_unlock();
+    lockdep_timer_stop(LOCKDEP_TIMER_RELEASE, start);
+}
+
+// ==================== SPINLOCKS ====================
+
+// A thread tracking a spinlock must keep spinning, never sleep on lockdep's
+// own mutex. Spinlock operations therefore only try the graph lock, and when it
+// is busy they are queued per thread and applied, in order, by the thread's
+// next lockdep call. Deferred acquisitions are recorded without validation;
+// the orderings they add are checked when a validated acquisition reaches
+// them. Only a full queue makes the thread wait, spinning, for the graph lock.
+
+static void apply_deferred_spin_ops(void)
+{
+    unsigned count = spin_deferred_count;
+    spin_deferred_count = 0;
+
+    thread_context_t* ctx = current_thread_context();
+    for (unsigned i = 0; i < count; i++) {
+        const spin_op_t* op = &spin_deferred[i];
+        if (op->kind == SPIN_RELEASE) {
+            release_lock_from_thread_context(ctx, op->lock_addr);
+            continue;
+        }
+
+        lock_node_t* lock = find_or_create_lock(op->lock_addr, SYNC_SPINLOCK, op->ip);
+        for (held_lock_t* held = ctx && op->kind == SPIN_ACQUIRE ? ctx->held_locks : NULL; held; held = held->next) {
+            record_dependency(held->lock, lock, lockdep_edge_type(held->read, false), false);
         }
+        ctx = add_lock_to_thread_context(ctx, lock, false);
     }
+}
 
-    pthread_mutex_unlock(&lockdep_mutex);
+static inline void cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    __asm__ volatile("yield");
+#endif
 }
 
-// ==================== FUNCTIONS FOR EACH TYPE ====================
+/// Takes the graph lock for a spinlock operation, or defers the operation if
+/// the lock is busy. Returns whether the graph lock was taken.
+static bool spin_graph_lock(const void* lock_addr, const void* ip, spin_op_kind_t kind)
+{
+    if (graph_trylock()) return true;
+
+    if (spin_deferred_count < SPIN_DEFERRED_MAX) {
+        // A thread that exits before its next lockdep call has them applied
+        // by its context destructor.
+        if (!spin_deferred_count && !current_context) {
+            pthread_once(&context_key_once, create_context_key);
+            pthread_setspecific(context_key, SPIN_OPS_ONLY);
+        }
+        spin_deferred[spin_deferred_count++] = (spin_op_t){lock_addr, ip, kind};
+        return false;
+    }
+
+    while (!graph_trylock()) cpu_relax();
+    return true;
+}
 
-bool lockdep_acquire_mutex(const void* mutex_addr)
+bool lockdep_acquire_spinlock(const volatile void* spin_addr, const void* ip)
 {
-    return lockdep_acquire_lock(mutex_addr, SYNC_MUTEX);
+    if (tracking_off()) return true;
+
+    const void* lock_addr = (const void*)spin_addr;
+    lockdep_count(LOCKDEP_EVENT_ACQUIRE);
+
+    if (deferred_mode()) {
+        lockdep_deferred_push(LOCKDEP_DEFERRED_ACQUIRE, lock_addr, SYNC_SPINLOCK, ip, NULL);
+        return true;
+    }
+    lockdep_shm_prepare(lock_addr);
+    if (!spin_graph_lock(lock_addr, ip, SPIN_ACQUIRE)) return true;
+
+    bool allowed;
+    acquire_locked(current_thread_context(), lock_addr, SYNC_SPINLOCK, false, ip, should_validate(), &allowed);
+
+    graph_unlock();
+    return allowed;
 }
 
-bool lockdep_acquire_rwlock_read(const void* rwlock_addr)
+void lockdep_release_spinlock(const volatile void* spin_addr)
 {
-    return lockdep_acquire_lock(rwlock_addr, SYNC_RWLOCK);
+    if (tracking_off()) return;
+
+    const void* lock_addr = (const void*)spin_addr;
+    lockdep_count(LOCKDEP_EVENT_RELEASE);
+
+    if (deferred_mode()) {
+        lockdep_deferred_push(LOCKDEP_DEFERRED_RELEASE, lock_addr, SYNC_SPINLOCK, NULL, NULL);
+        return;
+    }
+    if (!spin_graph_lock(lock_addr, NULL, SPIN_RELEASE)) return;
+
+    release_lock_from_thread_context(current_thread_context(), lock_addr);
+
+    graph_unlock();
 }
 
-bool lockdep_acquire_rwlock_write(const void* rwlock_addr)
+// ==================== TRYLOCK ====================
+
+// A trylock never waits, so it cannot be the acquisition that closes a
+// deadlock, and the locks already held are not ordered before it. Like the
+// kernel's lockdep, a successful trylock only goes onto the held stack: no
+// edge leads to it and no cycle search is run. Locks taken while it is held are
+// still ordered after it.
+
+static void acquire_trylock(const void* lock_addr, sync_type_t type, bool read, const void* ip)
 {
-    return lockdep_acquire_lock(rwlock_addr, SYNC_RWLOCK);
+    if (tracking_off()) return;
+
+    lockdep_count(LOCKDEP_EVENT_ACQUIRE);
+
+    if (deferred_mode()) {
+        lockdep_deferred_op_t op = read ? LOCKDEP_DEFERRED_TRYLOCK_READ : LOCKDEP_DEFERRED_TRYLOCK;
+        lockdep_deferred_push(op, lock_addr, type, ip, NULL);
+        return;
+    }
+
+    if (type == SYNC_SPINLOCK) {
+        if (!spin_graph_lock(lock_addr, ip, SPIN_TRYLOCK)) return;
+    } else {
+        if (trace_enabled) {
+            printf("[LOCKDEP] Acquiring %s lock %p (trylock)\n", lockdep_sync_type_to_string(type), lock_addr);
+        }
+
+        thread_context_t* ctx = current_thread_context();
+        lock_node_t* lock = cached_node(lock_addr, type);
+        if (ctx && lock && (read || lock->exclusive) && !spin_deferred_count) {
+            add_lock_to_thread_context(ctx, lock, read);
+            return;
+        }
+        lockdep_shm_prepare(lock_addr);
+        graph_lock();
+    }
+
+    lock_node_t* lock = find_or_create_lock(lock_addr, type, ip);
+    cache_node(lock);
+    add_lock_to_thread_context(current_thread_context(), lock, read);
+
+    graph_unlock();
 }
 
-bool lockdep_acquire_semaphore(const void* sem_addr)
+void lockdep_acquire_trylock(const volatile void* trylock_addr, sync_type_t type, const void* ip)
 {
-    return lockdep_acquire_lock(sem_addr, SYNC_SEMAPHORE);
+    acquire_trylock((const void*)trylock_addr, type, false, ip);
 }
 
-bool lockdep_wait_condvar(const void* condvar_addr, const void* mutex_addr)
+void lockdep_acquire_trylock_read(const volatile void* rwlock_addr, const void* ip)
 {
+    acquire_trylock((const void*)rwlock_addr, SYNC_RWLOCK, true, ip);
+}
 
-    printf("[LOCKDEP] Waiting on condvar %p with mutex %p\n", condvar_addr, mutex_addr);
+// ==================== FUNCTIONS FOR EACH TYPE ====================
 
-    pthread_mutex_lock(&lockdep_mutex);
+bool lockdep_acquire_mutex(const void* mutex_addr, const void* ip)
+{
+    return lockdep_acquire_lock(mutex_addr, SYNC_MUTEX, ip);
+}
+
+bool lockdep_acquire_rwlock_read(const void* rwlock_addr, const void* ip)
+{
+    return acquire_lock(rwlock_addr, SYNC_RWLOCK, true, ip);
+}
+
+bool lockdep_acquire_rwlock_write(const void* rwlock_addr, const void* ip)
+{
+    return lockdep_acquire_lock(rwlock_addr, SYNC_RWLOCK, ip);
+}
 
-    lock_node_t* condvar_lock = find_or_create_lock(condvar_addr, SYNC_CONDVAR);
-    thread_context_t* ctx = find_thread_context(pthread_self());
+bool lockdep_acquire_semaphore(const void* sem_addr, const void* ip)
+{
+    return lockdep_acquire_lock(sem_addr, SYNC_SEMAPHORE, ip);
+}
+
+/// Orders the condvar after the locks held besides `mutex`, which the wait
+/// releases. Must be called with the graph lock held.
+static bool wait_condvar_locked(thread_context_t* ctx, const void* condvar_addr, const void* mutex_addr,
+                                const void* ip, bool validate)
+{
+    lock_node_t* condvar_lock = find_or_create_lock(condvar_addr, SYNC_CONDVAR, ip);
 
     if (ctx && ctx->held_locks) {
         held_lock_t* held = ctx->held_locks;
         while (held) {
             if (held->lock->lock_addr != mutex_addr) {
-                add_dependency(held->lock, condvar_lock);
-
-                if (would_create_cycle(held->lock, condvar_lock)) {
-                    printf("[LOCKDEP] Cycle detected in condvar wait\n");
-                    pthread_mutex_unlock(&lockdep_mutex);
-                    return false;
+                uint8_t edge_type = lockdep_edge_type(held->read, false);
+                if (!validate) {
+                    record_dependency(held->lock, condvar_lock, edge_type, false);
+                } else {
+                    uint32_t edge;
+                    bool linked = link_dependency(held->lock, condvar_lock, edge_type, &edge);
+                    count_hit(edge);
+                    if (!linked) {
+                        uint32_t length = report_cycle(held->lock, condvar_lock, edge, ip);
+                        if (length) {
+                            printf("[LOCKDEP] Cycle detected in condvar wait\n");
+                            print_cycle(length);
+                        }
+                        return false;
+                    }
                 }
             }
             held = held->next;
@@ -381,13 +1874,34 @@ bool lockdep_wait_condvar(const void* condvar_addr, const void* mutex_addr)
     }
 
     if (ctx) {
+        lockdep_count(LOCKDEP_EVENT_RELEASE);
         release_lock_from_thread_context(ctx, mutex_addr);
     }
-
-    pthread_mutex_unlock(&lockdep_mutex);
     return true;
 }
 
+bool lockdep_wait_condvar(const void* condvar_addr, const void* mutex_addr, const void* ip)
+{
+    if (tracking_off()) return true;
+
+    uint64_t start = lockdep_timer_start();
+    bool allowed = true;
+
+    if (deferred_mode()) {
+        lockdep_deferred_push(LOCKDEP_DEFERRED_CONDVAR_WAIT, condvar_addr, SYNC_CONDVAR, ip, mutex_addr);
+    } else {
+        if (trace_enabled) printf("[LOCKDEP] Waiting on condvar %p with mutex %p\n", condvar_addr, mutex_addr);
+
+        lockdep_shm_prepare(condvar_addr);
+        graph_lock();
+        allowed = wait_condvar_locked(current_thread_context(), condvar_addr, mutex_addr, ip, should_validate());
+        graph_unlock();
+    }
+
+    lockdep_timer_stop(LOCKDEP_TIMER_CONDVAR, start);
+    return allowed;
+}
+
 void lockdep_release_mutex(const void* mutex_addr)
 {
     lockdep_release_lock(mutex_addr);
@@ -405,5 +1919,69 @@ void lockdep_release_semaphore(const void* sem_addr)
 
 void lockdep_signal_condvar(const void* condvar_addr)
 {
-    printf("[LOCKDEP] Signaling condvar %p\n", condvar_addr);
+    if (trace_enabled) printf("[LOCKDEP] Signaling condvar %p\n", condvar_addr);
+}
+
+// ==================== DEFERRED REPLAY ====================
+
+// The analyzer thread replays the operations queued in deferred mode on a
+// shadow context per application thread, with full validation. The thread has
+// long since taken the lock, so an inversion is reported rather than refused,
+// and the lock still goes onto the shadow's held stack. The analyzer holds the
+// graph lock for a whole batch of operations: no application thread takes it
+// in deferred mode.
+
+void lockdep_replay_lock(void)
+{
+    graph_lock();
+}
+
+void lockdep_replay_unlock(void)
+{
+    graph_unlock();
+}
+
+static void report_deferred(const thread_context_t* shadow, const char* what, const void* lock_addr, const void* ip)
+{
+    if (!lockdep_report_first_seen()) return;
+
+    fprintf(stderr, "[LOCKDEP] DEADLOCK DETECTED (deferred): thread %lu %s %p at %p while holding:\n",
+            shadow->thread_id, what, lock_addr, ip);
+    for (held_lock_t* held = shadow->held_locks; held; held = held->next) {
+        fprintf(stderr, "[LOCKDEP] - %s %p\n", lockdep_sync_type_to_string(held->lock->type), held->lock->lock_addr);
+    }
+}
+
+void lockdep_replay_acquire(thread_context_t* shadow, const void* lock_addr, sync_type_t type, const void* ip,
+                            bool trylock, bool read)
+{
+    if (trylock) {
+        add_lock_to_thread_context(shadow, find_or_create_lock(lock_addr, type, ip), read);
+    } else {
+        bool allowed;
+        acquire_locked(shadow, lock_addr, type, read, ip, true, &allowed);
+        if (!allowed) {
+            report_deferred(shadow, "acquired", lock_addr, ip);
+            add_lock_to_thread_context(shadow, find_or_create_lock(lock_addr, type, ip), read);
+        }
+    }
+}
+
+void lockdep_replay_release(thread_context_t* shadow, const void* lock_addr)
+{
+    release_lock_from_thread_context(shadow, lock_addr);
+}
+
+void lockdep_replay_condvar_wait(thread_context_t* shadow, const void* condvar_addr, const void* mutex_addr,
+                                 const void* ip)
+{
+    if (!wait_condvar_locked(shadow, condvar_addr, mutex_addr, ip, true)) {
+        report_deferred(shadow, "waited on condvar", condvar_addr, ip);
+        release_lock_from_thread_context(shadow, mutex_addr);
+    }
+}
+
+void lockdep_replay_reset(thread_context_t* shadow)
+{
+    drop_held_locks(shadow);
 }
@@ -0,0 +1,261 @@
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "lockdep_internal.h"
+
+// Graph export for external tools. The graph is streamed from the node and
+// edge tables through a fixed-size stdio buffer, so the memory used does not
+// depend on the size of the graph. Nodes are named by their dense id; the
+// labels carry the type, address, class key and first callsite of each lock,
+// and the number of acquisitions through each edge.
+//
+// The graph lock is only held to copy a batch of records, never while writing,
+// so a slow file does not hold up the program. Nodes are never removed and the
+// edges of a node keep their index, so the export walks the nodes that existed
+// when it started and picks up where it left off after each batch; edges to
+// nodes created in the meantime are left out.
+
+#define EXPORT_BUFFER_SIZE (64 * 1024)
+#define EXPORT_BATCH 256
+
+typedef struct export_node {
+    uint32_t id;
+    sync_type_t type;
+    const void* lock_addr;
+    uint64_t class_key;
+    const void* callsite;
+    unsigned rank;
+} export_node_t;
+
+typedef struct export_edge {
+    uint32_t from;
+    uint32_t to;
+    uint64_t hits;
+    bool inversion;
+} export_edge_t;
+
+typedef struct export_cursor {
+    uint32_t node_count; // Nodes when the export started.
+    uint32_t node;       // Next node to copy.
+    uint32_t edge;       // Next edge of `node` to copy.
+} export_cursor_t;
+
+typedef struct export_writer {
+    void (*header)(FILE* out);
+    void (*node)(FILE* out, const export_node_t* node, bool first);
+    void (*edges)(FILE* out); // Between the nodes and the edges, if needed.
+    void (*edge)(FILE* out, const export_edge_t* edge, bool first);
+    void (*footer)(FILE* out);
+} export_writer_t;
+
+static uint32_t copy_nodes(export_cursor_t* cursor, export_node_t* batch)
+{
+    uint32_t count = 0;
+
+    lockdep_graph_lock();
+    while (cursor->node < cursor->node_count && count < EXPORT_BATCH) {
+        lock_node_t* lock = lockdep_graph_node(cursor->node++);
+        export_node_t* node = &batch[count++];
+        node->id = lock->id;
+        node->type = lock->type;
+        node->lock_addr = lock->lock_addr;
+        node->class_key = lockdep_class_key(lock);
+        node->callsite = lock->callsite;
+        node->rank = lock->rank;
+    }
+    lockdep_graph_unlock();
+    return count;
+}
+
+static uint32_t copy_edges(export_cursor_t* cursor, export_edge_t* batch)
+{
+    uint32_t count = 0;
+
+    lockdep_graph_lock();
+    while (cursor->node < cursor->node_count && count < EXPORT_BATCH) {
+        const lock_node_t* lock = lockdep_graph_node(cursor->node);
+        if (cursor->edge >= lock->out_degree) {
+            cursor->node++;
+            cursor->edge = 0;
+            continue;
+        }
+
+        uint32_t i = cursor->edge++;
+        if (lock->edges[i] >= cursor->node_count) continue;
+        uint32_t edge = lockdep_edge_id(lock, i);
+        export_edge_t* copy = &batch[count++];
+        copy->from = lock->id;
+        copy->to = lock->edges[i];
+        copy->hits = atomic_load_explicit(lockdep_edge_hits(edge), memory_order_relaxed);
+        copy->inversion = *lockdep_edge_flags(edge) & LOCKDEP_EDGE_INVERSION;
+    }
+    lockdep_graph_unlock();
+    return count;
+}
+
+// ==================== DOT ====================
+
+static void dot_header(FILE* out)
+{
+    fprintf(out, "digraph lockdep {\n");
+    fprintf(out, "    node [shape=box, fontname=monospace];\n");
+}
+
+static void dot_node(FILE* out, const export_node_t* node, bool first __attribute__((unused)))
+{
+    fprintf(out, "    n%" PRIu32 " [label=\"%s %p\\nclass %016" PRIx64 "\\nfirst at %p\"];\n", node->id,
+            lockdep_sync_type_to_string(node->type), node->lock_addr, node->class_key, node->callsite);
+}
+
+static void dot_edge(FILE* out, const export_edge_t* edge, bool first __attribute__((unused)))
+{
+    fprintf(out, "    n%" PRIu32 " -> n%" PRIu32 " [label=\"%" PRIu64 "\"%s];\n", edge->from, edge->to, edge->hits,
+            edge->inversion ? ", color=red" : "");
+}
+
+static void dot_footer(FILE* out)
+{
+    fprintf(out, "}\n");
+}
+
+// ==================== GRAPHML ====================
+
+static void graphml_header(FILE* out)
+{
+    fprintf(out, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+                 "<graphml xmlns=\"http://graphml.graphdrawing.org/xmlns\">\n"
+                 "  <key id=\"type\" for=\"node\" attr.name=\"type\" attr.type=\"string\"/>\n"
+                 "  <key id=\"address\" for=\"node\" attr.name=\"address\" attr.type=\"string\"/>\n"
+                 "  <key id=\"class\" for=\"node\" attr.name=\"class\" attr.type=\"string\"/>\n"
+                 "  <key id=\"callsite\" for=\"node\" attr.name=\"callsite\" attr.type=\"string\"/>\n"
+                 "  <key id=\"rank\" for=\"node\" attr.name=\"rank\" attr.type=\"int\"/>\n"
+                 "  <key id=\"hits\" for=\"edge\" attr.name=\"hits\" attr.type=\"long\"/>\n"
+                 "  <key id=\"inversion\" for=\"edge\" attr.name=\"inversion\" attr.type=\"boolean\"/>\n"
+                 "  <graph id=\"lockdep\" edgedefault=\"directed\">\n");
+}
+
+static void graphml_node(FILE* out, const export_node_t* node, bool first __attribute__((unused)))
+{
+    fprintf(out,
+            "    <node id=\"n%" PRIu32 "\"><data key=\"type\">%s</data><data key=\"address\">%p</data>"
+            "<data key=\"class\">%016" PRIx64 "</data><data key=\"callsite\">%p</data>"
+            "<data key=\"rank\">%u</data></node>\n",
+            node->id, lockdep_sync_type_to_string(node->type), node->lock_addr, node->class_key, node->callsite,
+            node->rank);
+}
+
+static void graphml_edge(FILE* out, const export_edge_t* edge, bool first __attribute__((unused)))
+{
+    fprintf(out,
+            "    <edge source=\"n%" PRIu32 "\" target=\"n%" PRIu32 "\"><data key=\"hits\">%" PRIu64 "</data>"
+            "<data key=\"inversion\">%s</data></edge>\n",
+            edge->from, edge->to, edge->hits, edge->inversion ? "true" : "false");
+}
+
+static void graphml_footer(FILE* out)
+{
+    fprintf(out, "  </graph>\n</graphml>\n");
+}
+
+// ==================== JSON ====================
+
+static void json_header(FILE* out)
+{
+    fprintf(out, "{\"nodes\": [");
+}
+
+static void json_node(FILE* out, const export_node_t* node, bool first)
+{
+    fprintf(out,
+            "%s\n  {\"id\": %" PRIu32 ", \"type\": \"%s\", \"address\": \"%p\", \"class\": \"%016" PRIx64
+            "\", \"callsite\": \"%p\", \"rank\": %u}",
+            first ? "" : ",", node->id, lockdep_sync_type_to_string(node->type), node->lock_addr, node->class_key,
+            node->callsite, node->rank);
+}
+
+static void json_edges(FILE* out)
+{
+    fprintf(out, "\n], \"edges\": [");
+}
+
+static void json_edge(FILE* out, const export_edge_t* edge, bool first)
+{
+    fprintf(out, "%s\n  {\"from\": %" PRIu32 ", \"to\": %" PRIu32 ", \"hits\": %" PRIu64 ", \"inversion\": %s}",
+            first ? "" : ",", edge->from, edge->to, edge->hits, edge->inversion ? "true" : "false");
+}
+
+static void json_footer(FILE* out)
+{
+    fprintf(out, "\n]}\n");
+}
+
+static const export_writer_t writers[] = {
+    [LOCKDEP_EXPORT_DOT] = {dot_header, dot_node, NULL, dot_edge, dot_footer},
+    [LOCKDEP_EXPORT_GRAPHML] = {graphml_header, graphml_node, NULL, graphml_edge, graphml_footer},
+    [LOCKDEP_EXPORT_JSON] = {json_header, json_node, json_edges, json_edge, json_footer},
+};
+
+static void write_graph(FILE* out, const export_writer_t* writer)
+{
+    export_node_t nodes[EXPORT_BATCH];
+    export_edge_t edges[EXPORT_BATCH];
+    export_cursor_t cursor = {0};
+    uint32_t count;
+    bool first = true;
+
+    lockdep_graph_lock();
+    cursor.node_count = lockdep_graph_node_count();
+    lockdep_graph_unlock();
+
+    writer->header(out);
+    while ((count = copy_nodes(&cursor, nodes))) {
+        for (uint32_t i = 0; i < count; i++, first = false) writer->node(out, &nodes[i], first);
+    }
+
+    if (writer->edges) writer->edges(out);
+    cursor.node = 0;
+    first = true;
+    while ((count = copy_edges(&cursor, edges))) {
+        for (uint32_t i = 0; i < count; i++, first = false) writer->edge(out, &edges[i], first);
+    }
+    writer->footer(out);
+}
+
+bool lockdep_export_format_from_path(const char* path, lockdep_export_format_t* format)
+{
+    const char* extension = strrchr(path, '.');
+    if (!extension) return false;
+
+    if (strcmp(extension, ".dot") == 0 || strcmp(extension, ".gv") == 0) {
+        *format = LOCKDEP_EXPORT_DOT;
+    } else if (strcmp(extension, ".graphml") == 0 || strcmp(extension, ".xml") == 0) {
+        *format = LOCKDEP_EXPORT_GRAPHML;
+    } else if (strcmp(extension, ".json") == 0) {
+        *format = LOCKDEP_EXPORT_JSON;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+bool lockdep_export_write(const char* path, lockdep_export_format_t format)
+{
+    if ((unsigned)format >= sizeof(writers) / sizeof(writers[0])) {
+        fprintf(stderr, "[LOCKDEP] Unknown export format %d\n", (int)format);
+        return false;
+    }
+
+    FILE* out = fopen(path, "w");
+    if (!out) {
+        fprintf(stderr, "[LOCKDEP] Cannot open %s: %s\n", path, strerror(errno));
+        return false;
+    }
+    setvbuf(out, NULL, _IOFBF, EXPORT_BUFFER_SIZE);
+
+    write_graph(out, &writers[format]);
+
+    bool written = !ferror(out);
+    return fclose(out) == 0 && written;
+}
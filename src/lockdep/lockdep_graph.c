@@ -0,0 +1,220 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lockdep_internal.h"
+
+// Storage of the lock graph. Nodes are allocated in fixed-size chunks and
+// addressed by their dense 32-bit id, so they never move and the graph is
+// walked in creation order without a list. The edges of a node are a single
+// block: the child ids, then the matching edge ids. Searches only read the
+// first array, 4 bytes per edge in one contiguous run, instead of following a
+// list of 32-byte records. A full block is replaced by one twice its size, and
+// the old one is kept on a free list for the next node that reaches its size.
+//
+// The attributes of each edge are structure-of-arrays tables indexed by edge
+// id. Their chunks never move either, so the per-thread caches can keep an
+// edge id and count hits through it without the graph lock.
+//
+// Nodes are also indexed by lock address in an open-addressed table of node
+// pointers, filled with the graph lock held and probed without it. A table
+// that gets half full is replaced by one twice its size. The old one is left
+// in place for lookups that may still be probing it: it only misses the nodes
+// created since, and a miss just takes the graph lock.
+
+#define NODE_CHUNK_SHIFT 8
+#define NODE_CHUNK_SIZE (1u << NODE_CHUNK_SHIFT)
+#define EDGE_CHUNK_SHIFT 12
+#define EDGE_CHUNK_SIZE (1u << EDGE_CHUNK_SHIFT)
+#define MAX_CHUNKS (1u << 16)
+#define BLOCK_CLASSES 32
+#define NODE_INDEX_MIN 256
+
+typedef struct node_index {
+    uint32_t mask; // Number of slots, minus one.
+    lock_node_t* _Atomic slots[];
+} node_index_t;
+
+typedef struct edge_chunk {
+    _Atomic uint64_t hits[EDGE_CHUNK_SIZE];
+    uint8_t flags[EDGE_CHUNK_SIZE];
+} edge_chunk_t;
+
+static lock_node_t* node_chunks[MAX_CHUNKS];
+static edge_chunk_t* edge_chunks[MAX_CHUNKS];
+static uint32_t node_count;
+static node_index_t* _Atomic node_index;
+static uint32_t indexed_count;
+static uint32_t edge_count;
+static size_t graph_bytes;
+
+// Edge blocks that were outgrown, by log2 of their capacity. The first bytes of
+// a free block point to the next one.
+static uint32_t* free_blocks[BLOCK_CLASSES];
+
+static void* graph_alloc(size_t bytes)
+{
+    graph_bytes += bytes;
+    return lockdep_alloc(bytes);
+}
+
+static void graph_full(const char* what)
+{
+    fprintf(stderr, "[LOCKDEP] Too many %s in the lock graph, aborting\n", what);
+    exit(EXIT_FAILURE);
+}
+
+lock_node_t* lockdep_graph_new_node(void)
+{
+    uint32_t id = node_count;
+    if (id >> NODE_CHUNK_SHIFT >= MAX_CHUNKS) graph_full("locks");
+
+    lock_node_t** chunk = &node_chunks[id >> NODE_CHUNK_SHIFT];
+    if (!*chunk) *chunk = graph_alloc(NODE_CHUNK_SIZE * sizeof(lock_node_t));
+
+    lock_node_t* lock = &(*chunk)[id & (NODE_CHUNK_SIZE - 1)];
+    memset(lock, 0, sizeof(*lock));
+    lock->id = id;
+    node_count++;
+    return lock;
+}
+
+lock_node_t* lockdep_graph_node(uint32_t id)
+{
+    return &node_chunks[id >> NODE_CHUNK_SHIFT][id & (NODE_CHUNK_SIZE - 1)];
+}
+
+static inline uint32_t index_hash(const void* lock_addr)
+{
+    return (uint32_t)(((uintptr_t)lock_addr >> 3) * 0x9E3779B97F4A7C15ull >> 32);
+}
+
+static void index_insert(node_index_t* index, lock_node_t* lock)
+{
+    for (uint32_t i = index_hash(lock->lock_addr);; i++) {
+        lock_node_t* _Atomic* slot = &index->slots[i & index->mask];
+        if (!atomic_load_explicit(slot, memory_order_relaxed)) {
+            atomic_store_explicit(slot, lock, memory_order_release);
+            return;
+        }
+    }
+}
+
+void lockdep_graph_index_node(lock_node_t* lock)
+{
+    node_index_t* index = atomic_load_explicit(&node_index, memory_order_relaxed);
+    uint32_t capacity = index ? index->mask + 1 : 0;
+
+    if (2 * (indexed_count + 1) > capacity) {
+        uint32_t grown = capacity ? 2 * capacity : NODE_INDEX_MIN;
+        node_index_t* bigger = graph_alloc(sizeof(node_index_t) + grown * sizeof(lock_node_t*));
+        memset(bigger, 0, sizeof(node_index_t) + grown * sizeof(lock_node_t*));
+        bigger->mask = grown - 1;
+        for (uint32_t i = 0; i < capacity; i++) {
+            lock_node_t* indexed = atomic_load_explicit(&index->slots[i], memory_order_relaxed);
+            if (indexed) index_insert(bigger, indexed);
+        }
+        atomic_store_explicit(&node_index, bigger, memory_order_release);
+        index = bigger;
+    }
+
+    index_insert(index, lock);
+    indexed_count++;
+}
+
+lock_node_t* lockdep_graph_lookup(const void* lock_addr)
+{
+    node_index_t* index = atomic_load_explicit(&node_index, memory_order_acquire);
+    if (!index) return NULL;
+
+    // Tables are at most half full, so every probe ends on an empty slot.
+    for (uint32_t i = index_hash(lock_addr);; i++) {
+        lock_node_t* lock = atomic_load_explicit(&index->slots[i & index->mask], memory_order_acquire);
+        if (!lock || lock->lock_addr == lock_addr) return lock;
+    }
+}
+
+uint32_t lockdep_graph_node_count(void)
+{
+    return node_count;
+}
+
+uint32_t lockdep_graph_edge_count(void)
+{
+    return edge_count;
+}
+
+size_t lockdep_graph_bytes(void)
+{
+    return graph_bytes;
+}
+
+static uint32_t* alloc_block(uint32_t capacity)
+{
+    uint32_t** head = &free_blocks[__builtin_ctz(capacity)];
+    uint32_t* block = *head;
+    if (block) {
+        memcpy(head, block, sizeof(*head));
+        return block;
+    }
+    return graph_alloc(2 * (size_t)capacity * sizeof(uint32_t));
+}
+
+static void free_block(uint32_t* block, uint32_t capacity)
+{
+    uint32_t** head = &free_blocks[__builtin_ctz(capacity)];
+    memcpy(block, head, sizeof(*head));
+    *head = block;
+}
+
+uint32_t lockdep_graph_add_edge(lock_node_t* parent, const lock_node_t* child)
+{
+    uint32_t edge = edge_count;
+    if (edge >> EDGE_CHUNK_SHIFT >= MAX_CHUNKS) graph_full("orderings");
+
+    edge_chunk_t** chunk = &edge_chunks[edge >> EDGE_CHUNK_SHIFT];
+    if (!*chunk) *chunk = graph_alloc(sizeof(edge_chunk_t));
+    atomic_init(&(*chunk)->hits[edge & (EDGE_CHUNK_SIZE - 1)], 0);
+    (*chunk)->flags[edge & (EDGE_CHUNK_SIZE - 1)] = 0;
+
+    uint32_t degree = parent->out_degree;
+    uint32_t capacity = lockdep_edge_capacity(degree);
+    if (degree == capacity) {
+        uint32_t grown = lockdep_edge_capacity(degree + 1);
+        uint32_t* block = alloc_block(grown);
+        if (capacity) {
+            memcpy(block, parent->edges, degree * sizeof(uint32_t));
+            memcpy(block + grown, parent->edges + capacity, degree * sizeof(uint32_t));
+            free_block(parent->edges, capacity);
+        }
+        parent->edges = block;
+        capacity = grown;
+    }
+
+    parent->edges[degree] = child->id;
+    parent->edges[capacity + degree] = edge;
+    parent->out_degree = degree + 1;
+    edge_count++;
+    return edge;
+}
+
+bool lockdep_graph_find_edge(const lock_node_t* parent, const lock_node_t* child, uint32_t* edge)
+{
+    for (uint32_t i = 0; i < parent->out_degree; i++) {
+        if (parent->edges[i] == child->id) {
+            *edge = lockdep_edge_id(parent, i);
+            return true;
+        }
+    }
+    return false;
+}
+
+uint8_t* lockdep_edge_flags(uint32_t edge)
+{
+    return &edge_chunks[edge >> EDGE_CHUNK_SHIFT]->flags[edge & (EDGE_CHUNK_SIZE - 1)];
+}
+
+_Atomic uint64_t* lockdep_edge_hits(uint32_t edge)
+{
+    return &edge_chunks[edge >> EDGE_CHUNK_SHIFT]->hits[edge & (EDGE_CHUNK_SIZE - 1)];
+}
@@ -0,0 +1,412 @@
+// Declarations shared between the lockdep modules. Nothing here is part of the
+// public interface, and every symbol is hidden so it can neither clash with nor
+// be interposed by the instrumented program.
+
+#ifndef LOCKDEP_INTERNAL_H
+#define LOCKDEP_INTERNAL_H
+
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "../include/lockdep.h"
+
+#define LOCKDEP_INTERNAL __attribute__((visibility("hidden")))
+
+// ==================== CORE (lockdep_core.c) ====================
+
+// Take and release the graph lock, for modules that walk the graph in several
+// steps rather than under a single call from the core.
+LOCKDEP_INTERNAL void lockdep_graph_lock(void);
+LOCKDEP_INTERNAL void lockdep_graph_unlock(void);
+
+// Records the ordering `parent -> child` and validates it. Returns false if the
+// new edge closes a cycle. Must be called with the graph lock held.
+LOCKDEP_INTERNAL bool lockdep_link_locks(lock_node_t* parent, lock_node_t* child);
+
+// Allocates from the arena, falling back to malloc. Never returns NULL.
+LOCKDEP_INTERNAL void* lockdep_alloc(size_t bytes);
+
+LOCKDEP_INTERNAL const char* lockdep_sync_type_to_string(sync_type_t type);
+LOCKDEP_INTERNAL const char* lockdep_mode_to_string(lockdep_mode_t mode);
+LOCKDEP_INTERNAL bool lockdep_mode_from_string(const char* name, lockdep_mode_t* mode);
+LOCKDEP_INTERNAL unsigned lockdep_get_sample_rate(void);
+
+// Bumped every time tracking is turned back on. State published under an older
+// epoch may have missed releases and must not be trusted.
+LOCKDEP_INTERNAL unsigned lockdep_held_epoch(void);
+
+// ==================== DEFERRED ANALYSIS (lockdep_deferred.c) ====================
+
+// Lock operations queued by threads in deferred mode.
+typedef enum lockdep_deferred_op {
+    LOCKDEP_DEFERRED_ACQUIRE,
+    LOCKDEP_DEFERRED_ACQUIRE_READ, // Read acquisition of an rwlock.
+    LOCKDEP_DEFERRED_TRYLOCK,
+    LOCKDEP_DEFERRED_TRYLOCK_READ,
+    LOCKDEP_DEFERRED_RELEASE,
+    LOCKDEP_DEFERRED_CONDVAR_WAIT // `lock_addr` is the condvar, `mutex_addr` the mutex.
+} lockdep_deferred_op_t;
+
+// Starts the analyzer thread, reading the ring size and overflow policy from
+// the environment the first time.
+LOCKDEP_INTERNAL bool lockdep_deferred_start(void);
+
+// Stops the analyzer thread once it has drained every ring.
+LOCKDEP_INTERNAL void lockdep_deferred_stop(void);
+
+// Queues an operation of the calling thread. Takes no lock.
+LOCKDEP_INTERNAL void lockdep_deferred_push(lockdep_deferred_op_t op, const void* lock_addr, sync_type_t type,
+                                            const void* ip, const void* mutex_addr);
+
+// Hands the rings of the parent's other threads to the analyzer, which is
+// restarted in the child after fork().
+LOCKDEP_INTERNAL void lockdep_deferred_atfork_child(void);
+
+// Replay of queued operations by the analyzer, on `shadow`, a context that
+// mirrors the locks held by the thread that queued them (lockdep_core.c).
+// They are called between lockdep_replay_lock() and lockdep_replay_unlock(),
+// which take and drop the graph lock.
+LOCKDEP_INTERNAL void lockdep_replay_lock(void);
+LOCKDEP_INTERNAL void lockdep_replay_unlock(void);
+LOCKDEP_INTERNAL void lockdep_replay_acquire(thread_context_t* shadow, const void* lock_addr, sync_type_t type,
+                                             const void* ip, bool trylock, bool read);
+LOCKDEP_INTERNAL void lockdep_replay_release(thread_context_t* shadow, const void* lock_addr);
+LOCKDEP_INTERNAL void lockdep_replay_condvar_wait(thread_context_t* shadow, const void* condvar_addr,
+                                                  const void* mutex_addr, const void* ip);
+
+// Forgets the locks `shadow` holds, when its thread exited or events were lost.
+LOCKDEP_INTERNAL void lockdep_replay_reset(thread_context_t* shadow);
+
+// ==================== STATISTICS (lockdep_stats.c) ====================
+
+// Events counted by each thread in a block of its own. Only the owner writes a
+// block, with relaxed loads and stores, so counting needs no atomic
+// read-modify-write and no cache line is shared between cores.
+typedef enum lockdep_event {
+    LOCKDEP_EVENT_ACQUIRE,      // Lock acquisitions.
+    LOCKDEP_EVENT_RELEASE,      // Lock releases.
+    LOCKDEP_EVENT_VALIDATE,     // Acquisitions validated against the held locks.
+    LOCKDEP_EVENT_CACHE_HIT,    // Acquisitions handled from the thread caches.
+    LOCKDEP_EVENT_NEW_NODE,     // Locks added to the graph.
+    LOCKDEP_EVENT_NEW_EDGE,     // Orderings added to the graph.
+    LOCKDEP_EVENT_CYCLE_CHECK,  // Cycle checks.
+    LOCKDEP_EVENT_DENSE_CHECK,  // Cycle checks answered by the closure matrix.
+    LOCKDEP_EVENT_QUICK_REJECT, // Sparse checks answered by the reachability summaries.
+    LOCKDEP_EVENT_DEFERRED,     // Operations queued in deferred mode.
+    LOCKDEP_EVENT_DROPPED,      // Operations lost to a full ring.
+    LOCKDEP_EVENT_RESYNC,       // Shadow held stacks dropped after lost operations.
+    LOCKDEP_EVENT_FROZEN,       // Acquisitions validated by the frozen order alone.
+    LOCKDEP_EVENT_SHARED,       // Read acquisitions that could not wait on any other thread.
+    LOCKDEP_EVENT_COUNT
+} lockdep_event_t;
+
+// Entry points whose duration is recorded while profiling is on.
+typedef enum lockdep_timer {
+    LOCKDEP_TIMER_ACQUIRE,
+    LOCKDEP_TIMER_RELEASE,
+    LOCKDEP_TIMER_CONDVAR,
+    LOCKDEP_TIMER_COUNT
+} lockdep_timer_t;
+
+#define LOCKDEP_HISTOGRAM_BUCKETS 64
+
+typedef struct lockdep_thread_stats {
+    _Atomic uint64_t events[LOCKDEP_EVENT_COUNT];
+    _Atomic uint64_t ticks[LOCKDEP_TIMER_COUNT]; // Total time spent in each entry point.
+    // Calls by log2 of their duration in ticks.
+    _Atomic uint64_t histograms[LOCKDEP_TIMER_COUNT][LOCKDEP_HISTOGRAM_BUCKETS];
+    atomic_bool in_use;                // Owned by a live thread.
+    struct lockdep_thread_stats* next; // Next block ever allocated.
+} lockdep_thread_stats_t;
+
+LOCKDEP_INTERNAL extern __thread lockdep_thread_stats_t* lockdep_thread_stats;
+LOCKDEP_INTERNAL extern bool lockdep_profiling;
+
+// Turns the timing of the entry points on or off.
+LOCKDEP_INTERNAL void lockdep_stats_configure(bool profiling);
+
+// Gives the calling thread a block, reusing one left by an exited thread. The
+// block is handed back, counts kept, when the thread exits.
+LOCKDEP_INTERNAL lockdep_thread_stats_t* lockdep_stats_attach(void);
+
+LOCKDEP_INTERNAL void lockdep_stats_record_time(lockdep_timer_t timer, uint64_t ticks);
+
+// Prints the sum of all the blocks, after the size of the graph.
+LOCKDEP_INTERNAL void lockdep_stats_report(uint32_t nodes, uint32_t edges, size_t bytes);
+
+// Adds to a counter of the calling thread's own block.
+static inline void lockdep_counter_add(_Atomic uint64_t* counter, uint64_t amount)
+{
+    uint64_t value = atomic_load_explicit(counter, memory_order_relaxed);
+    atomic_store_explicit(counter, value + amount, memory_order_relaxed);
+}
+
+static inline void lockdep_count(lockdep_event_t event)
+{
+    lockdep_thread_stats_t* stats = lockdep_thread_stats;
+    if (!stats) stats = lockdep_stats_attach();
+    lockdep_counter_add(&stats->events[event], 1);
+}
+
+// Time stamps: the TSC where there is one, nanoseconds elsewhere.
+static inline uint64_t lockdep_ticks(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ull + (uint64_t)now.tv_nsec;
+#endif
+}
+
+// Returns 0 when profiling is off, which makes lockdep_timer_stop() a no-op.
+static inline uint64_t lockdep_timer_start(void)
+{
+    return lockdep_profiling ? lockdep_ticks() : 0;
+}
+
+static inline void lockdep_timer_stop(lockdep_timer_t timer, uint64_t start)
+{
+    if (start) lockdep_stats_record_time(timer, lockdep_ticks() - start);
+}
+
+// ==================== GRAPH STORAGE (lockdep_graph.c) ====================
+
+// Nodes are stored in chunks indexed by id and never move. The edges of a node
+// are one block of `capacity` child ids followed by `capacity` edge ids, and
+// the attributes of each edge live in tables indexed by edge id. All of these
+// must be called with the graph lock held, except lockdep_edge_hits() and
+// lockdep_graph_lookup().
+
+#define LOCKDEP_EDGE_CHECKED 0x1   // The edge went through the cycle search.
+#define LOCKDEP_EDGE_INVERSION 0x2 // The edge closed a cycle when it was added.
+
+// How the ordering was seen: the parent held exclusive (E) or shared (S), and
+// the child acquired normally (N) or as a recursive read (R). An edge carries
+// every combination seen on it.
+#define LOCKDEP_EDGE_EN 0x4
+#define LOCKDEP_EDGE_ER 0x8
+#define LOCKDEP_EDGE_SN 0x10
+#define LOCKDEP_EDGE_SR 0x20
+#define LOCKDEP_EDGE_TYPES 0x3c
+
+static inline uint8_t lockdep_edge_type(bool held_read, bool read)
+{
+    return LOCKDEP_EDGE_EN << (2 * held_read + read);
+}
+
+// Returns a zeroed node with the next dense id.
+LOCKDEP_INTERNAL lock_node_t* lockdep_graph_new_node(void);
+LOCKDEP_INTERNAL lock_node_t* lockdep_graph_node(uint32_t id);
+LOCKDEP_INTERNAL uint32_t lockdep_graph_node_count(void);
+
+// Indexes a new node by its lock address, which must be set.
+LOCKDEP_INTERNAL void lockdep_graph_index_node(lock_node_t* lock);
+
+// Finds the node of `lock_addr`, or returns NULL. Safe without the graph lock,
+// in which case nodes created concurrently may be missed.
+LOCKDEP_INTERNAL lock_node_t* lockdep_graph_lookup(const void* lock_addr);
+LOCKDEP_INTERNAL uint32_t lockdep_graph_edge_count(void);
+
+// Bytes allocated for nodes, edge blocks and edge tables.
+LOCKDEP_INTERNAL size_t lockdep_graph_bytes(void);
+
+// Appends the edge `parent -> child` and returns its id.
+LOCKDEP_INTERNAL uint32_t lockdep_graph_add_edge(lock_node_t* parent, const lock_node_t* child);
+LOCKDEP_INTERNAL bool lockdep_graph_find_edge(const lock_node_t* parent, const lock_node_t* child, uint32_t* edge);
+
+// LOCKDEP_EDGE_* flags of an edge.
+LOCKDEP_INTERNAL uint8_t* lockdep_edge_flags(uint32_t edge);
+
+// Acquisitions that went through an edge. Edge tables never move, so the
+// counter may be updated without the graph lock.
+LOCKDEP_INTERNAL _Atomic uint64_t* lockdep_edge_hits(uint32_t edge);
+
+// Size of each of the two arrays in the edge block of a node with `degree`
+// edges: blocks hold two entries at first and double when full.
+static inline uint32_t lockdep_edge_capacity(uint32_t degree)
+{
+    if (degree <= 2) return degree ? 2 : 0;
+    return 1u << (32 - __builtin_clz(degree - 1));
+}
+
+// Id of the `i`-th edge of `lock`, whose child is `lock->edges[i]`.
+static inline uint32_t lockdep_edge_id(const lock_node_t* lock, uint32_t i)
+{
+    return lock->edges[lockdep_edge_capacity(lock->out_degree) + i];
+}
+
+// ==================== DENSE CLOSURE (lockdep_closure.c) ====================
+
+// Transitive closure of the graph as a bit matrix, kept while the graph has at
+// most `max_nodes` nodes. All of these must be called with the graph lock held.
+LOCKDEP_INTERNAL void lockdep_closure_configure(uint32_t max_nodes);
+
+// Adds a row for the newly created node `id`.
+LOCKDEP_INTERNAL void lockdep_closure_node_added(uint32_t id);
+LOCKDEP_INTERNAL void lockdep_closure_edge_added(uint32_t parent, uint32_t child);
+
+// Tells whether node `from` reaches node `to`. Returns false, leaving
+// `reaches` alone, once the graph has outgrown the dense engine.
+LOCKDEP_INTERNAL bool lockdep_closure_reaches(uint32_t from, uint32_t to, bool* reaches);
+
+// ==================== CYCLE ANALYSIS (lockdep_scc.c) ====================
+
+// Reports every group of locks with circular dependencies in the graph, and
+// returns how many were found. Linear in the graph size. Must be called with
+// the graph lock held.
+LOCKDEP_INTERNAL unsigned lockdep_scc_report(void);
+
+// ==================== TOPOLOGICAL ORDER (lockdep_order.c) ====================
+
+// Position of each lock in a topological order of the graph, leaving
+// inversions out. Locks on a cycle, or created after the order was computed and
+// not placed since, have none. Threads read the positions without any lock.
+typedef struct lockdep_order {
+    uint32_t count;              // Locks in the graph when the order was computed.
+    uint32_t capacity;           // Locks the table has room for.
+    uint32_t ordered;            // Locks that got a position.
+    uint32_t first;              // Lowest position given.
+    uint32_t last;               // Highest position given.
+    uint64_t retired;            // Epoch at which the table was replaced, 0 while in use.
+    struct lockdep_order* next;  // Next replaced table waiting to be freed.
+    _Atomic uint32_t position[]; // By lock id, 0 for none.
+} lockdep_order_t;
+
+// Computes the order of the current graph. Returns NULL if out of memory. Must
+// be called with the graph lock held.
+LOCKDEP_INTERNAL lockdep_order_t* lockdep_order_compute(void);
+
+// Gives `lock`, created after the order was computed, the position before all
+// others if `first` is set, or after all of them otherwise. Returns the table
+// holding the position: `order` itself, or a bigger copy that replaces it if
+// the lock had no room. Returns NULL if positions or memory ran out. Must be
+// called with the graph lock held.
+LOCKDEP_INTERNAL lockdep_order_t* lockdep_order_place(lockdep_order_t* order, const lock_node_t* lock, bool first);
+
+static inline uint32_t lockdep_order_position(const lockdep_order_t* order, const lock_node_t* lock)
+{
+    return lock->id < order->capacity ? atomic_load_explicit(&order->position[lock->id], memory_order_relaxed) : 0;
+}
+
+// ==================== EXPORT (lockdep_export.c) ====================
+
+// Picks the format matching the extension of `path`.
+LOCKDEP_INTERNAL bool lockdep_export_format_from_path(const char* path, lockdep_export_format_t* format);
+
+// Streams the graph to `path`. Takes the graph lock for each batch of nodes or
+// edges it copies, never while writing.
+LOCKDEP_INTERNAL bool lockdep_export_write(const char* path, lockdep_export_format_t format);
+
+// ==================== CONTROL CHANNEL (lockdep_control.c) ====================
+
+// Serves mode switches on a Unix socket from a lockdep thread. "%p" in
+// `pattern` is replaced by the process id.
+LOCKDEP_INTERNAL bool lockdep_control_start(const char* pattern);
+LOCKDEP_INTERNAL void lockdep_control_stop(void);
+
+// Serves a socket of the child's own after fork(), if the path has "%p".
+LOCKDEP_INTERNAL void lockdep_control_atfork_child(void);
+
+// ==================== WAIT-FOR WATCHDOG (lockdep_watchdog.c) ====================
+
+// Scans the wait-for graph for deadlocked threads every `interval_ms`.
+LOCKDEP_INTERNAL bool lockdep_watchdog_start(unsigned interval_ms);
+LOCKDEP_INTERNAL void lockdep_watchdog_stop(void);
+
+// Tells whether the watchdog runs. Lock operations are then published even
+// while tracking is off.
+LOCKDEP_INTERNAL bool lockdep_watchdog_running(void);
+
+// Forgets the parent's other threads and restarts the watchdog after fork().
+LOCKDEP_INTERNAL void lockdep_watchdog_atfork_child(void);
+
+// ==================== OWNERSHIP TABLE (lockdep_owner.c) ====================
+
+// Starts tracking the holders of locks. Until then, the updates return at once.
+LOCKDEP_INTERNAL void lockdep_owner_enable(void);
+
+LOCKDEP_INTERNAL void lockdep_owner_acquired(const void* lock_addr, const void* ip);
+LOCKDEP_INTERNAL void lockdep_owner_released(const void* lock_addr);
+
+// Forgets every holder. Called when tracking resumes, since releases made
+// while it was off went unseen.
+LOCKDEP_INTERNAL void lockdep_owner_reset(void);
+
+// Drops the holders that did not make it into the child after fork(). The
+// forking thread keeps its locks, under its new tid.
+LOCKDEP_INTERNAL void lockdep_owner_atfork_child(void);
+
+// Fills `owners` with up to `max` threads holding the lock and returns how many
+// were found.
+LOCKDEP_INTERNAL unsigned lockdep_lock_owners(const void* lock_addr, lockdep_owner_t* owners, unsigned max);
+
+// ==================== PERSISTENCE (lockdep_persist.c) ====================
+
+// Returns the run-independent class key of `lock`, computing it on first use.
+// Returns 0 if the lock cannot be keyed.
+LOCKDEP_INTERNAL uint64_t lockdep_class_key(lock_node_t* lock);
+
+// Maps the lock graph file at `path`, replacing any previously loaded one.
+LOCKDEP_INTERNAL bool lockdep_persist_load(const char* path);
+
+// Writes the union of the loaded graph and the current one.
+LOCKDEP_INTERNAL bool lockdep_persist_save(const char* path);
+
+// Connects a newly created node to the orderings its class had in earlier
+// runs. Must be called with the graph lock held.
+LOCKDEP_INTERNAL void lockdep_persist_bind(lock_node_t* lock);
+
+// Checks whether the loaded graph already orders `to` before `from`.
+LOCKDEP_INTERNAL bool lockdep_persist_would_create_cycle(lock_node_t* from, lock_node_t* to);
+
+// ==================== SHARED GRAPH (lockdep_shm.c) ====================
+
+// Maps the shared-memory segment `name` (see shm_open()), creating it if no
+// process did yet. Locks created afterwards are checked against it.
+LOCKDEP_INTERNAL bool lockdep_shm_attach(const char* name);
+
+// Looks up, before the graph lock is taken, where the lock at `lock_addr`
+// lives if it has no node yet, for lockdep_shm_bind() to key it without
+// reading /proc/self/maps under the graph lock.
+LOCKDEP_INTERNAL void lockdep_shm_prepare(const void* lock_addr);
+
+// Keys a newly created node by the shared object and offset it lives at, if it
+// lives in a shared mapping. Must be called with the graph lock held.
+LOCKDEP_INTERNAL void lockdep_shm_bind(lock_node_t* lock);
+
+// Publishes an ordering between two shared locks, which passed the cycle
+// checks, to the other processes.
+LOCKDEP_INTERNAL void lockdep_shm_edge_checked(const lock_node_t* parent, const lock_node_t* child);
+
+// Checks whether any attached process already orders `to` before `from`.
+LOCKDEP_INTERNAL bool lockdep_shm_would_create_cycle(lock_node_t* from, lock_node_t* to);
+
+// ==================== REPORTS (lockdep_report.c) ====================
+
+// Appends JSON reports to the file at `path`.
+LOCKDEP_INTERNAL void lockdep_report_configure(const char* path);
+
+// Counts another refusal of `edge` if it already closed a reported cycle.
+// Returns false if the edge was never refused.
+LOCKDEP_INTERNAL bool lockdep_report_repeat(uint32_t edge);
+
+// Reports the cycle closed by refusing `edge`: `cycle` holds the ids of its
+// locks, each ordered before the next and the last before the first. Returns
+// whether the cycle is seen for the first time; otherwise it is only counted.
+LOCKDEP_INTERNAL bool lockdep_report_cycle(uint32_t edge, const uint32_t* cycle, uint32_t length, const void* ip);
+
+// Same, for `lock` acquired while holding a lock of rank `held_rank`.
+LOCKDEP_INTERNAL bool lockdep_report_rank(const lock_node_t* lock, unsigned held_rank, const void* ip);
+
+// Tells whether the last problem reported by the calling thread was new.
+LOCKDEP_INTERNAL bool lockdep_report_first_seen(void);
+
+// Reports the occurrences counted since each problem was last reported.
+LOCKDEP_INTERNAL void lockdep_report_flush(void);
+
+#endif // LOCKDEP_INTERNAL_H
@@ -0,0 +1,104 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lockdep_internal.h"
+
+// Topological order of the lock graph, used by the frozen mode. Once the graph
+// stops changing, an acquisition that takes locks in increasing position cannot
+// close a cycle: every ordering consistent with one topological order leaves
+// the graph acyclic. Validation then becomes a comparison of positions.
+//
+// The order is computed with Kahn's algorithm in O(V + E). Orderings flagged as
+// inversions were refused, so they are left out; a lock still on a cycle, made
+// of orderings recorded without validation, never gets a position, and every
+// acquisition involving it goes through the graph as before.
+//
+// Positions are handed out from the middle of their range, so that locks
+// created once the graph is frozen can be placed before or after all the others
+// without sorting the graph again.
+
+#define ORDER_MIDDLE (UINT32_MAX / 2)
+#define ORDER_MIN_CAPACITY 64
+
+lockdep_order_t* lockdep_order_compute(void)
+{
+    uint32_t count = lockdep_graph_node_count();
+    size_t n = count ? count : 1;
+    uint32_t* in_degree = calloc(n, sizeof(uint32_t));
+    uint32_t* queue = malloc(n * sizeof(uint32_t));
+    if (!in_degree || !queue) {
+        free(in_degree);
+        free(queue);
+        return NULL;
+    }
+
+    for (uint32_t id = 0; id < count; id++) {
+        const lock_node_t* node = lockdep_graph_node(id);
+        for (uint32_t i = 0; i < node->out_degree; i++) {
+            if (*lockdep_edge_flags(lockdep_edge_id(node, i)) & LOCKDEP_EDGE_INVERSION) continue;
+            in_degree[node->edges[i]]++;
+        }
+    }
+
+    uint32_t head = 0, tail = 0;
+    for (uint32_t id = 0; id < count; id++) {
+        if (!in_degree[id]) queue[tail++] = id;
+    }
+
+    // Room is left for the locks created while the graph stays frozen.
+    uint32_t capacity = 2 * count > ORDER_MIN_CAPACITY ? 2 * count : ORDER_MIN_CAPACITY;
+    lockdep_order_t* order = malloc(sizeof(lockdep_order_t) + capacity * sizeof(uint32_t));
+    if (!order) {
+        free(in_degree);
+        free(queue);
+        return NULL;
+    }
+    memset(order, 0, sizeof(lockdep_order_t) + capacity * sizeof(uint32_t));
+    order->count = count;
+    order->capacity = capacity;
+
+    while (head < tail) {
+        uint32_t id = queue[head++];
+        atomic_store_explicit(&order->position[id], ORDER_MIDDLE + head, memory_order_relaxed);
+
+        const lock_node_t* node = lockdep_graph_node(id);
+        for (uint32_t i = 0; i < node->out_degree; i++) {
+            if (*lockdep_edge_flags(lockdep_edge_id(node, i)) & LOCKDEP_EDGE_INVERSION) continue;
+            if (--in_degree[node->edges[i]] == 0) queue[tail++] = node->edges[i];
+        }
+    }
+    order->ordered = tail;
+    order->first = ORDER_MIDDLE + 1;
+    order->last = ORDER_MIDDLE + tail;
+
+    free(in_degree);
+    free(queue);
+    return order;
+}
+
+lockdep_order_t* lockdep_order_place(lockdep_order_t* order, const lock_node_t* lock, bool first)
+{
+    if (first ? order->first == 1 : order->last == UINT32_MAX) return NULL;
+
+    if (lock->id >= order->capacity) {
+        uint32_t capacity = 2 * order->capacity > lock->id ? 2 * order->capacity : lock->id + 1;
+        lockdep_order_t* grown = malloc(sizeof(lockdep_order_t) + capacity * sizeof(uint32_t));
+        if (!grown) return NULL;
+        *grown = *order;
+        grown->capacity = capacity;
+        grown->retired = 0;
+        grown->next = NULL;
+        for (uint32_t id = 0; id < capacity; id++) {
+            uint32_t position = 0;
+            if (id < order->capacity) position = atomic_load_explicit(&order->position[id], memory_order_relaxed);
+            atomic_init(&grown->position[id], position);
+        }
+        order = grown;
+    }
+
+    uint32_t position = first ? --order->first : ++order->last;
+    atomic_store_explicit(&order->position[lock->id], position, memory_order_relaxed);
+    order->ordered++;
+    return order;
+}
@@ -0,0 +1,245 @@
+#define _GNU_SOURCE
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "lockdep_internal.h"
+
+// Lock ownership table: one record per (lock, holder thread), updated with
+// atomics on every acquisition and release so that "who holds L?" is answered
+// from any thread without taking the graph lock. Every reader of an rwlock has
+// a record of its own, and a recursive acquisition only bumps the holder's
+// count.
+//
+// Open addressing over a fixed probe window. The records of a lock all live in
+// the window of its address, which is always scanned whole, so a record freed
+// when its holder lets go of the lock leaves no hole that lookups would stop
+// at. The keys are kept apart from the records so that a window spans only a
+// few cache lines. When the window is full the holder is not tracked.
+//
+// An update costs a CAS and a clock read, which a program only pays for when
+// something reads the table: tracking is off unless LOCKDEP_OWNERS=1 is set or
+// the watchdog runs.
+
+#define OWNER_TABLE_SIZE (1 << 16)
+#define OWNER_TABLE_PROBES 16
+
+typedef struct owner_slot {
+    _Atomic pid_t tid; // Holder; 0 while the record is being claimed or freed.
+    unsigned count;    // Acquisitions not yet released. Only touched by the holder.
+    _Atomic pthread_t thread_id;
+    _Atomic uint64_t acquired_ns;
+    _Atomic(const void*) callsite;
+} owner_slot_t;
+
+static _Atomic(const void*) owner_keys[OWNER_TABLE_SIZE]; // Lock of each record; NULL while free.
+static owner_slot_t owner_slots[OWNER_TABLE_SIZE];
+static __thread pid_t self_tid;
+static _Atomic bool owners_tracked;
+
+static inline size_t owner_hash(const void* lock_addr)
+{
+    // Locks are at least 4-byte aligned; Fibonacci hashing spreads the rest.
+    return (size_t)(((uintptr_t)lock_addr >> 2) * 0x9E3779B97F4A7C15ull >> 48) & (OWNER_TABLE_SIZE - 1);
+}
+
+static inline size_t owner_index(size_t index, unsigned probe)
+{
+    return (index + probe) & (OWNER_TABLE_SIZE - 1);
+}
+
+static inline pid_t current_tid(void)
+{
+    if (!self_tid) self_tid = gettid();
+    return self_tid;
+}
+
+/// The coarse clock is read from memory, where a precise one costs more than the
+/// rest of the update.
+static uint64_t monotonic_ns(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+    return (uint64_t)now.tv_sec * 1000000000ull + (uint64_t)now.tv_nsec;
+}
+
+/// Returns the record of `tid` for `lock_addr`, or NULL. Only the holder itself
+/// writes `tid` into a record and frees it, so the answer is exact when `tid`
+/// is the calling thread.
+static owner_slot_t* holder_slot(const void* lock_addr, pid_t tid, size_t* index)
+{
+    size_t base = owner_hash(lock_addr);
+
+    for (unsigned probe = 0; probe < OWNER_TABLE_PROBES; probe++) {
+        size_t i = owner_index(base, probe);
+        if (atomic_load_explicit(&owner_keys[i], memory_order_acquire) != lock_addr) continue;
+        if (atomic_load_explicit(&owner_slots[i].tid, memory_order_relaxed) != tid) continue;
+        if (index) *index = i;
+        return &owner_slots[i];
+    }
+    return NULL;
+}
+
+/// Claims a free record in the window of `lock_addr` with a single CAS.
+static owner_slot_t* claim_slot(const void* lock_addr)
+{
+    size_t base = owner_hash(lock_addr);
+
+    for (unsigned probe = 0; probe < OWNER_TABLE_PROBES; probe++) {
+        size_t i = owner_index(base, probe);
+        const void* expected = NULL;
+        if (!atomic_load_explicit(&owner_keys[i], memory_order_relaxed) &&
+            atomic_compare_exchange_strong_explicit(&owner_keys[i], &expected, lock_addr, memory_order_acq_rel,
+                                                    memory_order_relaxed)) {
+            return &owner_slots[i];
+        }
+    }
+    return NULL;
+}
+
+/// Reads the record at `i` if it belongs to a holder of `lock_addr`. The key and
+/// the holder are checked again afterwards, so a record freed and claimed for
+/// another lock mid-read is skipped rather than mixed up.
+static bool read_slot(size_t i, const void* lock_addr, lockdep_owner_t* owner)
+{
+    if (atomic_load_explicit(&owner_keys[i], memory_order_acquire) != lock_addr) return false;
+
+    owner_slot_t* slot = &owner_slots[i];
+    pid_t tid = atomic_load_explicit(&slot->tid, memory_order_acquire);
+    if (!tid) return false;
+
+    owner->tid = tid;
+    owner->thread_id = atomic_load_explicit(&slot->thread_id, memory_order_relaxed);
+    owner->acquired_ns = atomic_load_explicit(&slot->acquired_ns, memory_order_relaxed);
+    owner->callsite = atomic_load_explicit(&slot->callsite, memory_order_relaxed);
+
+    atomic_thread_fence(memory_order_acquire);
+    return atomic_load_explicit(&slot->tid, memory_order_relaxed) == tid &&
+           atomic_load_explicit(&owner_keys[i], memory_order_relaxed) == lock_addr;
+}
+
+void lockdep_owner_enable(void)
+{
+    atomic_store(&owners_tracked, true);
+}
+
+void lockdep_owner_acquired(const void* lock_addr, const void* ip)
+{
+    if (!atomic_load_explicit(&owners_tracked, memory_order_relaxed)) return;
+
+    pid_t tid = current_tid();
+    owner_slot_t* slot = holder_slot(lock_addr, tid, NULL);
+    if (slot) {
+        slot->count++;
+        return;
+    }
+
+    slot = claim_slot(lock_addr);
+    if (!slot) return;
+
+    slot->count = 1;
+    atomic_store_explicit(&slot->thread_id, pthread_self(), memory_order_relaxed);
+    atomic_store_explicit(&slot->acquired_ns, monotonic_ns(), memory_order_relaxed);
+    atomic_store_explicit(&slot->callsite, ip, memory_order_relaxed);
+    atomic_store_explicit(&slot->tid, tid, memory_order_release);
+}
+
+void lockdep_owner_released(const void* lock_addr)
+{
+    if (!atomic_load_explicit(&owners_tracked, memory_order_relaxed)) return;
+
+    pid_t tid = current_tid();
+    size_t index;
+    owner_slot_t* slot = holder_slot(lock_addr, tid, &index);
+    if (!slot || --slot->count) return;
+
+    // The record may have been cleared and claimed again by a mode switch in
+    // the meantime, in which case it is no longer ours to free.
+    if (atomic_compare_exchange_strong_explicit(&slot->tid, &tid, 0, memory_order_relaxed, memory_order_relaxed)) {
+        atomic_store_explicit(&owner_keys[index], NULL, memory_order_release);
+    }
+}
+
+void lockdep_owner_reset(void)
+{
+    // Holders that let go of their locks while tracking was off left records
+    // that would never be freed.
+    for (size_t i = 0; i < OWNER_TABLE_SIZE; i++) {
+        if (!atomic_load_explicit(&owner_keys[i], memory_order_relaxed)) continue;
+        atomic_store_explicit(&owner_slots[i].tid, 0, memory_order_relaxed);
+        atomic_store_explicit(&owner_keys[i], NULL, memory_order_release);
+    }
+}
+
+void lockdep_owner_atfork_child(void)
+{
+    pid_t parent_tid = self_tid;
+    self_tid = gettid();
+
+    // Only the forking thread runs in the child, so nothing races with the scan.
+    for (size_t i = 0; i < OWNER_TABLE_SIZE; i++) {
+        if (!atomic_load_explicit(&owner_keys[i], memory_order_relaxed)) continue;
+        if (parent_tid && atomic_load_explicit(&owner_slots[i].tid, memory_order_relaxed) == parent_tid) {
+            atomic_store_explicit(&owner_slots[i].tid, self_tid, memory_order_relaxed);
+        } else {
+            atomic_store_explicit(&owner_slots[i].tid, 0, memory_order_relaxed);
+            atomic_store_explicit(&owner_keys[i], NULL, memory_order_relaxed);
+        }
+    }
+}
+
+unsigned lockdep_lock_owners(const void* lock_addr, lockdep_owner_t* owners, unsigned max)
+{
+    size_t base = owner_hash(lock_addr);
+    unsigned count = 0;
+
+    for (unsigned probe = 0; probe < OWNER_TABLE_PROBES && count < max; probe++) {
+        if (read_slot(owner_index(base, probe), lock_addr, &owners[count])) count++;
+    }
+    for (unsigned i = 0; i < count; i++) owners[i].holders = count;
+    return count;
+}
+
+bool lockdep_lock_owner(const void* lock_addr, lockdep_owner_t* owner)
+{
+    lockdep_owner_t owners[OWNER_TABLE_PROBES];
+    unsigned count = lockdep_lock_owners(lock_addr, owners, OWNER_TABLE_PROBES);
+    if (!count) return false;
+
+    unsigned latest = 0;
+    for (unsigned i = 1; i < count; i++) {
+        if (owners[i].acquired_ns > owners[latest].acquired_ns) latest = i;
+    }
+    *owner = owners[latest];
+    return true;
+}
+
+unsigned lockdep_dump_held(pid_t tid)
+{
+    if (!tid) tid = current_tid();
+    if (!atomic_load(&owners_tracked)) {
+        fprintf(stderr, "[LOCKDEP] Lock owners are not tracked, set LOCKDEP_OWNERS=1\n");
+        return 0;
+    }
+    uint64_t now = monotonic_ns();
+
+    // The table is only ever read here, so the scan never holds up the threads
+    // that update it.
+    unsigned count = 0;
+    for (size_t i = 0; i < OWNER_TABLE_SIZE; i++) {
+        const void* lock_addr = atomic_load_explicit(&owner_keys[i], memory_order_acquire);
+        lockdep_owner_t owner;
+        if (!lock_addr || !read_slot(i, lock_addr, &owner) || owner.tid != tid) continue;
+
+        if (!count++) fprintf(stderr, "[LOCKDEP] Thread %d holds:\n", tid);
+        const lock_node_t* lock = lockdep_graph_lookup(lock_addr);
+        fprintf(stderr, "[LOCKDEP] - %s %p, acquired at %p %" PRIu64 " ms ago\n",
+                lock ? lockdep_sync_type_to_string(lock->type) : "LOCK", lock_addr, owner.callsite,
+                now > owner.acquired_ns ? (now - owner.acquired_ns) / 1000000 : 0);
+    }
+    if (!count) fprintf(stderr, "[LOCKDEP] Thread %d holds no lock\n", tid);
+    return count;
+}
@@ -0,0 +1,426 @@
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "../include/lockdep.h"
+#include "lockdep_internal.h"
+
+// ==================== FILE FORMAT ====================
+//
+// The graph file is a flat, native-endian image meant to be mapped read-only:
+//
+//   graph_file_header_t header
+//   uint64_t keys[node_count]          sorted class keys
+//   uint32_t out_index[node_count + 1] CSR offsets into out_edges
+//   uint32_t out_edges[edge_count]     successor indices, sorted per node
+//   uint32_t in_index[node_count + 1]  CSR offsets into in_edges
+//   uint32_t in_edges[edge_count]      predecessor indices, sorted per node
+
+#define GRAPH_FILE_MAGIC "LDGRAPH"
+#define GRAPH_FILE_VERSION 1
+
+#define CLASS_TAG_STATIC 0x5354415449434c4bULL   // Lock lives inside a module.
+#define CLASS_TAG_CALLSITE 0x43414c4c53495445ULL // Lock keyed by who takes it.
+
+typedef struct graph_file_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t node_count;
+    uint32_t edge_count;
+    uint32_t reserved;
+} graph_file_header_t;
+
+typedef struct persisted_graph {
+    void* map;
+    size_t map_size;
+    uint32_t node_count;
+    uint32_t edge_count;
+    const uint64_t* keys;
+    const uint32_t* out_index;
+    const uint32_t* out_edges;
+    const uint32_t* in_index;
+    const uint32_t* in_edges;
+    lock_node_t** nodes; // First node of this run bound to each class.
+    // Scratch space of the searches, sized once for the loaded graph. They
+    // run with the graph lock held, so one set is enough.
+    uint64_t* visited;
+    uint32_t* stack;
+} persisted_graph_t;
+
+typedef struct edge_pair {
+    uint32_t from;
+    uint32_t to;
+} edge_pair_t;
+
+static persisted_graph_t persisted;
+
+// ==================== CLASS KEYS ====================
+
+static uint64_t mix64(uint64_t x)
+{
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ULL;
+    x ^= x >> 33;
+    return x;
+}
+
+/// Hashes `addr` as (module basename, offset), which is stable across runs
+/// regardless of where the module gets mapped.
+static uint64_t hash_module_offset(const void* addr, uint64_t tag)
+{
+    Dl_info info;
+    if (!addr || !dladdr(addr, &info) || !info.dli_fbase) return 0;
+
+    const char* name = info.dli_fname ? info.dli_fname : "";
+    const char* base = strrchr(name, '/');
+    base = base ? base + 1 : name;
+
+    uint64_t hash = 0xcbf29ce484222325ULL; // FNV-1a
+    for (const char* c = base; *c; c++) {
+        hash = (hash ^ (unsigned char)*c) * 0x100000001b3ULL;
+    }
+
+    return mix64(hash ^ tag ^ mix64((uintptr_t)addr - (uintptr_t)info.dli_fbase));
+}
+
+uint64_t lockdep_class_key(lock_node_t* lock)
+{
+    if (lock->class_key) return lock->class_key;
+
+    // Static locks are keyed by their own location, dynamic ones by the code
+    // that first acquired them.
+    uint64_t key = hash_module_offset(lock->lock_addr, CLASS_TAG_STATIC);
+    if (!key) key = hash_module_offset(lock->callsite, CLASS_TAG_CALLSITE);
+
+    return lock->class_key = key;
+}
+
+static bool find_key(const uint64_t* keys, uint32_t count, uint64_t key, uint32_t* index)
+{
+    uint32_t lo = 0, hi = count;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (keys[mid] < key) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    if (lo == count || keys[lo] != key) return false;
+    *index = lo;
+    return true;
+}
+
+static bool persisted_index(lock_node_t* lock, uint32_t* index)
+{
+    if (!persisted.map) return false;
+
+    uint64_t key = lockdep_class_key(lock);
+    return key && find_key(persisted.keys, persisted.node_count, key, index);
+}
+
+// ==================== LOADING ====================
+
+static void unload_graph(void)
+{
+    if (!persisted.map) return;
+
+    munmap(persisted.map, persisted.map_size);
+    free(persisted.nodes);
+    free(persisted.visited);
+    free(persisted.stack);
+    memset(&persisted, 0, sizeof(persisted));
+}
+
+static bool csr_is_valid(const uint32_t* index, const uint32_t* edges, uint32_t node_count, uint32_t edge_count)
+{
+    if (index[0] != 0 || index[node_count] != edge_count) return false;
+
+    for (uint32_t i = 0; i < node_count; i++) {
+        if (index[i] > index[i + 1]) return false;
+    }
+    for (uint32_t i = 0; i < edge_count; i++) {
+        if (edges[i] >= node_count) return false;
+    }
+    return true;
+}
+
+bool lockdep_persist_load(const char* path)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return false;
+
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(graph_file_header_t)) {
+        close(fd);
+        return false;
+    }
+
+    void* map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return false;
+
+    const graph_file_header_t* header = map;
+    size_t nodes = header->node_count, edges = header->edge_count;
+    size_t expected = sizeof(*header) + nodes * sizeof(uint64_t) + 2 * (nodes + 1 + edges) * sizeof(uint32_t);
+
+    if (memcmp(header->magic, GRAPH_FILE_MAGIC, sizeof(header->magic)) != 0 ||
+        header->version != GRAPH_FILE_VERSION || (size_t)st.st_size != expected) {
+        fprintf(stderr, "[LOCKDEP] Ignoring lock graph %s: unknown format or version\n", path);
+        munmap(map, st.st_size);
+        return false;
+    }
+
+    persisted_graph_t graph = {.map = map, .map_size = st.st_size, .node_count = nodes, .edge_count = edges};
+    graph.keys = (const uint64_t*)(header + 1);
+    graph.out_index = (const uint32_t*)(graph.keys + nodes);
+    graph.out_edges = graph.out_index + nodes + 1;
+    graph.in_index = graph.out_edges + edges;
+    graph.in_edges = graph.in_index + nodes + 1;
+
+    if (!csr_is_valid(graph.out_index, graph.out_edges, nodes, edges) ||
+        !csr_is_valid(graph.in_index, graph.in_edges, nodes, edges)) {
+        fprintf(stderr, "[LOCKDEP] Ignoring lock graph %s: corrupted adjacency\n", path);
+        munmap(map, st.st_size);
+        return false;
+    }
+
+    graph.nodes = calloc(nodes ? nodes : 1, sizeof(lock_node_t*));
+    graph.visited = malloc((nodes / 64 + 1) * sizeof(uint64_t));
+    graph.stack = malloc((nodes ? nodes : 1) * sizeof(uint32_t));
+    if (!graph.nodes || !graph.visited || !graph.stack) {
+        free(graph.nodes);
+        free(graph.visited);
+        free(graph.stack);
+        munmap(map, st.st_size);
+        return false;
+    }
+
+    unload_graph();
+    persisted = graph;
+
+    fprintf(stderr, "[LOCKDEP] Loaded lock graph %s (%u classes, %u orderings)\n", path, graph.node_count,
+            graph.edge_count);
+    return true;
+}
+
+void lockdep_persist_bind(lock_node_t* lock)
+{
+    uint32_t index;
+    if (!persisted_index(lock, &index) || persisted.nodes[index]) return;
+
+    persisted.nodes[index] = lock;
+
+    // Earlier runs ordered these classes before the new lock. The node has no
+    // outgoing edges yet, so these cannot close a cycle.
+    for (uint32_t i = persisted.in_index[index]; i < persisted.in_index[index + 1]; i++) {
+        lock_node_t* parent = persisted.nodes[persisted.in_edges[i]];
+        if (parent && parent != lock) lockdep_link_locks(parent, lock);
+    }
+
+    for (uint32_t i = persisted.out_index[index]; i < persisted.out_index[index + 1]; i++) {
+        lock_node_t* child = persisted.nodes[persisted.out_edges[i]];
+        if (child && child != lock && !lockdep_link_locks(lock, child)) {
+            printf("[LOCKDEP] Cycle detected between %p and %p against an ordering from a previous run\n",
+                   lock->lock_addr, child->lock_addr);
+        }
+    }
+}
+
+/// Looks for a path between two classes through the loaded graph, which covers
+/// classes that have not been instantiated by this run yet.
+bool lockdep_persist_would_create_cycle(lock_node_t* from, lock_node_t* to)
+{
+    uint32_t source, target;
+    if (!persisted_index(to, &source) || !persisted_index(from, &target)) return false;
+
+    // Distinct locks sharing a callsite share a class; that is not an ordering.
+    if (source == target) return false;
+
+    uint64_t* visited = persisted.visited;
+    uint32_t* stack = persisted.stack;
+    memset(visited, 0, (persisted.node_count + 63) / 64 * sizeof(uint64_t));
+
+    bool found = false;
+    uint32_t depth = 0;
+    stack[depth++] = source;
+    visited[source / 64] |= 1ULL << (source % 64);
+
+    while (depth && !found) {
+        uint32_t node = stack[--depth];
+        for (uint32_t i = persisted.out_index[node]; i < persisted.out_index[node + 1]; i++) {
+            uint32_t next = persisted.out_edges[i];
+            if (next == target) {
+                found = true;
+                break;
+            }
+            if (!(visited[next / 64] & (1ULL << (next % 64)))) {
+                visited[next / 64] |= 1ULL << (next % 64);
+                stack[depth++] = next;
+            }
+        }
+    }
+
+    return found;
+}
+
+// ==================== SAVING ====================
+
+static int compare_keys(const void* a, const void* b)
+{
+    uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+    return (x > y) - (x < y);
+}
+
+static int compare_edges(const void* a, const void* b)
+{
+    const edge_pair_t *x = a, *y = b;
+    if (x->from != y->from) return (x->from > y->from) - (x->from < y->from);
+    return (x->to > y->to) - (x->to < y->to);
+}
+
+static size_t unique_keys(uint64_t* keys, size_t count)
+{
+    size_t out = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (out == 0 || keys[out - 1] != keys[i]) keys[out++] = keys[i];
+    }
+    return out;
+}
+
+static size_t unique_edges(edge_pair_t* edges, size_t count)
+{
+    size_t out = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (out == 0 || compare_edges(&edges[out - 1], &edges[i]) != 0) edges[out++] = edges[i];
+    }
+    return out;
+}
+
+/// Fills `index`/`targets` with the CSR form of `edges`, which must be sorted
+/// by the field that `by_source` selects.
+static void build_csr(const edge_pair_t* edges, size_t edge_count, size_t node_count, bool by_source, uint32_t* index,
+                      uint32_t* targets)
+{
+    memset(index, 0, (node_count + 1) * sizeof(uint32_t));
+    for (size_t i = 0; i < edge_count; i++) {
+        index[(by_source ? edges[i].from : edges[i].to) + 1]++;
+    }
+    for (size_t i = 0; i < node_count; i++) {
+        index[i + 1] += index[i];
+    }
+    for (size_t i = 0; i < edge_count; i++) {
+        targets[i] = by_source ? edges[i].to : edges[i].from;
+    }
+}
+
+static int compare_edges_by_target(const void* a, const void* b)
+{
+    const edge_pair_t *x = a, *y = b;
+    if (x->to != y->to) return (x->to > y->to) - (x->to < y->to);
+    return (x->from > y->from) - (x->from < y->from);
+}
+
+static bool write_all(FILE* file, const void* data, size_t size)
+{
+    return size == 0 || fwrite(data, 1, size, file) == size;
+}
+
+bool lockdep_persist_save(const char* path)
+{
+    uint32_t lock_count = lockdep_graph_node_count();
+    size_t key_count = persisted.node_count + lock_count;
+    size_t edge_count = persisted.edge_count + lockdep_graph_edge_count();
+
+    uint64_t* keys = malloc((key_count ? key_count : 1) * sizeof(uint64_t));
+    edge_pair_t* edges = malloc((edge_count ? edge_count : 1) * sizeof(edge_pair_t));
+    uint32_t* csr = NULL;
+    FILE* file = NULL;
+    bool saved = false;
+    char tmp_path[4096];
+
+    if (!keys || !edges) goto out;
+
+    // Classes known from earlier runs are kept even if this run never used them.
+    size_t nodes = 0;
+    if (persisted.map) memcpy(keys, persisted.keys, persisted.node_count * sizeof(uint64_t));
+    nodes = persisted.node_count;
+    for (uint32_t id = 0; id < lock_count; id++) {
+        uint64_t key = lockdep_class_key(lockdep_graph_node(id));
+        if (key) keys[nodes++] = key;
+    }
+    qsort(keys, nodes, sizeof(uint64_t), compare_keys);
+    nodes = unique_keys(keys, nodes);
+
+    size_t count = 0;
+    for (uint32_t from = 0; from < persisted.node_count; from++) {
+        // Every loaded key was copied into `keys`, so none should be missing.
+        uint32_t new_from;
+        if (!find_key(keys, nodes, persisted.keys[from], &new_from)) continue;
+        for (uint32_t i = persisted.out_index[from]; i < persisted.out_index[from + 1]; i++) {
+            uint32_t new_to;
+            if (!find_key(keys, nodes, persisted.keys[persisted.out_edges[i]], &new_to)) continue;
+            edges[count++] = (edge_pair_t){new_from, new_to};
+        }
+    }
+
+    // Orderings that closed a cycle are reported by the run that saw them and
+    // are not carried over.
+    for (uint32_t id = 0; id < lock_count; id++) {
+        lock_node_t* lock = lockdep_graph_node(id);
+        uint32_t from, to;
+        if (!lock->class_key || !find_key(keys, nodes, lock->class_key, &from)) continue;
+        for (uint32_t i = 0; i < lock->out_degree; i++) {
+            lock_node_t* child = lockdep_graph_node(lock->edges[i]);
+            if (*lockdep_edge_flags(lockdep_edge_id(lock, i)) & LOCKDEP_EDGE_INVERSION) continue;
+            if (!lockdep_class_key(child)) continue;
+            if (find_key(keys, nodes, child->class_key, &to) && to != from) {
+                edges[count++] = (edge_pair_t){from, to};
+            }
+        }
+    }
+    qsort(edges, count, sizeof(edge_pair_t), compare_edges);
+    count = unique_edges(edges, count);
+
+    csr = malloc(2 * (nodes + 1 + count) * sizeof(uint32_t));
+    if (!csr) goto out;
+
+    uint32_t* out_index = csr;
+    uint32_t* out_edges = out_index + nodes + 1;
+    uint32_t* in_index = out_edges + count;
+    uint32_t* in_edges = in_index + nodes + 1;
+
+    build_csr(edges, count, nodes, true, out_index, out_edges);
+    qsort(edges, count, sizeof(edge_pair_t), compare_edges_by_target);
+    build_csr(edges, count, nodes, false, in_index, in_edges);
+
+    graph_file_header_t header = {.magic = GRAPH_FILE_MAGIC, .version = GRAPH_FILE_VERSION};
+    header.node_count = nodes;
+    header.edge_count = count;
+
+    // Write to a sibling file and rename it, so readers never map a torn file.
+    if (snprintf(tmp_path, sizeof(tmp_path), "%s.%d.tmp", path, getpid()) >= (int)sizeof(tmp_path)) goto out;
+    file = fopen(tmp_path, "wb");
+    if (!file) goto out;
+
+    saved = write_all(file, &header, sizeof(header)) && write_all(file, keys, nodes * sizeof(uint64_t)) &&
+            write_all(file, csr, 2 * (nodes + 1 + count) * sizeof(uint32_t));
+    saved = (fclose(file) == 0) && saved;
+    saved = saved && rename(tmp_path, path) == 0;
+    if (!saved) unlink(tmp_path);
+
+out:
+    free(keys);
+    free(edges);
+    free(csr);
+    return saved;
+}
@@ -0,0 +1,100 @@
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <errno.h>
+#include <link.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../include/lockdep.h"
+
+typedef struct module_lookup {
+    const char* name;
+    uintptr_t base;
+    bool found;
+} module_lookup_t;
+
+static const char* path_basename(const char* path)
+{
+    const char* slash = strrchr(path, '/');
+    return slash ? slash + 1 : path;
+}
+
+static int match_module(struct dl_phdr_info* info, size_t size __attribute__((unused)), void* data)
+{
+    module_lookup_t* lookup = data;
+
+    // The main program is reported without a name.
+    const char* name = info->dlpi_name[0] ? path_basename(info->dlpi_name) : program_invocation_short_name;
+    if (strcmp(name, lookup->name) != 0) return 0;
+
+    lookup->base = info->dlpi_addr;
+    lookup->found = true;
+    return 1;
+}
+
+/// Resolves a lock reference from a rank file: "<module>+<hex offset>", a hex
+/// address, or the name of an exported symbol.
+static const void* resolve_lock(char* ref)
+{
+    char* plus = strchr(ref, '+');
+    if (plus) {
+        *plus = '\0';
+        char* end;
+        errno = 0;
+        uintptr_t offset = strtoull(plus + 1, &end, 16);
+        if (errno || *end) return NULL;
+
+        module_lookup_t lookup = {.name = ref};
+        dl_iterate_phdr(match_module, &lookup);
+        return lookup.found ? (const void*)(lookup.base + offset) : NULL;
+    }
+
+    if (ref[0] == '0' && (ref[1] == 'x' || ref[1] == 'X')) {
+        char* end;
+        errno = 0;
+        uintptr_t addr = strtoull(ref, &end, 16);
+        return (errno || *end) ? NULL : (const void*)addr;
+    }
+
+    return dlsym(RTLD_DEFAULT, ref);
+}
+
+bool lockdep_load_ranks(const char* path)
+{
+    FILE* file = fopen(path, "r");
+    if (!file) {
+        fprintf(stderr, "[LOCKDEP] Failed to open rank file %s\n", path);
+        return false;
+    }
+
+    char line[512];
+    unsigned line_no = 0, ranked = 0;
+    bool ok = true;
+
+    while (fgets(line, sizeof(line), file)) {
+        line_no++;
+
+        char* comment = strchr(line, '#');
+        if (comment) *comment = '\0';
+
+        char ref[256];
+        unsigned rank;
+        int fields = sscanf(line, "%255s %u", ref, &rank);
+        if (fields <= 0) continue;
+
+        const void* lock_addr = fields == 2 ? resolve_lock(ref) : NULL;
+        if (!lock_addr) {
+            fprintf(stderr, "[LOCKDEP] %s:%u: cannot resolve rank entry\n", path, line_no);
+            ok = false;
+            continue;
+        }
+
+        lockdep_set_rank(lock_addr, rank);
+        ranked++;
+    }
+
+    fclose(file);
+    fprintf(stderr, "[LOCKDEP] Loaded %u lock ranks from %s\n", ranked, path);
+    return ok;
+}
@@ -0,0 +1,338 @@
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../include/lockdep.h"
+#include "lockdep_internal.h"
+
+// Problem reports. An inversion stays in the graph, so every later acquisition
+// through it is refused again. Each problem is only reported the first time it
+// is seen: a cycle is keyed by the set of its edges, whichever ordering closes
+// it, and a rank violation by the lock and the rank held. Later occurrences are
+// counted, and the count is printed at most once per second per problem, then
+// once more at exit. A refusal is counted under the graph lock, so problems
+// are indexed by key, and the orderings that closed a cycle by edge, in
+// open-addressed tables: counting one costs a probe, however many there are.
+//
+// With LOCKDEP_REPORT_FILE, each report is also written to that file as a JSON
+// line. A line is written with a single write() on a file opened for
+// appending, so processes sharing the file do not interleave their lines.
+
+#define REPEAT_INTERVAL_NS 1000000000ull // 1s
+
+#define KEY_TAG_CYCLE 0x4359434c45ull
+#define KEY_TAG_RANK 0x52414e4bull
+
+typedef struct report_entry {
+    uint64_t key;
+    uint32_t id;
+    bool rank;         // A rank violation, not a cycle.
+    uint64_t count;    // Occurrences seen.
+    uint64_t reported; // Occurrences covered by the last report.
+    uint64_t last_ns;  // When the last report was made.
+} report_entry_t;
+
+// The ordering that was refused, and the problem it belongs to.
+typedef struct closing_edge {
+    uint32_t edge;
+    uint32_t entry; // Index + 1 in `entries`, 0 for an empty slot.
+} closing_edge_t;
+
+// Entries in the order they were seen, which gives their ids, and indexed by
+// key: a slot holds an index + 1, 0 when empty. The index has twice as many
+// slots as there is room for entries, so every probe ends on the key or on an
+// empty slot.
+static report_entry_t* entries;
+static uint32_t entry_count;
+static uint32_t entry_capacity;
+static uint32_t* entry_slots;
+
+// Kept at most half full too.
+static closing_edge_t* closing_edges;
+static uint32_t closing_edge_count;
+static uint32_t closing_edge_mask; // Number of slots, minus one.
+
+static int report_fd = -1;
+static __thread bool first_seen;
+
+void lockdep_report_configure(const char* path)
+{
+    report_fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (report_fd < 0) fprintf(stderr, "[LOCKDEP] Failed to open report file %s\n", path);
+}
+
+static uint64_t clock_ns(clockid_t clock)
+{
+    struct timespec now;
+    clock_gettime(clock, &now);
+    return (uint64_t)now.tv_sec * 1000000000ull + (uint64_t)now.tv_nsec;
+}
+
+static uint64_t mix64(uint64_t x)
+{
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdull;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ull;
+    x ^= x >> 33;
+    return x;
+}
+
+// ==================== JSON LINES ====================
+
+typedef struct line_buffer {
+    char* data;
+    size_t length;
+    size_t capacity;
+} line_buffer_t;
+
+static void __attribute__((format(printf, 2, 3))) append(line_buffer_t* line, const char* format, ...)
+{
+    if (!line->data) return;
+
+    for (;;) {
+        va_list args;
+        va_start(args, format);
+        int written = vsnprintf(line->data + line->length, line->capacity - line->length, format, args);
+        va_end(args);
+        if (written < 0) return;
+
+        if ((size_t)written < line->capacity - line->length) {
+            line->length += written;
+            return;
+        }
+
+        char* grown = realloc(line->data, 2 * line->capacity + written);
+        if (!grown) {
+            free(line->data);
+            line->data = NULL;
+            return;
+        }
+        line->data = grown;
+        line->capacity = 2 * line->capacity + written;
+    }
+}
+
+static line_buffer_t begin_line(const char* event, uint32_t id)
+{
+    // Without a report file, append() and end_line() have nothing to do.
+    if (report_fd < 0) return (line_buffer_t){NULL, 0, 0};
+
+    line_buffer_t line = {malloc(256), 0, 256};
+    append(&line, "{\"event\":\"%s\",\"id\":%u,\"time_ns\":%" PRIu64 ",\"pid\":%d,\"tid\":%d", event, id,
+           clock_ns(CLOCK_REALTIME), getpid(), gettid());
+    return line;
+}
+
+static void append_lock(line_buffer_t* line, const lock_node_t* lock)
+{
+    append(line, "{\"type\":\"%s\",\"address\":\"%p\",", lockdep_sync_type_to_string(lock->type), lock->lock_addr);
+    if (lock->callsite) {
+        append(line, "\"callsite\":\"%p\"", lock->callsite);
+    } else {
+        append(line, "\"callsite\":null");
+    }
+    if (lock->rank) append(line, ",\"rank\":%u", lock->rank);
+    append(line, "}");
+}
+
+static void end_line(line_buffer_t* line)
+{
+    append(line, "}\n");
+    if (line->data && report_fd >= 0) {
+        for (size_t written = 0; written < line->length;) {
+            ssize_t result = write(report_fd, line->data + written, line->length - written);
+            if (result <= 0) break;
+            written += result;
+        }
+    }
+    free(line->data);
+}
+
+// ==================== DEDUPLICATION ====================
+
+static report_entry_t* find_entry(uint64_t key)
+{
+    if (!entry_slots) return NULL;
+
+    uint32_t mask = 2 * entry_capacity - 1;
+    for (uint32_t i = (uint32_t)key;; i++) {
+        uint32_t slot = entry_slots[i & mask];
+        if (!slot) return NULL;
+        if (entries[slot - 1].key == key) return &entries[slot - 1];
+    }
+}
+
+/// Adds `entries[index]` to the index by key.
+static void index_entry(uint32_t index)
+{
+    uint32_t mask = 2 * entry_capacity - 1;
+    uint32_t i = (uint32_t)entries[index].key;
+    while (entry_slots[i & mask]) i++;
+    entry_slots[i & mask] = index + 1;
+}
+
+static report_entry_t* add_entry(uint64_t key, bool rank)
+{
+    if (entry_count == entry_capacity) {
+        uint32_t capacity = entry_capacity ? 2 * entry_capacity : 16;
+        uint32_t* slots = calloc(2 * capacity, sizeof(uint32_t));
+        report_entry_t* grown = slots ? realloc(entries, capacity * sizeof(report_entry_t)) : NULL;
+        if (!grown) {
+            free(slots);
+            return NULL;
+        }
+        entries = grown;
+        entry_capacity = capacity;
+        free(entry_slots);
+        entry_slots = slots;
+        for (uint32_t i = 0; i < entry_count; i++) index_entry(i);
+    }
+
+    report_entry_t* entry = &entries[entry_count];
+    *entry = (report_entry_t){key, entry_count + 1, rank, 1, 1, clock_ns(CLOCK_MONOTONIC_COARSE)};
+    index_entry(entry_count++);
+    return entry;
+}
+
+/// Returns the slot of `edge` in `slots`, or the empty slot where it belongs.
+static closing_edge_t* closing_edge_slot(closing_edge_t* slots, uint32_t mask, uint32_t edge)
+{
+    for (uint32_t i = (uint32_t)mix64(edge);; i++) {
+        closing_edge_t* slot = &slots[i & mask];
+        if (!slot->entry || slot->edge == edge) return slot;
+    }
+}
+
+static void remember_closing_edge(uint32_t edge, const report_entry_t* entry)
+{
+    if (2 * (closing_edge_count + 1) > closing_edge_mask + 1) {
+        uint32_t size = closing_edges ? 2 * (closing_edge_mask + 1) : 32;
+        closing_edge_t* grown = calloc(size, sizeof(closing_edge_t));
+        if (!grown) return;
+        for (uint32_t i = 0; closing_edges && i <= closing_edge_mask; i++) {
+            if (closing_edges[i].entry) *closing_edge_slot(grown, size - 1, closing_edges[i].edge) = closing_edges[i];
+        }
+        free(closing_edges);
+        closing_edges = grown;
+        closing_edge_mask = size - 1;
+    }
+
+    closing_edge_t* slot = closing_edge_slot(closing_edges, closing_edge_mask, edge);
+    if (slot->entry) return;
+    *slot = (closing_edge_t){edge, (uint32_t)(entry - entries) + 1};
+    closing_edge_count++;
+}
+
+static void report_count(report_entry_t* entry)
+{
+    const char* what = entry->rank ? "Rank violation" : "Cycle";
+    fprintf(stderr, "[LOCKDEP] %s %u seen %" PRIu64 " times\n", what, entry->id, entry->count);
+
+    line_buffer_t line = begin_line("repeat", entry->id);
+    append(&line, ",\"count\":%" PRIu64, entry->count);
+    end_line(&line);
+
+    entry->reported = entry->count;
+}
+
+/// Counts another occurrence of a known problem, reporting the count if the
+/// last report is old enough.
+static void repeat(report_entry_t* entry)
+{
+    entry->count++;
+    first_seen = false;
+
+    uint64_t now = clock_ns(CLOCK_MONOTONIC_COARSE);
+    if (now - entry->last_ns < REPEAT_INTERVAL_NS) return;
+    entry->last_ns = now;
+    report_count(entry);
+}
+
+bool lockdep_report_repeat(uint32_t edge)
+{
+    if (!closing_edges) return false;
+
+    const closing_edge_t* slot = closing_edge_slot(closing_edges, closing_edge_mask, edge);
+    if (!slot->entry) return false;
+    repeat(&entries[slot->entry - 1]);
+    return true;
+}
+
+bool lockdep_report_cycle(uint32_t edge, const uint32_t* cycle, uint32_t length, const void* ip)
+{
+    // The sum of the edge hashes does not depend on where the cycle starts.
+    uint64_t key = mix64(KEY_TAG_CYCLE);
+    for (uint32_t i = 0; i < length; i++) {
+        key += mix64((uint64_t)cycle[i] << 32 | cycle[(i + 1) % length]);
+    }
+
+    report_entry_t* entry = find_entry(key);
+    if (entry) {
+        remember_closing_edge(edge, entry);
+        repeat(entry);
+        return false;
+    }
+
+    entry = add_entry(key, false);
+    if (!entry) return first_seen = true;
+    remember_closing_edge(edge, entry);
+
+    line_buffer_t line = begin_line("cycle", entry->id);
+    append(&line, ",\"ip\":\"%p\",\"locks\":[", ip);
+    for (uint32_t i = 0; i < length; i++) {
+        if (i) append(&line, ",");
+        append_lock(&line, lockdep_graph_node(cycle[i]));
+    }
+    append(&line, "]");
+    end_line(&line);
+
+    return first_seen = true;
+}
+
+bool lockdep_report_rank(const lock_node_t* lock, unsigned held_rank, const void* ip)
+{
+    uint64_t key = mix64(KEY_TAG_RANK ^ ((uint64_t)lock->id << 32 | held_rank));
+
+    report_entry_t* entry = find_entry(key);
+    if (entry) {
+        repeat(entry);
+        return false;
+    }
+
+    entry = add_entry(key, true);
+    if (!entry) return first_seen = true;
+
+    line_buffer_t line = begin_line("rank_violation", entry->id);
+    append(&line, ",\"ip\":\"%p\",\"lock\":", ip);
+    append_lock(&line, lock);
+    append(&line, ",\"held_rank\":%u", held_rank);
+    end_line(&line);
+
+    return first_seen = true;
+}
+
+bool lockdep_report_first_seen(void)
+{
+    return first_seen;
+}
+
+void lockdep_report_flush(void)
+{
+    for (uint32_t i = 0; i < entry_count; i++) {
+        if (entries[i].count > entries[i].reported) report_count(&entries[i]);
+    }
+}
+
+void lockdep_report_refusal(const char* operation)
+{
+    if (!first_seen) return;
+    first_seen = false;
+    fprintf(stderr, "[LOCKDEP] DEADLOCK DETECTED on %s\n", operation);
+}
@@ -0,0 +1,247 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lockdep_internal.h"
+
+// Whole-graph cycle analysis. Validation stops at the first cycle an
+// acquisition would close and only names the two locks of that edge; this pass
+// finds every group of locks involved in circular dependencies at once.
+//
+// Tarjan's algorithm splits the graph into strongly connected components in
+// O(V + E); a component with more than one lock, or a lock ordered after
+// itself, holds at least one cycle. Enumerating every elementary cycle can take
+// exponential time, so each component is reported with its locks and one full
+// cycle per inversion flagged inside it (found by a BFS limited to the
+// component), or a single cycle if none was flagged. The walk is iterative, so
+// deep graphs cannot overflow the stack.
+
+#define UNVISITED UINT32_MAX
+#define MAX_CYCLES_PER_COMPONENT 16
+
+typedef struct scc_frame {
+    uint32_t node;
+    uint32_t next_edge; // Index of the next edge of `node` to walk.
+} scc_frame_t;
+
+typedef struct scc_state {
+    uint32_t node_count;
+    uint32_t* index;      // Discovery order, UNVISITED until reached.
+    uint32_t* lowlink;    // Lowest index reachable; the component once assigned.
+    uint32_t* stack;      // Tarjan's stack of open nodes.
+    bool* on_stack;
+    scc_frame_t* frames;  // Explicit DFS call stack.
+    uint32_t* component;  // Component of each node.
+    uint32_t component_count;
+} scc_state_t;
+
+static void scc_free(scc_state_t* state)
+{
+    free(state->index);
+    free(state->lowlink);
+    free(state->stack);
+    free(state->on_stack);
+    free(state->frames);
+    free(state->component);
+}
+
+static bool scc_alloc(scc_state_t* state)
+{
+    memset(state, 0, sizeof(*state));
+    state->node_count = lockdep_graph_node_count();
+
+    size_t n = state->node_count ? state->node_count : 1;
+    state->index = malloc(n * sizeof(uint32_t));
+    state->lowlink = malloc(n * sizeof(uint32_t));
+    state->stack = malloc(n * sizeof(uint32_t));
+    state->on_stack = calloc(n, sizeof(bool));
+    state->frames = malloc(n * sizeof(scc_frame_t));
+    state->component = malloc(n * sizeof(uint32_t));
+    if (!state->index || !state->lowlink || !state->stack || !state->on_stack || !state->frames || !state->component) {
+        scc_free(state);
+        return false;
+    }
+
+    for (uint32_t i = 0; i < state->node_count; i++) state->index[i] = UNVISITED;
+    return true;
+}
+
+static void scc_visit(scc_state_t* state, uint32_t root, uint32_t* next_index)
+{
+    uint32_t depth = 0, stack_size = 0;
+
+    state->frames[depth++] = (scc_frame_t){root, 0};
+    state->index[root] = state->lowlink[root] = (*next_index)++;
+    state->stack[stack_size++] = root;
+    state->on_stack[root] = true;
+
+    while (depth) {
+        scc_frame_t* frame = &state->frames[depth - 1];
+        uint32_t node = frame->node;
+        const lock_node_t* lock = lockdep_graph_node(node);
+
+        if (frame->next_edge < lock->out_degree) {
+            uint32_t child = lock->edges[frame->next_edge++];
+
+            if (state->index[child] == UNVISITED) {
+                state->frames[depth++] = (scc_frame_t){child, 0};
+                state->index[child] = state->lowlink[child] = (*next_index)++;
+                state->stack[stack_size++] = child;
+                state->on_stack[child] = true;
+            } else if (state->on_stack[child] && state->index[child] < state->lowlink[node]) {
+                state->lowlink[node] = state->index[child];
+            }
+            continue;
+        }
+
+        // All edges walked: `node` closes a component if nothing below it
+        // reached an older open node.
+        if (state->lowlink[node] == state->index[node]) {
+            uint32_t member;
+            do {
+                member = state->stack[--stack_size];
+                state->on_stack[member] = false;
+                state->component[member] = state->component_count;
+            } while (member != node);
+            state->component_count++;
+        }
+
+        depth--;
+        if (depth) {
+            uint32_t parent = state->frames[depth - 1].node;
+            if (state->lowlink[node] < state->lowlink[parent]) state->lowlink[parent] = state->lowlink[node];
+        }
+    }
+}
+
+static bool has_self_edge(const lock_node_t* lock)
+{
+    for (uint32_t i = 0; i < lock->out_degree; i++) {
+        if (lock->edges[i] == lock->id) return true;
+    }
+    return false;
+}
+
+/// Prints the shortest path from `from` back to `to` inside their component,
+/// whose `size` locks are `members`, preceded by the edge `to -> from`. `queue`
+/// and `came_from` are scratch arrays of node_count entries. The search never
+/// leaves the component, so only the entries of its members are reset, which
+/// keeps the whole report linear however many groups there are.
+static void print_cycle(scc_state_t* state, const uint32_t* members, uint32_t size, uint32_t to, uint32_t from,
+                        uint32_t* queue, uint32_t* came_from)
+{
+    uint32_t component = state->component[from];
+    uint32_t head = 0, tail = 0;
+
+    for (uint32_t i = 0; i < size; i++) came_from[members[i]] = UNVISITED;
+    queue[tail++] = from;
+    came_from[from] = from;
+
+    while (head < tail && came_from[to] == UNVISITED) {
+        uint32_t node = queue[head++];
+        const lock_node_t* lock = lockdep_graph_node(node);
+        for (uint32_t i = 0; i < lock->out_degree; i++) {
+            uint32_t next = lock->edges[i];
+            if (state->component[next] != component || came_from[next] != UNVISITED) continue;
+            came_from[next] = node;
+            queue[tail++] = next;
+        }
+    }
+
+    // Walk back from `to`, reusing the queue for the path.
+    uint32_t length = 0;
+    for (uint32_t node = to; node != from; node = came_from[node]) queue[length++] = node;
+    queue[length++] = from;
+
+    const lock_node_t* first = lockdep_graph_node(to);
+    fprintf(stderr, "[LOCKDEP]   cycle: %s %p", lockdep_sync_type_to_string(first->type), first->lock_addr);
+    for (uint32_t i = length; i-- > 0;) {
+        const lock_node_t* lock = lockdep_graph_node(queue[i]);
+        fprintf(stderr, " -> %s %p", lockdep_sync_type_to_string(lock->type), lock->lock_addr);
+    }
+    fprintf(stderr, "\n");
+}
+
+static void report_component(scc_state_t* state, uint32_t component, const uint32_t* members, uint32_t size,
+                             uint32_t number, uint32_t* queue, uint32_t* came_from)
+{
+    fprintf(stderr, "[LOCKDEP] Group %u: %u lock%s\n", number, size, size == 1 ? "" : "s");
+    for (uint32_t i = 0; i < size; i++) {
+        const lock_node_t* lock = lockdep_graph_node(members[i]);
+        fprintf(stderr, "[LOCKDEP]   %s %p, first acquired at %p\n", lockdep_sync_type_to_string(lock->type),
+                lock->lock_addr, lock->callsite);
+    }
+
+    unsigned cycles = 0;
+    for (uint32_t i = 0; i < size && cycles < MAX_CYCLES_PER_COMPONENT; i++) {
+        const lock_node_t* lock = lockdep_graph_node(members[i]);
+        for (uint32_t e = 0; e < lock->out_degree && cycles < MAX_CYCLES_PER_COMPONENT; e++) {
+            bool inversion = *lockdep_edge_flags(lockdep_edge_id(lock, e)) & LOCKDEP_EDGE_INVERSION;
+            if (!inversion || state->component[lock->edges[e]] != component) continue;
+            print_cycle(state, members, size, lock->id, lock->edges[e], queue, came_from);
+            cycles++;
+        }
+    }
+
+    // Orderings recorded without validation close cycles nobody flagged.
+    if (!cycles) {
+        const lock_node_t* lock = lockdep_graph_node(members[0]);
+        for (uint32_t e = 0; e < lock->out_degree; e++) {
+            if (state->component[lock->edges[e]] != component) continue;
+            print_cycle(state, members, size, lock->id, lock->edges[e], queue, came_from);
+            break;
+        }
+    }
+}
+
+unsigned lockdep_scc_report(void)
+{
+    scc_state_t state;
+    if (!scc_alloc(&state)) {
+        fprintf(stderr, "[LOCKDEP] Cycle analysis: out of memory\n");
+        return 0;
+    }
+
+    uint32_t next_index = 0;
+    for (uint32_t node = 0; node < state.node_count; node++) {
+        if (state.index[node] == UNVISITED) scc_visit(&state, node, &next_index);
+    }
+
+    // Bucket the nodes by component; `lowlink` is free to hold the counts.
+    uint32_t* sizes = state.lowlink;
+    uint32_t* offsets = calloc(state.component_count + 1, sizeof(uint32_t));
+    uint32_t* members = malloc((state.node_count ? state.node_count : 1) * sizeof(uint32_t));
+    if (!offsets || !members) {
+        free(offsets);
+        free(members);
+        scc_free(&state);
+        fprintf(stderr, "[LOCKDEP] Cycle analysis: out of memory\n");
+        return 0;
+    }
+    memset(sizes, 0, state.node_count * sizeof(uint32_t));
+    for (uint32_t node = 0; node < state.node_count; node++) {
+        offsets[state.component[node] + 1]++;
+    }
+    for (uint32_t c = 0; c < state.component_count; c++) offsets[c + 1] += offsets[c];
+    for (uint32_t node = 0; node < state.node_count; node++) {
+        uint32_t c = state.component[node];
+        members[offsets[c] + sizes[c]++] = node;
+    }
+
+    // `index` and `stack` are no longer needed and serve as BFS scratch space.
+    unsigned groups = 0;
+    for (uint32_t c = 0; c < state.component_count; c++) {
+        uint32_t size = offsets[c + 1] - offsets[c];
+        const uint32_t* group = members + offsets[c];
+        if (size == 1 && !has_self_edge(lockdep_graph_node(group[0]))) continue;
+
+        if (!groups) fprintf(stderr, "[LOCKDEP] Cycle analysis: locks with circular dependencies\n");
+        report_component(&state, c, group, size, ++groups, state.stack, state.index);
+    }
+    if (!groups) fprintf(stderr, "[LOCKDEP] Cycle analysis: no circular dependencies\n");
+
+    free(offsets);
+    free(members);
+    scc_free(&state);
+    return groups;
+}
@@ -0,0 +1,391 @@
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <inttypes.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "../include/lockdep.h"
+#include "lockdep_internal.h"
+
+// ==================== SEGMENT LAYOUT ====================
+//
+// Locks placed in shared memory, such as PTHREAD_PROCESS_SHARED mutexes, are
+// also recorded in a graph kept in a named POSIX shared-memory segment, so
+// every process attached to it validates its orderings against those of the
+// others. A shared lock is keyed by the object it lives in (the device and
+// inode behind the mapping) and its offset there, which are the same in every
+// process whatever the address it is mapped at.
+//
+// The segment is a fixed-size image updated without locks:
+//
+//   shm_header_t header
+//   shm_lock_t locks[SHM_LOCK_SLOTS]          open-addressed by key
+//   _Atomic uint64_t edge_keys[SHM_EDGE_SLOTS] open-addressed set of orderings
+//   shm_edge_t edges[SHM_EDGE_RECORDS]        adjacency lists, linked by index
+//
+// A lock slot is claimed with a compare-and-swap on its state and published
+// once its key is written. An ordering is published once it passed the cycle
+// checks, so inversions stay out: a record is claimed first, then its key in
+// the edge set, so only one process appends it, then it is pushed onto its
+// parent's list. Records are never modified once published, and nothing is
+// ever removed.
+//
+// Checking an ordering and publishing it are not one atomic step. Two
+// processes that check A -> B and B -> A at the same time can both miss the
+// other's ordering, pass, and both publish: neither acquisition is refused,
+// and the inversion stays in the segment. It is then reported to the next
+// process that takes either ordering for the first time, not to the two that
+// raced. Each process validates a given ordering once, so the window is only
+// that first check.
+
+#define SHM_MAGIC "LDSHARED"
+#define SHM_VERSION 1
+
+#define SHM_LOCK_SLOTS 16384
+#define SHM_EDGE_SLOTS 131072
+#define SHM_EDGE_RECORDS (SHM_EDGE_SLOTS / 2)
+
+#define SHM_UNINITIALIZED 0
+#define SHM_INITIALIZING 1
+#define SHM_READY 2
+
+#define SLOT_EMPTY 0
+#define SLOT_CLAIMED 1
+#define SLOT_READY 2
+
+typedef struct shm_lock {
+    _Atomic uint32_t state;
+    uint32_t type;
+    uint64_t device;
+    uint64_t inode;
+    uint64_t offset;
+    _Atomic uint32_t first_edge; // Index + 1 of the newest outgoing edge, 0 if none.
+    uint32_t reserved;
+} shm_lock_t;
+
+typedef struct shm_edge {
+    uint32_t child; // Lock slot ordered after the parent.
+    uint32_t next;  // Index + 1 of the parent's previous edge, 0 if none.
+} shm_edge_t;
+
+typedef struct shm_header {
+    char magic[8];
+    uint32_t version;
+    _Atomic uint32_t state;
+    uint32_t lock_slots;
+    uint32_t edge_slots;
+    _Atomic uint32_t lock_count;
+    _Atomic uint32_t edge_count;
+} shm_header_t;
+
+typedef struct shm_segment {
+    shm_header_t header;
+    shm_lock_t locks[SHM_LOCK_SLOTS];
+    _Atomic uint64_t edge_keys[SHM_EDGE_SLOTS];
+    shm_edge_t edges[SHM_EDGE_RECORDS];
+} shm_segment_t;
+
+// Where a shared lock lives: the object behind its mapping and the offset
+// there.
+typedef struct shm_key {
+    uint64_t device;
+    uint64_t inode;
+    uint64_t offset;
+} shm_key_t;
+
+static shm_segment_t* segment;
+
+// Key of the lock the thread is about to create, looked up before it took the
+// graph lock.
+static __thread const void* prepared_addr;
+static __thread bool prepared_shared;
+static __thread shm_key_t prepared_key;
+
+// Lock slot + 1 of each local node, by node id; 0 for private locks.
+static uint32_t* node_slots;
+static uint32_t node_slot_capacity;
+
+// Scratch space of the search, one entry per lock slot.
+static uint64_t* search_visited;
+static uint32_t* search_stack;
+
+// Whether running out of each table was reported, which is done once.
+static bool lock_slots_full;
+static bool edge_records_full;
+
+// ==================== ATTACHING ====================
+
+static bool wait_until_ready(void)
+{
+    for (unsigned spins = 0; atomic_load(&segment->header.state) != SHM_READY; spins++) {
+        if (spins == 100000) return false;
+        sched_yield();
+    }
+    return memcmp(segment->header.magic, SHM_MAGIC, sizeof(segment->header.magic)) == 0 &&
+           segment->header.version == SHM_VERSION && segment->header.lock_slots == SHM_LOCK_SLOTS &&
+           segment->header.edge_slots == SHM_EDGE_SLOTS;
+}
+
+bool lockdep_shm_attach(const char* name)
+{
+    if (segment) return true;
+
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        fprintf(stderr, "[LOCKDEP] Failed to open shared lock graph %s\n", name);
+        return false;
+    }
+
+    // Every process sizes the segment the same way, which only zero-fills
+    // it the first time.
+    struct stat st;
+    bool sized = fstat(fd, &st) == 0 &&
+                 ((size_t)st.st_size >= sizeof(shm_segment_t) || ftruncate(fd, sizeof(shm_segment_t)) == 0);
+    if (!sized) {
+        fprintf(stderr, "[LOCKDEP] Failed to size shared lock graph %s\n", name);
+        close(fd);
+        return false;
+    }
+
+    void* map = mmap(NULL, sizeof(shm_segment_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "[LOCKDEP] Failed to map shared lock graph %s\n", name);
+        return false;
+    }
+    segment = map;
+
+    uint32_t state = SHM_UNINITIALIZED;
+    if (atomic_compare_exchange_strong(&segment->header.state, &state, SHM_INITIALIZING)) {
+        memcpy(segment->header.magic, SHM_MAGIC, sizeof(segment->header.magic));
+        segment->header.version = SHM_VERSION;
+        segment->header.lock_slots = SHM_LOCK_SLOTS;
+        segment->header.edge_slots = SHM_EDGE_SLOTS;
+        atomic_store(&segment->header.state, SHM_READY);
+    }
+
+    if (!wait_until_ready()) {
+        fprintf(stderr, "[LOCKDEP] Ignoring shared lock graph %s: unknown format or version\n", name);
+        munmap(map, sizeof(shm_segment_t));
+        segment = NULL;
+        return false;
+    }
+
+    search_visited = lockdep_alloc(SHM_LOCK_SLOTS / 64 * sizeof(uint64_t));
+    search_stack = lockdep_alloc(SHM_LOCK_SLOTS * sizeof(uint32_t));
+
+    fprintf(stderr, "[LOCKDEP] Attached to shared lock graph %s (%u locks, %u orderings)\n", name,
+            atomic_load(&segment->header.lock_count), atomic_load(&segment->header.edge_count));
+    return true;
+}
+
+// ==================== SHARED LOCK KEYS ====================
+
+/// Looks up the mapping that `addr` lies in, in /proc/self/maps, and returns
+/// whether it is a shared mapping of an object. Mappings come and go, so the
+/// file is read again for every lock, and never with the graph lock held but
+/// for the locks that are not created by an acquisition.
+static bool read_key(uintptr_t addr, shm_key_t* key)
+{
+    FILE* maps = fopen("/proc/self/maps", "re");
+    if (!maps) return false;
+
+    bool shared = false;
+    char line[512];
+    while (fgets(line, sizeof(line), maps)) {
+        uintptr_t start, end;
+        uint64_t offset, inode;
+        unsigned major, minor;
+        char perms[5];
+        if (sscanf(line, "%" SCNxPTR "-%" SCNxPTR " %4s %" SCNx64 " %x:%x %" SCNu64, &start, &end, perms, &offset,
+                   &major, &minor, &inode) != 7) {
+            continue;
+        }
+        // Mappings are listed by address.
+        if (addr < start) break;
+        if (addr >= end) continue;
+
+        shared = perms[3] == 's' && inode != 0;
+        *key = (shm_key_t){(uint64_t)major << 32 | minor, inode, offset + (addr - start)};
+        break;
+    }
+    fclose(maps);
+    return shared;
+}
+
+void lockdep_shm_prepare(const void* lock_addr)
+{
+    if (!segment || lockdep_graph_lookup(lock_addr)) return;
+    prepared_addr = lock_addr;
+    prepared_shared = read_key((uintptr_t)lock_addr, &prepared_key);
+}
+
+static uint64_t hash_key(uint64_t device, uint64_t inode, uint64_t offset)
+{
+    uint64_t hash = (device * 0x9E3779B97F4A7C15ull) ^ (inode * 0xC2B2AE3D27D4EB4Full) ^ offset;
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdull;
+    hash ^= hash >> 33;
+    return hash;
+}
+
+/// Returns the slot of the lock keyed by `key`, claiming one
+/// if no process recorded it yet, or UINT32_MAX if the table is full.
+static uint32_t lock_slot(const shm_key_t* key, sync_type_t type)
+{
+    uint32_t mask = SHM_LOCK_SLOTS - 1;
+    uint32_t slot = (uint32_t)hash_key(key->device, key->inode, key->offset) & mask;
+
+    for (uint32_t probes = 0; probes < SHM_LOCK_SLOTS; probes++, slot = (slot + 1) & mask) {
+        shm_lock_t* lock = &segment->locks[slot];
+        uint32_t state = atomic_load_explicit(&lock->state, memory_order_acquire);
+
+        if (state == SLOT_EMPTY) {
+            if (atomic_compare_exchange_strong(&lock->state, &state, SLOT_CLAIMED)) {
+                lock->type = type;
+                lock->device = key->device;
+                lock->inode = key->inode;
+                lock->offset = key->offset;
+                atomic_store_explicit(&lock->state, SLOT_READY, memory_order_release);
+                atomic_fetch_add_explicit(&segment->header.lock_count, 1, memory_order_relaxed);
+                return slot;
+            }
+        }
+
+        // Another process is writing the key of this slot.
+        while (state == SLOT_CLAIMED) {
+            sched_yield();
+            state = atomic_load_explicit(&lock->state, memory_order_acquire);
+        }
+        if (lock->device == key->device && lock->inode == key->inode && lock->offset == key->offset) return slot;
+    }
+    return UINT32_MAX;
+}
+
+static void report_full(bool* reported, const char* what)
+{
+    if (*reported) return;
+    *reported = true;
+    fprintf(stderr, "[LOCKDEP] Shared lock graph is out of %s, new shared orderings are no longer recorded\n", what);
+}
+
+void lockdep_shm_bind(lock_node_t* lock)
+{
+    if (!segment) return;
+
+    if (lock->id >= node_slot_capacity) {
+        uint32_t capacity = node_slot_capacity ? 2 * node_slot_capacity : 256;
+        while (capacity <= lock->id) capacity *= 2;
+        uint32_t* grown = realloc(node_slots, capacity * sizeof(uint32_t));
+        if (!grown) return;
+        memset(grown + node_slot_capacity, 0, (capacity - node_slot_capacity) * sizeof(uint32_t));
+        node_slots = grown;
+        node_slot_capacity = capacity;
+    }
+
+    shm_key_t key;
+    bool shared;
+    if (prepared_addr == lock->lock_addr) {
+        key = prepared_key;
+        shared = prepared_shared;
+        prepared_addr = NULL;
+    } else {
+        shared = read_key((uintptr_t)lock->lock_addr, &key);
+    }
+    if (!shared) return;
+
+    uint32_t slot = lock_slot(&key, lock->type);
+    if (slot == UINT32_MAX) {
+        report_full(&lock_slots_full, "lock slots");
+        return;
+    }
+    node_slots[lock->id] = slot + 1;
+}
+
+static bool shared_slot(const lock_node_t* lock, uint32_t* slot)
+{
+    if (!segment || lock->id >= node_slot_capacity || !node_slots[lock->id]) return false;
+    *slot = node_slots[lock->id] - 1;
+    return true;
+}
+
+// ==================== SHARED ORDERINGS ====================
+
+void lockdep_shm_edge_checked(const lock_node_t* parent, const lock_node_t* child)
+{
+    uint32_t from, to;
+    if (!shared_slot(parent, &from) || !shared_slot(child, &to) || from == to) return;
+
+    // The set never holds more keys than there are records, half its slots, so
+    // every probe ends on the key or on an empty slot.
+    uint64_t key = (uint64_t)(from + 1) << 32 | (to + 1);
+    uint32_t mask = SHM_EDGE_SLOTS - 1;
+    uint32_t slot = (uint32_t)hash_key(from, to, 0) & mask;
+    for (uint64_t known; (known = atomic_load(&segment->edge_keys[slot])); slot = (slot + 1) & mask) {
+        if (known == key) return; // Already known, from this process or another.
+    }
+
+    // The record is claimed before the key, so that no key is published
+    // without one once the records run out.
+    uint32_t index = atomic_load(&segment->header.edge_count);
+    do {
+        if (index >= SHM_EDGE_RECORDS) {
+            report_full(&edge_records_full, "ordering records");
+            return;
+        }
+    } while (!atomic_compare_exchange_weak(&segment->header.edge_count, &index, index + 1));
+
+    for (;; slot = (slot + 1) & mask) {
+        uint64_t expected = 0;
+        if (atomic_compare_exchange_strong(&segment->edge_keys[slot], &expected, key)) break;
+        if (expected == key) return; // Another process published it first; the record stays unused.
+    }
+
+    shm_edge_t* edge = &segment->edges[index];
+    edge->child = to;
+    _Atomic uint32_t* head = &segment->locks[from].first_edge;
+    uint32_t next = atomic_load_explicit(head, memory_order_relaxed);
+    do {
+        edge->next = next;
+    } while (!atomic_compare_exchange_weak_explicit(head, &next, index + 1, memory_order_release,
+                                                    memory_order_relaxed));
+}
+
+/// Looks for a path between two shared locks through the orderings recorded by
+/// every attached process, including those of this one.
+bool lockdep_shm_would_create_cycle(lock_node_t* from, lock_node_t* to)
+{
+    uint32_t source, target;
+    if (!shared_slot(to, &source) || !shared_slot(from, &target) || source == target) return false;
+
+    memset(search_visited, 0, SHM_LOCK_SLOTS / 64 * sizeof(uint64_t));
+    uint32_t depth = 0;
+    search_stack[depth++] = source;
+    search_visited[source / 64] |= 1ull << (source % 64);
+
+    while (depth) {
+        uint32_t slot = search_stack[--depth];
+        uint32_t link = atomic_load_explicit(&segment->locks[slot].first_edge, memory_order_acquire);
+        for (; link; link = segment->edges[link - 1].next) {
+            uint32_t child = segment->edges[link - 1].child;
+            if (child == target) {
+                const shm_lock_t* first = &segment->locks[source];
+                const shm_lock_t* second = &segment->locks[target];
+                printf("[LOCKDEP] The shared lock graph orders %s at inode %" PRIu64 "+0x%" PRIx64
+                       " before %s at inode %" PRIu64 "+0x%" PRIx64 "\n",
+                       lockdep_sync_type_to_string(first->type), first->inode, first->offset,
+                       lockdep_sync_type_to_string(second->type), second->inode, second->offset);
+                return true;
+            }
+            if (search_visited[child / 64] >> (child % 64) & 1) continue;
+            search_visited[child / 64] |= 1ull << (child % 64);
+            search_stack[depth++] = child;
+        }
+    }
+    return false;
+}
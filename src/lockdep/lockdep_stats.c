@@ -0,0 +1,205 @@
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "lockdep_internal.h"
+
+// Self-profiling. Every thread counts its events in a block that only it writes,
+// and blocks are never freed: a thread that exits leaves its block, counts
+// included, to the next thread that starts. The block is handed over by a
+// thread-specific key destructor of its own, so threads without a lockdep
+// context give it back too, and an event counted by another destructor after
+// it ran attaches the block again, which makes it run once more. A report sums
+// all the blocks with relaxed loads, so it may miss the last few events of
+// running threads but never stops them.
+//
+// While profiling is on, the time spent in lockdep_acquire_lock(),
+// lockdep_release_lock() and lockdep_wait_condvar() is read from the TSC and
+// recorded in a histogram with one bucket per power of two. The TSC rate is
+// calibrated against CLOCK_MONOTONIC over the profiled interval to also give
+// the mean in nanoseconds.
+
+#if defined(__x86_64__) || defined(__i386__)
+#define TICK_UNIT "cycles"
+#else
+#define TICK_UNIT "ns"
+#endif
+
+__thread lockdep_thread_stats_t* lockdep_thread_stats;
+bool lockdep_profiling;
+
+static lockdep_thread_stats_t* _Atomic all_stats;
+static pthread_key_t stats_key;
+static pthread_once_t stats_key_once = PTHREAD_ONCE_INIT;
+static uint64_t calibration_ticks;
+static uint64_t calibration_ns;
+
+static const char* const timer_names[LOCKDEP_TIMER_COUNT] = {
+    [LOCKDEP_TIMER_ACQUIRE] = "lockdep_acquire_lock",
+    [LOCKDEP_TIMER_RELEASE] = "lockdep_release_lock",
+    [LOCKDEP_TIMER_CONDVAR] = "lockdep_wait_condvar",
+};
+
+static uint64_t monotonic_ns(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ull + (uint64_t)now.tv_nsec;
+}
+
+void lockdep_stats_configure(bool profiling)
+{
+    calibration_ticks = lockdep_ticks();
+    calibration_ns = monotonic_ns();
+    lockdep_profiling = profiling;
+}
+
+/// Hands the block of the exiting thread over to later threads, counts kept.
+static void stats_destructor(void* data __attribute__((unused)))
+{
+    if (!lockdep_thread_stats) return;
+    atomic_store(&lockdep_thread_stats->in_use, false);
+    lockdep_thread_stats = NULL;
+}
+
+static void create_stats_key(void)
+{
+    pthread_key_create(&stats_key, stats_destructor);
+}
+
+/// Finds a block left by an exited thread, or allocates one.
+static lockdep_thread_stats_t* claim_stats(void)
+{
+    for (lockdep_thread_stats_t* stats = atomic_load(&all_stats); stats; stats = stats->next) {
+        bool in_use = false;
+        if (atomic_compare_exchange_strong(&stats->in_use, &in_use, true)) return stats;
+    }
+
+    lockdep_thread_stats_t* stats = lockdep_alloc(sizeof(lockdep_thread_stats_t));
+    memset(stats, 0, sizeof(*stats));
+    atomic_init(&stats->in_use, true);
+    stats->next = atomic_load_explicit(&all_stats, memory_order_relaxed);
+    while (!atomic_compare_exchange_weak_explicit(&all_stats, &stats->next, stats, memory_order_release,
+                                                  memory_order_relaxed)) {
+    }
+    return stats;
+}
+
+lockdep_thread_stats_t* lockdep_stats_attach(void)
+{
+    lockdep_thread_stats_t* stats = claim_stats();
+    pthread_once(&stats_key_once, create_stats_key);
+    pthread_setspecific(stats_key, stats);
+    return lockdep_thread_stats = stats;
+}
+
+
+
+void lockdep_stats_record_time(lockdep_timer_t timer, uint64_t ticks)
+{
+    lockdep_thread_stats_t* stats = lockdep_thread_stats;
+    if (!stats) stats = lockdep_stats_attach();
+
+    unsigned bucket = ticks ? 63 - __builtin_clzll(ticks) : 0;
+    lockdep_counter_add(&stats->ticks[timer], ticks);
+    lockdep_counter_add(&stats->histograms[timer][bucket], 1);
+}
+
+/// Returns the upper bound of the bucket holding the `fraction` quantile.
+static uint64_t histogram_quantile(const uint64_t* histogram, uint64_t calls, double fraction)
+{
+    uint64_t seen = 0;
+    for (unsigned bucket = 0; bucket < LOCKDEP_HISTOGRAM_BUCKETS; bucket++) {
+        seen += histogram[bucket];
+        if ((double)seen >= fraction * (double)calls) return bucket < 63 ? UINT64_C(2) << bucket : UINT64_MAX;
+    }
+    return UINT64_MAX;
+}
+
+static void report_timer(lockdep_timer_t timer, uint64_t ticks, const uint64_t* histogram, double ticks_per_ns)
+{
+    uint64_t calls = 0;
+    for (unsigned bucket = 0; bucket < LOCKDEP_HISTOGRAM_BUCKETS; bucket++) calls += histogram[bucket];
+    if (!calls) return;
+
+    double mean = (double)ticks / (double)calls;
+    fprintf(stderr,
+            "[LOCKDEP] Time in %s: %" PRIu64 " calls, mean %.0f " TICK_UNIT " (%.0f ns), median < %" PRIu64
+            ", p99 < %" PRIu64 " " TICK_UNIT "\n",
+            timer_names[timer], calls, mean, mean / ticks_per_ns, histogram_quantile(histogram, calls, 0.5),
+            histogram_quantile(histogram, calls, 0.99));
+
+    for (unsigned bucket = 0; bucket < LOCKDEP_HISTOGRAM_BUCKETS; bucket++) {
+        if (!histogram[bucket]) continue;
+        fprintf(stderr, "[LOCKDEP]   [%" PRIu64 ", %" PRIu64 ") " TICK_UNIT ": %" PRIu64 " (%.1f%%)\n",
+                bucket ? UINT64_C(1) << bucket : 0, bucket < 63 ? UINT64_C(2) << bucket : UINT64_MAX, histogram[bucket],
+                100.0 * (double)histogram[bucket] / (double)calls);
+    }
+}
+
+void lockdep_stats_report(uint32_t nodes, uint32_t edges, size_t bytes)
+{
+    uint64_t events[LOCKDEP_EVENT_COUNT] = {0};
+    uint64_t ticks[LOCKDEP_TIMER_COUNT] = {0};
+    uint64_t histograms[LOCKDEP_TIMER_COUNT][LOCKDEP_HISTOGRAM_BUCKETS] = {{0}};
+
+    for (lockdep_thread_stats_t* stats = atomic_load(&all_stats); stats; stats = stats->next) {
+        for (unsigned i = 0; i < LOCKDEP_EVENT_COUNT; i++) {
+            events[i] += atomic_load_explicit(&stats->events[i], memory_order_relaxed);
+        }
+        for (unsigned t = 0; t < LOCKDEP_TIMER_COUNT; t++) {
+            ticks[t] += atomic_load_explicit(&stats->ticks[t], memory_order_relaxed);
+            for (unsigned b = 0; b < LOCKDEP_HISTOGRAM_BUCKETS; b++) {
+                histograms[t][b] += atomic_load_explicit(&stats->histograms[t][b], memory_order_relaxed);
+            }
+        }
+    }
+
+    fprintf(stderr, "[LOCKDEP] Graph: %u locks, %u orderings, %zu bytes\n", nodes, edges, bytes);
+    fprintf(stderr,
+            "[LOCKDEP] Events: %" PRIu64 " acquisitions (%" PRIu64 " validated, %" PRIu64
+            " from the thread caches), %" PRIu64 " releases, %" PRIu64 " new locks, %" PRIu64 " new orderings\n",
+            events[LOCKDEP_EVENT_ACQUIRE], events[LOCKDEP_EVENT_VALIDATE], events[LOCKDEP_EVENT_CACHE_HIT],
+            events[LOCKDEP_EVENT_RELEASE], events[LOCKDEP_EVENT_NEW_NODE], events[LOCKDEP_EVENT_NEW_EDGE]);
+
+    uint64_t checks = events[LOCKDEP_EVENT_CYCLE_CHECK], dense_checks = events[LOCKDEP_EVENT_DENSE_CHECK];
+    uint64_t quick_rejects = events[LOCKDEP_EVENT_QUICK_REJECT];
+    if (checks) {
+        fprintf(stderr, "[LOCKDEP] Cycle checks: %" PRIu64 ", %" PRIu64 " answered by the closure matrix\n", checks,
+                dense_checks);
+    }
+    if (checks > dense_checks) {
+        uint64_t sparse_checks = checks - dense_checks;
+        fprintf(stderr,
+                "[LOCKDEP] Sparse cycle checks: %" PRIu64 ", %" PRIu64 " (%.1f%%) rejected by reachability summaries\n",
+                sparse_checks, quick_rejects, 100.0 * (double)quick_rejects / (double)sparse_checks);
+    }
+
+    if (events[LOCKDEP_EVENT_DEFERRED] || events[LOCKDEP_EVENT_DROPPED]) {
+        fprintf(stderr,
+                "[LOCKDEP] Deferred: %" PRIu64 " operations queued, %" PRIu64 " dropped, %" PRIu64
+                " held stacks resynchronized\n",
+                events[LOCKDEP_EVENT_DEFERRED], events[LOCKDEP_EVENT_DROPPED], events[LOCKDEP_EVENT_RESYNC]);
+    }
+
+    if (events[LOCKDEP_EVENT_FROZEN]) {
+        fprintf(stderr, "[LOCKDEP] Frozen: %" PRIu64 " acquisitions validated by the topological order\n",
+                events[LOCKDEP_EVENT_FROZEN]);
+    }
+
+    if (events[LOCKDEP_EVENT_SHARED]) {
+        fprintf(stderr, "[LOCKDEP] Shared: %" PRIu64 " read acquisitions needed no cycle search\n",
+                events[LOCKDEP_EVENT_SHARED]);
+    }
+
+    if (!lockdep_profiling) return;
+
+    double ticks_per_ns = 1.0;
+    uint64_t elapsed_ns = monotonic_ns() - calibration_ns;
+    if (elapsed_ns > 1000000) ticks_per_ns = (double)(lockdep_ticks() - calibration_ticks) / (double)elapsed_ns;
+
+    for (unsigned t = 0; t < LOCKDEP_TIMER_COUNT; t++) {
+        report_timer(t, ticks[t], histograms[t], ticks_per_ns);
+    }
+}
@@ -0,0 +1,302 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "lockdep_internal.h"
+
+// Wait-for graph. Every thread publishes, without taking any lock, the lock it
+// is blocked on; owners are kept by the ownership table (lockdep_owner.c). A
+// watchdog thread periodically builds the graph "thread -> lock it waits for
+// -> threads holding that lock" and reports its cycles: threads that are
+// deadlocked right now, as opposed to the lock-order graph, which reports
+// orderings that could deadlock.
+
+#define WATCHDOG_MAX_CYCLE 64
+#define WATCHDOG_MAX_OWNERS 16
+
+typedef struct waiter {
+    _Atomic bool in_use;             // Cleared when the thread exits, so the record can be reused.
+    pthread_t thread_id;
+    pid_t tid;
+    _Atomic unsigned epoch;          // Tracking epoch the record belongs to.
+    _Atomic(const void*) blocked_on; // Lock the thread is waiting for, if any.
+    _Atomic unsigned wait_seq;       // Bumped every time the thread starts waiting.
+    struct waiter* next;
+
+    // Only touched by the watchdog thread.
+    const void* seen_blocked_on; // `blocked_on` at the previous scan.
+    unsigned seen_seq;           // `wait_seq` at the previous scan.
+    unsigned reported_seq;       // `wait_seq` when the thread was last reported.
+    bool stuck;                  // Blocked on the same wait for a whole interval.
+    int mark;                    // DFS state: 0 unvisited, 1 on the path, 2 done.
+    unsigned owner_count;        // Entries of `owners` in use.
+    lockdep_owner_t owners[WATCHDOG_MAX_OWNERS]; // Holders of `seen_blocked_on` at this scan.
+} waiter_t;
+
+static _Atomic(waiter_t*) waiters;
+static __thread waiter_t* self;
+static pthread_key_t waiter_key;
+
+static _Atomic bool watchdog_running;
+static unsigned watchdog_interval_ms;
+
+static void waiter_destructor(void* data)
+{
+    waiter_t* w = data;
+    atomic_store_explicit(&w->blocked_on, NULL, memory_order_relaxed);
+    atomic_store_explicit(&w->in_use, false, memory_order_release);
+    self = NULL;
+}
+
+/// Claims the record of an exited thread, or registers a new one.
+static waiter_t* claim_waiter(void)
+{
+    for (waiter_t* w = atomic_load_explicit(&waiters, memory_order_acquire); w; w = w->next) {
+        bool free = false;
+        if (atomic_compare_exchange_strong_explicit(&w->in_use, &free, true, memory_order_acquire,
+                                                    memory_order_relaxed)) {
+            return w;
+        }
+    }
+
+    waiter_t* w = arena_alloc(sizeof(waiter_t));
+    if (!w) return NULL;
+    memset(w, 0, sizeof(*w));
+    atomic_store_explicit(&w->in_use, true, memory_order_relaxed);
+
+    w->next = atomic_load_explicit(&waiters, memory_order_relaxed);
+    while (!atomic_compare_exchange_weak_explicit(&waiters, &w->next, w, memory_order_release, memory_order_relaxed)) {
+    }
+    return w;
+}
+
+/// Returns the calling thread's record, registering it on first use.
+static waiter_t* current_waiter(void)
+{
+    unsigned epoch = lockdep_held_epoch();
+    waiter_t* w = self;
+
+    if (!w) {
+        w = claim_waiter();
+        if (!w) return NULL;
+        w->thread_id = pthread_self();
+        w->tid = gettid();
+        atomic_store_explicit(&w->epoch, epoch, memory_order_relaxed);
+        pthread_setspecific(waiter_key, w);
+        self = w;
+    } else if (atomic_load_explicit(&w->epoch, memory_order_relaxed) != epoch) {
+        atomic_store_explicit(&w->epoch, epoch, memory_order_release);
+    }
+    return w;
+}
+
+// ==================== PUBLICATION ====================
+
+void lockdep_publish_wait(const volatile void* lock_addr)
+{
+    if (!atomic_load_explicit(&watchdog_running, memory_order_relaxed)) return;
+
+    waiter_t* w = current_waiter();
+    if (!w) return;
+
+    atomic_fetch_add_explicit(&w->wait_seq, 1, memory_order_relaxed);
+    atomic_store_explicit(&w->blocked_on, (const void*)lock_addr, memory_order_release);
+}
+
+void lockdep_publish_acquired(const volatile void* lock_addr, bool acquired, const void* ip)
+{
+    if (acquired) lockdep_owner_acquired((const void*)lock_addr, ip);
+
+    if (!atomic_load_explicit(&watchdog_running, memory_order_relaxed)) return;
+
+    waiter_t* w = self;
+    if (w) atomic_store_explicit(&w->blocked_on, NULL, memory_order_release);
+}
+
+void lockdep_publish_release(const volatile void* lock_addr)
+{
+    lockdep_owner_released((const void*)lock_addr);
+}
+
+// ==================== WATCHDOG ====================
+
+static waiter_t* find_waiter(pid_t tid)
+{
+    for (waiter_t* w = atomic_load(&waiters); w; w = w->next) {
+        if (w->tid == tid && atomic_load_explicit(&w->in_use, memory_order_relaxed)) return w;
+    }
+    return NULL;
+}
+
+static const lockdep_owner_t* waiter_owner(const waiter_t* w, pid_t tid)
+{
+    for (unsigned i = 0; i < w->owner_count; i++) {
+        if (w->owners[i].tid == tid) return &w->owners[i];
+    }
+    return NULL;
+}
+
+static void report_cycle(waiter_t** cycle, unsigned length)
+{
+    // A deadlock stays in place, so report it once rather than at every scan.
+    bool reported = true;
+    for (unsigned i = 0; i < length; i++) {
+        if (cycle[i]->reported_seq != cycle[i]->seen_seq) reported = false;
+    }
+    if (reported) return;
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    uint64_t now_ns = (uint64_t)now.tv_sec * 1000000000ull + (uint64_t)now.tv_nsec;
+
+    fprintf(stderr, "[LOCKDEP] Watchdog: deadlock between %u thread%s\n", length, length == 1 ? "" : "s");
+    for (unsigned i = 0; i < length; i++) {
+        waiter_t* waiter = cycle[i];
+        waiter_t* owner = cycle[(i + 1) % length];
+        const lockdep_owner_t* held = waiter_owner(waiter, owner->tid);
+        fprintf(stderr,
+                "[LOCKDEP]   thread %lu (tid %d) waits for lock %p held by thread %lu (tid %d), acquired at %p %llu ms "
+                "ago\n",
+                waiter->thread_id, waiter->tid, waiter->seen_blocked_on, owner->thread_id, owner->tid, held->callsite,
+                (unsigned long long)((now_ns - held->acquired_ns) / 1000000));
+        waiter->reported_seq = waiter->seen_seq;
+    }
+}
+
+/// Depth-first search over stuck threads. A lock held by several readers makes
+/// its waiter wait for each of them. `path` holds the threads on the current
+/// path; reaching one of them again closes a cycle.
+static void find_cycles(waiter_t* w, waiter_t** path, unsigned depth)
+{
+    if (depth == WATCHDOG_MAX_CYCLE) return;
+
+    w->mark = 1;
+    path[depth] = w;
+
+    for (unsigned i = 0; i < w->owner_count; i++) {
+        waiter_t* owner = find_waiter(w->owners[i].tid);
+        if (!owner || !owner->stuck || owner->mark == 2) continue;
+
+        if (owner->mark == 1) {
+            unsigned start = depth;
+            while (path[start] != owner) start--;
+            report_cycle(&path[start], depth - start + 1);
+        } else {
+            find_cycles(owner, path, depth + 1);
+        }
+    }
+
+    w->mark = 2;
+}
+
+/// A thread takes part in the graph only if it has been waiting on the same
+/// acquisition for a whole interval, which filters out the short waits that
+/// every contended lock goes through and the records being updated mid-scan.
+static void watchdog_scan(void)
+{
+    unsigned epoch = lockdep_held_epoch();
+
+    for (waiter_t* w = atomic_load(&waiters); w; w = w->next) {
+        const void* blocked_on = atomic_load_explicit(&w->blocked_on, memory_order_acquire);
+        unsigned seq = atomic_load_explicit(&w->wait_seq, memory_order_relaxed);
+
+        w->stuck = blocked_on && blocked_on == w->seen_blocked_on && seq == w->seen_seq &&
+                   atomic_load_explicit(&w->epoch, memory_order_acquire) == epoch &&
+                   atomic_load_explicit(&w->in_use, memory_order_relaxed);
+        w->seen_blocked_on = blocked_on;
+        w->seen_seq = seq;
+        w->mark = 0;
+        w->owner_count = w->stuck ? lockdep_lock_owners(blocked_on, w->owners, WATCHDOG_MAX_OWNERS) : 0;
+    }
+
+    waiter_t* path[WATCHDOG_MAX_CYCLE];
+    for (waiter_t* w = atomic_load(&waiters); w; w = w->next) {
+        if (w->stuck && w->mark == 0) find_cycles(w, path, 0);
+    }
+}
+
+static void* watchdog_thread(void* arg __attribute__((unused)))
+{
+    // Locks taken by this thread belong to lockdep, not to the program.
+    lockdep_recursion++;
+
+    struct timespec interval = {
+        .tv_sec = watchdog_interval_ms / 1000,
+        .tv_nsec = (long)(watchdog_interval_ms % 1000) * 1000000,
+    };
+
+    while (atomic_load(&watchdog_running)) {
+        struct timespec remaining = interval;
+        while (nanosleep(&remaining, &remaining) < 0 && errno == EINTR) {
+        }
+        watchdog_scan();
+    }
+    return NULL;
+}
+
+static bool spawn_watchdog_thread(void)
+{
+    atomic_store(&watchdog_running, true);
+
+    lockdep_recursion++;
+    pthread_t thread;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    int err = pthread_create(&thread, &attr, watchdog_thread, NULL);
+    pthread_attr_destroy(&attr);
+    lockdep_recursion--;
+
+    if (err) {
+        atomic_store(&watchdog_running, false);
+        fprintf(stderr, "[LOCKDEP] Failed to start watchdog thread: %s\n", strerror(err));
+        return false;
+    }
+    return true;
+}
+
+bool lockdep_watchdog_start(unsigned interval_ms)
+{
+    if (atomic_load(&watchdog_running)) return true;
+
+    watchdog_interval_ms = interval_ms ? interval_ms : 1;
+    if (pthread_key_create(&waiter_key, waiter_destructor) != 0) {
+        fprintf(stderr, "[LOCKDEP] Failed to start watchdog: no thread-specific key available\n");
+        return false;
+    }
+    // Stuck threads are matched with the holders of the locks they wait for.
+    lockdep_owner_enable();
+    if (!spawn_watchdog_thread()) return false;
+
+    // Lock operations are published for it even while tracking is off.
+    atomic_store(&lockdep_enabled, true);
+    fprintf(stderr, "[LOCKDEP] Watchdog scanning the wait-for graph every %u ms\n", watchdog_interval_ms);
+    return true;
+}
+
+bool lockdep_watchdog_running(void)
+{
+    return atomic_load_explicit(&watchdog_running, memory_order_relaxed);
+}
+
+void lockdep_watchdog_stop(void)
+{
+    atomic_store(&watchdog_running, false);
+}
+
+void lockdep_watchdog_atfork_child(void)
+{
+    // Only the forking thread made it into the child, and its record (if any)
+    // is all the list needs. The others are dropped without being visited.
+    atomic_store_explicit(&waiters, self, memory_order_relaxed);
+    if (self) {
+        self->next = NULL;
+        self->tid = gettid();
+    }
+
+    if (atomic_load(&watchdog_running)) spawn_watchdog_thread();
+}
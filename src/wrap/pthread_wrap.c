@@ -0,0 +1,147 @@
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <semaphore.h>
+
+// Linked with -Wl,--wrap=<function>, calls to the pthread functions land here
+// and the originals are reachable as `__real_<function>`.
+#define LOCKDEP_WRAP
+#include "../include/lockdep_inline.h"
+
+__attribute__((constructor)) static void lockdep_constructor(void)
+{
+    lockdep_recursion++;
+    lockdep_init();
+    lockdep_recursion--;
+}
+
+__attribute__((destructor)) static void lockdep_destructor(void)
+{
+    lockdep_recursion++;
+    lockdep_fini();
+    lockdep_recursion--;
+}
+
+// ==================== MUTEX FUNCTIONS ====================
+
+int __wrap_pthread_mutex_lock(pthread_mutex_t* mutex)
+{
+    return lockdep_mutex_lock_at(mutex, __builtin_return_address(0));
+}
+
+int __wrap_pthread_mutex_unlock(pthread_mutex_t* mutex)
+{
+    return lockdep_mutex_unlock_at(mutex);
+}
+
+int __wrap_pthread_mutex_trylock(pthread_mutex_t* mutex)
+{
+    return lockdep_mutex_trylock_at(mutex, __builtin_return_address(0));
+}
+
+int __wrap_pthread_mutex_timedlock(pthread_mutex_t* mutex, const struct timespec* abstime)
+{
+    return lockdep_mutex_timedlock_at(mutex, abstime, __builtin_return_address(0));
+}
+
+int __wrap_pthread_mutex_clocklock(pthread_mutex_t* mutex, clockid_t clock, const struct timespec* abstime)
+{
+    return lockdep_mutex_clocklock_at(mutex, clock, abstime, __builtin_return_address(0));
+}
+
+// ==================== RWLOCK FUNCTIONS ====================
+
+int __wrap_pthread_rwlock_rdlock(pthread_rwlock_t* rwlock)
+{
+    return lockdep_rwlock_rdlock_at(rwlock, __builtin_return_address(0));
+}
+
+int __wrap_pthread_rwlock_wrlock(pthread_rwlock_t* rwlock)
+{
+    return lockdep_rwlock_wrlock_at(rwlock, __builtin_return_address(0));
+}
+
+int __wrap_pthread_rwlock_unlock(pthread_rwlock_t* rwlock)
+{
+    return lockdep_rwlock_unlock_at(rwlock);
+}
+
+int __wrap_pthread_rwlock_tryrdlock(pthread_rwlock_t* rwlock)
+{
+    return lockdep_rwlock_tryrdlock_at(rwlock, __builtin_return_address(0));
+}
+
+int __wrap_pthread_rwlock_trywrlock(pthread_rwlock_t* rwlock)
+{
+    return lockdep_rwlock_trywrlock_at(rwlock, __builtin_return_address(0));
+}
+
+int __wrap_pthread_rwlock_timedrdlock(pthread_rwlock_t* rwlock, const struct timespec* abstime)
+{
+    return lockdep_rwlock_timedrdlock_at(rwlock, abstime, __builtin_return_address(0));
+}
+
+int __wrap_pthread_rwlock_timedwrlock(pthread_rwlock_t* rwlock, const struct timespec* abstime)
+{
+    return lockdep_rwlock_timedwrlock_at(rwlock, abstime, __builtin_return_address(0));
+}
+
+// ==================== SEMAPHORE FUNCTIONS ====================
+
+int __wrap_sem_wait(sem_t* sem)
+{
+    return lockdep_sem_wait_at(sem, __builtin_return_address(0));
+}
+
+int __wrap_sem_trywait(sem_t* sem)
+{
+    return lockdep_sem_trywait_at(sem, __builtin_return_address(0));
+}
+
+int __wrap_sem_post(sem_t* sem)
+{
+    return lockdep_sem_post_at(sem);
+}
+
+int __wrap_sem_timedwait(sem_t* sem, const struct timespec* abstime)
+{
+    return lockdep_sem_timedwait_at(sem, abstime, __builtin_return_address(0));
+}
+
+// ==================== SPINLOCK FUNCTIONS ====================
+
+int __wrap_pthread_spin_lock(pthread_spinlock_t* lock)
+{
+    return lockdep_spin_lock_at(lock, __builtin_return_address(0));
+}
+
+int __wrap_pthread_spin_trylock(pthread_spinlock_t* lock)
+{
+    return lockdep_spin_trylock_at(lock, __builtin_return_address(0));
+}
+
+int __wrap_pthread_spin_unlock(pthread_spinlock_t* lock)
+{
+    return lockdep_spin_unlock_at(lock);
+}
+
+// ==================== CONDITION VARIABLE FUNCTIONS ====================
+
+int __wrap_pthread_cond_wait(pthread_cond_t* cond, pthread_mutex_t* mutex)
+{
+    return lockdep_cond_wait_at(cond, mutex, __builtin_return_address(0));
+}
+
+int __wrap_pthread_cond_timedwait(pthread_cond_t* cond, pthread_mutex_t* mutex, const struct timespec* abstime)
+{
+    return lockdep_cond_timedwait_at(cond, mutex, abstime, __builtin_return_address(0));
+}
+
+int __wrap_pthread_cond_signal(pthread_cond_t* cond)
+{
+    return lockdep_cond_signal_at(cond);
+}
+
+int __wrap_pthread_cond_broadcast(pthread_cond_t* cond)
+{
+    return lockdep_cond_broadcast_at(cond);
+}
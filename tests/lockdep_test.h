@@ -0,0 +1,73 @@
+#ifndef LOCKDEP_TEST_H
+#define LOCKDEP_TEST_H
+
+// Helpers shared by the tests. Include after defining _GNU_SOURCE.
+
+#include <dlfcn.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <lockdep.h>
+
+// The tests run with the interposer preloaded rather than linked against
+// lockdep, so its API is looked up at run time. NULL when it is not preloaded.
+#define LOCKDEP_API(function) ((typeof(&function))dlsym(RTLD_DEFAULT, #function))
+
+/// Takes `first`, then `second`, and releases both. Returns the result of the
+/// second acquisition.
+static inline int lock_in_order(pthread_mutex_t* first, pthread_mutex_t* second)
+{
+    pthread_mutex_lock(first);
+    int result = pthread_mutex_lock(second);
+    if (result == 0) pthread_mutex_unlock(second);
+    pthread_mutex_unlock(first);
+    return result;
+}
+
+/// Runs the test again from the start with the environment variable `name` set
+/// to `value`, for lockdep to read it at startup, unless it is set already.
+static inline void rerun_with(const char* name, const char* value, char** argv)
+{
+    if (getenv(name)) return;
+    setenv(name, value, 1);
+    execv("/proc/self/exe", argv);
+    perror("execv");
+    exit(1);
+}
+
+/// Counts the lines of `file`, from its start, that contain `pattern`.
+static inline unsigned count_lines(FILE* file, const char* pattern)
+{
+    unsigned count = 0;
+    char line[4096];
+    rewind(file);
+    while (fgets(line, sizeof(line), file)) {
+        if (strstr(line, pattern)) count++;
+    }
+    return count;
+}
+
+/// Sends what is written to `fd` to `capture` until capture_end(). Returns the
+/// descriptor to restore.
+static inline int capture_start(int fd, FILE* capture)
+{
+    fflush(stdout);
+    fflush(stderr);
+    int saved = dup(fd);
+    dup2(fileno(capture), fd);
+    return saved;
+}
+
+static inline void capture_end(int fd, int saved)
+{
+    fflush(stdout);
+    fflush(stderr);
+    dup2(saved, fd);
+    close(saved);
+}
+
+#endif
@@ -0,0 +1,78 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <unistd.h>
+
+/*
+ * AB-BA ordering between two spinlocks. Without lockdep both threads would
+ * spin forever; with it, the second acquisition that closes the cycle fails
+ * with EDEADLK and the thread backs off.
+ */
+
+pthread_spinlock_t spin1;
+pthread_spinlock_t spin2;
+
+void* thread1_func(void* arg __attribute__((unused)))
+{
+    printf("Thread 1: Acquiring spin1\n");
+    pthread_spin_lock(&spin1);
+    printf("Thread 1: Got spin1, sleeping...\n");
+
+    sleep(1);
+
+    printf("Thread 1: Trying to acquire spin2\n");
+    int result = pthread_spin_lock(&spin2);
+    if (result == 0) {
+        printf("Thread 1: Got spin2\n");
+        pthread_spin_unlock(&spin2);
+    } else {
+        printf("Thread 1: Error acquiring spin2: %d\n", result);
+    }
+
+    pthread_spin_unlock(&spin1);
+    return NULL;
+}
+
+void* thread2_func(void* arg __attribute__((unused)))
+{
+    usleep(500000);
+
+    printf("Thread 2: Acquiring spin2\n");
+    pthread_spin_lock(&spin2);
+    printf("Thread 2: Got spin2, sleeping...\n");
+
+    sleep(1);
+
+    printf("Thread 2: Trying to acquire spin1\n");
+    int result = pthread_spin_lock(&spin1);
+    if (result == 0) {
+        printf("Thread 2: Got spin1\n");
+        pthread_spin_unlock(&spin1);
+    } else {
+        printf("Thread 2: Error acquiring spin1: %d\n", result);
+    }
+
+    pthread_spin_unlock(&spin2);
+    return NULL;
+}
+
+int main()
+{
+    pthread_t t1, t2;
+
+    printf("Starting spinlock deadlock test (AB-BA pattern)\n");
+
+    pthread_spin_init(&spin1, PTHREAD_PROCESS_PRIVATE);
+    pthread_spin_init(&spin2, PTHREAD_PROCESS_PRIVATE);
+
+    pthread_create(&t1, NULL, thread1_func, NULL);
+    pthread_create(&t2, NULL, thread2_func, NULL);
+
+    pthread_join(t1, NULL);
+    pthread_join(t2, NULL);
+
+    pthread_spin_destroy(&spin1);
+    pthread_spin_destroy(&spin2);
+
+    printf("Test completed\n");
+    return 0;
+}
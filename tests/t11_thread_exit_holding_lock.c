@@ -0,0 +1,46 @@
+#include <pthread.h>
+#include <stdio.h>
+
+/*
+ * Many short-lived threads take and release a lock, then one thread exits
+ * without releasing it. Lockdep reuses the contexts of exited threads instead
+ * of growing its registry, and reports the lock left held at exit.
+ */
+
+#define SHORT_LIVED_THREADS 1000
+
+pthread_mutex_t mutex1 = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t mutex2 = PTHREAD_MUTEX_INITIALIZER;
+
+void* short_lived_func(void* arg __attribute__((unused)))
+{
+    pthread_mutex_lock(&mutex1);
+    pthread_mutex_unlock(&mutex1);
+    return NULL;
+}
+
+void* leaking_func(void* arg __attribute__((unused)))
+{
+    printf("Leaking thread: Acquiring mutex2 and exiting without releasing it\n");
+    pthread_mutex_lock(&mutex2);
+    return NULL;
+}
+
+int main()
+{
+    pthread_t thread;
+
+    printf("Starting thread exit test\n");
+
+    for (int i = 0; i < SHORT_LIVED_THREADS; i++) {
+        pthread_create(&thread, NULL, short_lived_func, NULL);
+        pthread_join(thread, NULL);
+    }
+    printf("%d short-lived threads completed\n", SHORT_LIVED_THREADS);
+
+    pthread_create(&thread, NULL, leaking_func, NULL);
+    pthread_join(thread, NULL);
+
+    printf("Test completed\n");
+    return 0;
+}
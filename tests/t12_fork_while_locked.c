@@ -0,0 +1,72 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/*
+ * A process learns the order mutex1 -> mutex2, then forks while another
+ * thread keeps taking locks, so lockdep is likely busy at the moment of the
+ * fork. The child must neither hang inside lockdep nor forget what the parent
+ * learned: its first mutex2 -> mutex1 acquisition is reported as a cycle and
+ * refused with EDEADLK, which its exit status tells the parent.
+ */
+
+pthread_mutex_t mutex1 = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t mutex2 = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t busy_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+atomic_bool stop;
+
+void* busy_func(void* arg __attribute__((unused)))
+{
+    while (!atomic_load(&stop)) {
+        pthread_mutex_lock(&busy_mutex);
+        pthread_mutex_unlock(&busy_mutex);
+    }
+    return NULL;
+}
+
+int main()
+{
+    pthread_t busy;
+
+    printf("Starting fork test\n");
+
+    pthread_mutex_lock(&mutex1);
+    pthread_mutex_lock(&mutex2);
+    pthread_mutex_unlock(&mutex2);
+    pthread_mutex_unlock(&mutex1);
+
+    pthread_create(&busy, NULL, busy_func, NULL);
+    usleep(10000);
+
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0) {
+        printf("Child: Acquiring mutex2, then mutex1\n");
+        pthread_mutex_lock(&mutex2);
+        int result = pthread_mutex_lock(&mutex1);
+        if (result == 0) {
+            printf("Child: Got mutex1\n");
+            pthread_mutex_unlock(&mutex1);
+        } else {
+            printf("Child: Error acquiring mutex1: %d\n", result);
+        }
+        pthread_mutex_unlock(&mutex2);
+        fflush(stdout);
+        _exit(result == EDEADLK ? 0 : 1);
+    }
+
+    int status;
+    waitpid(pid, &status, 0);
+    atomic_store(&stop, true);
+    pthread_join(busy, NULL);
+
+    bool refused = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    printf("Child exited with status %d, refused the reversed order: %d\n", WEXITSTATUS(status), refused);
+    printf("%s\n", refused ? "Test completed" : "Test failed");
+    return refused ? 0 : 1;
+}
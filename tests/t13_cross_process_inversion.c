@@ -0,0 +1,79 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#include "lockdep_test.h"
+
+/*
+ * Two processes take the same pair of process-shared mutexes in opposite
+ * orders. Each one only sees its own half of the inversion, so it can only be
+ * detected through the shared lock graph: the test runs itself again with
+ * LOCKDEP_SHM set if it was not. The first child's mutex1 -> mutex2 must be
+ * allowed, and the second child's mutex2 -> mutex1 refused with EDEADLK as a
+ * cycle. Each child's exit status tells the parent whether it got what was
+ * expected.
+ */
+
+typedef struct shared_locks {
+    pthread_mutex_t mutex1;
+    pthread_mutex_t mutex2;
+} shared_locks_t;
+
+/// Prints the result of a child's second acquisition, and exits with 0 if it
+/// is `expected`.
+static void report(const char* who, int result, int expected)
+{
+    if (result == 0) {
+        printf("%s: Got both mutexes\n", who);
+    } else {
+        printf("%s: Error acquiring the second mutex: %d\n", who, result);
+    }
+    fflush(stdout);
+    _exit(result == expected ? 0 : 1);
+}
+
+/// Tells whether the child `pid` exited with status 0.
+static bool succeeded(pid_t pid)
+{
+    int status;
+    return waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+int main(int argc __attribute__((unused)), char** argv)
+{
+    char name[64];
+    snprintf(name, sizeof(name), "/lockdep_t13.%d", getpid());
+    rerun_with("LOCKDEP_SHM", name, argv);
+
+    printf("Starting cross-process test\n");
+
+    shared_locks_t* locks = mmap(NULL, sizeof(*locks), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (locks == MAP_FAILED) return 1;
+
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutex_init(&locks->mutex1, &attr);
+    pthread_mutex_init(&locks->mutex2, &attr);
+
+    fflush(stdout);
+    pid_t first = fork();
+    if (first == 0) report("First child (mutex1, then mutex2)", lock_in_order(&locks->mutex1, &locks->mutex2), 0);
+    bool allowed = succeeded(first);
+
+    // The parent never took the mutexes, so the second child inherits no
+    // ordering between them.
+    pid_t second = fork();
+    if (second == 0) {
+        report("Second child (mutex2, then mutex1)", lock_in_order(&locks->mutex2, &locks->mutex1), EDEADLK);
+    }
+    bool refused = succeeded(second);
+
+    shm_unlink(getenv("LOCKDEP_SHM"));
+    munmap(locks, sizeof(*locks));
+    printf("First ordering allowed: %d, reversed ordering refused: %d\n", allowed, refused);
+    bool ok = allowed && refused;
+    printf("%s\n", ok ? "Test completed" : "Test failed");
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,104 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * Readers of an rwlock do not block each other, so lock orders made of read
+ * acquisitions alone are not deadlocks:
+ *
+ * 1. The same rwlock is read-locked twice by one thread.
+ * 2. Thread 1 read-locks rwlock1 then rwlock2, thread 2 the opposite.
+ *
+ * Neither may be reported. Then thread 3 write-locks rwlock3 and read-locks
+ * rwlock4, and thread 4 write-locks rwlock4 and write-locks rwlock3: the
+ * writers make each other wait, so that inversion must be reported as a cycle
+ * and refused with EDEADLK. The threads run one after the other, so none of
+ * them actually blocks.
+ */
+
+pthread_rwlock_t rwlock1 = PTHREAD_RWLOCK_INITIALIZER;
+pthread_rwlock_t rwlock2 = PTHREAD_RWLOCK_INITIALIZER;
+pthread_rwlock_t rwlock3 = PTHREAD_RWLOCK_INITIALIZER;
+pthread_rwlock_t rwlock4 = PTHREAD_RWLOCK_INITIALIZER;
+
+static void report(const char* who, int result)
+{
+    if (result == 0) {
+        printf("%s: Got both locks\n", who);
+    } else {
+        printf("%s: Error acquiring the second lock: %d\n", who, result);
+    }
+}
+
+void* read_in_order(void* arg __attribute__((unused)))
+{
+    pthread_rwlock_rdlock(&rwlock1);
+    int result = pthread_rwlock_rdlock(&rwlock2);
+    report("Thread 1 (read rwlock1, then read rwlock2)", result);
+    if (result == 0) pthread_rwlock_unlock(&rwlock2);
+    pthread_rwlock_unlock(&rwlock1);
+    return (void*)(intptr_t)result;
+}
+
+void* read_reversed(void* arg __attribute__((unused)))
+{
+    pthread_rwlock_rdlock(&rwlock2);
+    int result = pthread_rwlock_rdlock(&rwlock1);
+    report("Thread 2 (read rwlock2, then read rwlock1)", result);
+    if (result == 0) pthread_rwlock_unlock(&rwlock1);
+    pthread_rwlock_unlock(&rwlock2);
+    return (void*)(intptr_t)result;
+}
+
+void* write_then_read(void* arg __attribute__((unused)))
+{
+    pthread_rwlock_wrlock(&rwlock3);
+    int result = pthread_rwlock_rdlock(&rwlock4);
+    report("Thread 3 (write rwlock3, then read rwlock4)", result);
+    if (result == 0) pthread_rwlock_unlock(&rwlock4);
+    pthread_rwlock_unlock(&rwlock3);
+    return (void*)(intptr_t)result;
+}
+
+void* write_reversed(void* arg __attribute__((unused)))
+{
+    pthread_rwlock_wrlock(&rwlock4);
+    int result = pthread_rwlock_wrlock(&rwlock3);
+    report("Thread 4 (write rwlock4, then write rwlock3)", result);
+    if (result == 0) pthread_rwlock_unlock(&rwlock3);
+    pthread_rwlock_unlock(&rwlock4);
+    return (void*)(intptr_t)result;
+}
+
+/// Runs `func` in a thread of its own and returns the result of its second
+/// acquisition.
+static int run(void* (*func)(void*))
+{
+    pthread_t thread;
+    void* result;
+    pthread_create(&thread, NULL, func, NULL);
+    pthread_join(thread, &result);
+    return (int)(intptr_t)result;
+}
+
+int main()
+{
+    printf("Starting rwlock readers test\n");
+
+    pthread_rwlock_rdlock(&rwlock1);
+    int result = pthread_rwlock_rdlock(&rwlock1);
+    printf("Main: Read-locked rwlock1 twice: %d\n", result);
+    if (result == 0) pthread_rwlock_unlock(&rwlock1);
+    pthread_rwlock_unlock(&rwlock1);
+
+    bool ok = result == 0;
+    ok = run(read_in_order) == 0 && ok;
+    ok = run(read_reversed) == 0 && ok;
+    ok = run(write_then_read) == 0 && ok;
+    ok = run(write_reversed) == EDEADLK && ok;
+
+    printf("%s\n", ok ? "Test completed" : "Test failed");
+    return ok ? 0 : 1;
+}
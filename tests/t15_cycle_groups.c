@@ -0,0 +1,108 @@
+#define _GNU_SOURCE
+#include "lockdep_test.h"
+
+/*
+ * The whole-graph cycle analysis must find every group of locks with circular
+ * dependencies, however deep the graph is:
+ *
+ * 1. pair1 and pair2 are taken in both orders: a group of 2 locks.
+ * 2. ring1 -> ring2 -> ring3 -> ring1: a group of 3 locks.
+ * 3. hub is taken before and after each of 20 spokes: a group of 21 locks
+ *    with 20 inversions, of which only 16 cycles are printed.
+ * 4. A chain of 20000 locks without any cycle, which a recursive walk could
+ *    not get through on the small stack the analysis runs on.
+ *
+ * The report of lockdep_report_cycles() is captured and checked: 3 groups,
+ * and 1 + 1 + 16 cycles.
+ */
+
+#define SPOKES 20
+#define CHAIN_LENGTH 20000
+#define REPORT_STACK_SIZE (256 * 1024)
+
+pthread_mutex_t pair1 = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t pair2 = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t ring1 = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t ring2 = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t ring3 = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t hub = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t spokes[SPOKES];
+
+static typeof(&lockdep_report_cycles) report_cycles;
+static unsigned groups;
+
+void* report_func(void* arg __attribute__((unused)))
+{
+    groups = report_cycles();
+    return NULL;
+}
+
+static bool has_group(const unsigned* sizes, unsigned size)
+{
+    return sizes[1] == size || sizes[2] == size || sizes[3] == size;
+}
+
+/// Runs the analysis on a small stack, with stderr sent to `capture`.
+static void run_report(FILE* capture)
+{
+    int saved = capture_start(STDERR_FILENO, capture);
+
+    pthread_t thread;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, REPORT_STACK_SIZE);
+    pthread_create(&thread, &attr, report_func, NULL);
+    pthread_join(thread, NULL);
+    pthread_attr_destroy(&attr);
+
+    capture_end(STDERR_FILENO, saved);
+}
+
+int main()
+{
+    printf("Starting cycle groups test\n");
+
+    report_cycles = LOCKDEP_API(lockdep_report_cycles);
+    if (!report_cycles) {
+        printf("lockdep_report_cycles() not found, is the interposer preloaded?\n");
+        return 1;
+    }
+
+    lock_in_order(&pair1, &pair2);
+    lock_in_order(&pair2, &pair1);
+
+    lock_in_order(&ring1, &ring2);
+    lock_in_order(&ring2, &ring3);
+    lock_in_order(&ring3, &ring1);
+
+    for (int i = 0; i < SPOKES; i++) {
+        pthread_mutex_init(&spokes[i], NULL);
+        lock_in_order(&hub, &spokes[i]);
+        lock_in_order(&spokes[i], &hub);
+    }
+
+    pthread_mutex_t* chain = calloc(CHAIN_LENGTH, sizeof(pthread_mutex_t));
+    for (int i = 0; i + 1 < CHAIN_LENGTH; i++) lock_in_order(&chain[i], &chain[i + 1]);
+
+    FILE* capture = tmpfile();
+    if (!capture) return 1;
+    run_report(capture);
+
+    unsigned cycles = 0, sizes[4] = {0};
+    char line[4096];
+    rewind(capture);
+    while (fgets(line, sizeof(line), capture)) {
+        unsigned number, size;
+        if (strncmp(line, "[LOCKDEP]   cycle:", 18) == 0) cycles++;
+        if (sscanf(line, "[LOCKDEP] Group %u: %u lock", &number, &size) == 2 && number >= 1 && number <= 3) {
+            sizes[number] = size;
+        }
+    }
+    fclose(capture);
+
+    printf("Groups: %u, sizes %u %u %u, cycles: %u\n", groups, sizes[1], sizes[2], sizes[3], cycles);
+    bool ok = groups == 3 && has_group(sizes, 2) && has_group(sizes, 3) && has_group(sizes, SPOKES + 1) &&
+              cycles == 1 + 1 + 16;
+    printf("%s\n", ok ? "Test completed" : "Test failed");
+    return ok ? 0 : 1;
+}
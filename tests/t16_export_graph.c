@@ -0,0 +1,81 @@
+#define _GNU_SOURCE
+#include "lockdep_test.h"
+
+/*
+ * The orderings of the circular deadlock test are taken by a single thread:
+ * mutex1 -> mutex2, mutex2 -> mutex3, then mutex3 -> mutex1, which closes the
+ * cycle and is refused. The graph is then exported to DOT and JSON, and both
+ * files must hold the three mutexes and the three orderings, the last one
+ * marked as an inversion. An unknown format must be refused without creating
+ * the file.
+ */
+
+pthread_mutex_t mutex1 = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t mutex2 = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t mutex3 = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned count_in_file(const char* path, const char* pattern)
+{
+    FILE* in = fopen(path, "r");
+    if (!in) return 0;
+    unsigned count = count_lines(in, pattern);
+    fclose(in);
+    return count;
+}
+
+/// Every mutex must appear once, by address.
+static bool has_mutexes(const char* path)
+{
+    pthread_mutex_t* mutexes[] = {&mutex1, &mutex2, &mutex3};
+    for (int i = 0; i < 3; i++) {
+        char address[32];
+        snprintf(address, sizeof(address), "%p", (void*)mutexes[i]);
+        if (count_in_file(path, address) != 1) return false;
+    }
+    return true;
+}
+
+int main()
+{
+    printf("Starting graph export test\n");
+
+    typeof(&lockdep_export_graph) export_graph = LOCKDEP_API(lockdep_export_graph);
+    if (!export_graph) {
+        printf("lockdep_export_graph() not found, is the interposer preloaded?\n");
+        return 1;
+    }
+
+    lock_in_order(&mutex1, &mutex2);
+    lock_in_order(&mutex2, &mutex3);
+    lock_in_order(&mutex3, &mutex1);
+
+    char dot[64], json[64], unknown[64];
+    snprintf(dot, sizeof(dot), "/tmp/lockdep_t16.%d.dot", getpid());
+    snprintf(json, sizeof(json), "/tmp/lockdep_t16.%d.json", getpid());
+    snprintf(unknown, sizeof(unknown), "/tmp/lockdep_t16.%d.unknown", getpid());
+    bool exported = export_graph(dot, LOCKDEP_EXPORT_DOT) && export_graph(json, LOCKDEP_EXPORT_JSON);
+    bool refused = !export_graph(unknown, (lockdep_export_format_t)42) && access(unknown, F_OK) != 0;
+    printf("Unknown format refused: %d\n", refused);
+
+    unsigned dot_nodes = count_in_file(dot, "[label=\"MUTEX");
+    unsigned dot_edges = count_in_file(dot, " -> n");
+    unsigned dot_inversions = count_in_file(dot, "color=red");
+    bool dot_closed = count_in_file(dot, "digraph lockdep {") == 1 && count_in_file(dot, "}") == 1;
+    printf("DOT: %u nodes, %u edges, %u inversions\n", dot_nodes, dot_edges, dot_inversions);
+
+    unsigned json_nodes = count_in_file(json, "\"type\": \"MUTEX\"");
+    unsigned json_edges = count_in_file(json, "\"from\":");
+    unsigned json_inversions = count_in_file(json, "\"inversion\": true");
+    bool json_closed = count_in_file(json, "{\"nodes\": [") == 1 && count_in_file(json, "], \"edges\": [") == 1 &&
+                       count_in_file(json, "]}") == 1;
+    printf("JSON: %u nodes, %u edges, %u inversions\n", json_nodes, json_edges, json_inversions);
+
+    bool ok = exported && refused && dot_closed && json_closed && dot_nodes == 3 && dot_edges == 3 &&
+              dot_inversions == 1 && json_nodes == 3 && json_edges == 3 && json_inversions == 1 && has_mutexes(dot) &&
+              has_mutexes(json);
+    unlink(dot);
+    unlink(json);
+
+    printf("%s\n", ok ? "Test completed" : "Test failed");
+    return ok ? 0 : 1;
+}
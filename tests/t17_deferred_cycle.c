@@ -0,0 +1,83 @@
+#define _GNU_SOURCE
+#include "lockdep_test.h"
+
+/*
+ * The circular deadlock test in deferred mode: thread 1 takes mutex1 then
+ * mutex2, thread 2 mutex2 then mutex3, and thread 3 mutex3 then mutex1. The
+ * threads run one after the other, so none of them blocks, and nothing is
+ * refused in deferred mode. The analyzer thread must still report the cycle
+ * once it replays the third ordering.
+ *
+ * The test runs itself again with LOCKDEP_MODE=deferred if it was not set.
+ * Switching back to full validation stops the analyzer once it has drained
+ * every ring, after which the report must be there and the cycle analysis
+ * must find a single group.
+ */
+
+pthread_mutex_t mutex1 = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t mutex2 = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t mutex3 = PTHREAD_MUTEX_INITIALIZER;
+
+void* thread1_func(void* arg __attribute__((unused)))
+{
+    lock_in_order(&mutex1, &mutex2);
+    return NULL;
+}
+
+void* thread2_func(void* arg __attribute__((unused)))
+{
+    lock_in_order(&mutex2, &mutex3);
+    return NULL;
+}
+
+void* thread3_func(void* arg __attribute__((unused)))
+{
+    lock_in_order(&mutex3, &mutex1);
+    return NULL;
+}
+
+static void run(void* (*func)(void*))
+{
+    pthread_t thread;
+    pthread_create(&thread, NULL, func, NULL);
+    pthread_join(thread, NULL);
+}
+
+int main(int argc __attribute__((unused)), char** argv)
+{
+    rerun_with("LOCKDEP_MODE", "deferred", argv);
+
+    printf("Starting deferred cycle test\n");
+
+    typeof(&lockdep_set_mode) set_mode = LOCKDEP_API(lockdep_set_mode);
+    typeof(&lockdep_report_cycles) report_cycles = LOCKDEP_API(lockdep_report_cycles);
+    if (!set_mode || !report_cycles) {
+        printf("lockdep API not found, is the interposer preloaded?\n");
+        return 1;
+    }
+
+    // The analyzer reports from its own thread, at any time until it stops,
+    // the cycle on stdout and the deferred report on stderr.
+    FILE* capture = tmpfile();
+    if (!capture) return 1;
+    int saved_stdout = capture_start(STDOUT_FILENO, capture);
+    int saved_stderr = capture_start(STDERR_FILENO, capture);
+
+    run(thread1_func);
+    run(thread2_func);
+    run(thread3_func);
+    set_mode(LOCKDEP_MODE_FULL);
+    unsigned groups = report_cycles();
+
+    capture_end(STDOUT_FILENO, saved_stdout);
+    capture_end(STDERR_FILENO, saved_stderr);
+
+    unsigned reports = count_lines(capture, "[LOCKDEP] DEADLOCK DETECTED (deferred)");
+    unsigned cycles = count_lines(capture, "[LOCKDEP] Cycle:");
+    fclose(capture);
+
+    printf("Deferred reports: %u, cycles: %u, groups: %u\n", reports, cycles, groups);
+    bool ok = reports == 1 && cycles == 1 && groups == 1;
+    printf("%s\n", ok ? "Test completed" : "Test failed");
+    return ok ? 0 : 1;
+}
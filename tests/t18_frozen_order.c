@@ -0,0 +1,87 @@
+#define _GNU_SOURCE
+#include "lockdep_test.h"
+
+/*
+ * Frozen mode learns the orderings, freezes the graph, thaws on an ordering
+ * that does not fit the order and freezes again:
+ *
+ * 1. mutex_a -> mutex_b and mutex_p -> mutex_q are learned, and the graph
+ *    freezes once no ordering was added for LOCKDEP_FREEZE_MS.
+ * 2. 100 new mutexes are taken after mutex_q, and a new one before mutex_a.
+ *    New locks are placed at either end of the order, which must stay frozen
+ *    (the table also outgrows its first size).
+ * 3. mutex_b -> mutex_p is no cycle, but the order puts mutex_p first: the
+ *    graph thaws, then freezes again once it has settled.
+ *
+ * The test runs itself again with LOCKDEP_FREEZE_MS set if it was not, and
+ * checks the mode after each step and the messages printed along the way.
+ */
+
+#define NEW_LOCKS 100
+#define WAIT_MS 5000
+
+pthread_mutex_t mutex_a = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t mutex_b = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t mutex_p = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t mutex_q = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t mutex_early = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t new_locks[NEW_LOCKS];
+
+static typeof(&lockdep_get_mode) get_mode;
+
+/// Keeps acquiring a lock, which gives lockdep the chance to freeze, until the
+/// graph is frozen. Returns whether it was in time.
+static bool wait_for_freeze(void)
+{
+    for (int waited = 0; waited < WAIT_MS; waited += 10) {
+        if (get_mode() == LOCKDEP_MODE_FROZEN) return true;
+        usleep(10 * 1000);
+        pthread_mutex_lock(&mutex_a);
+        pthread_mutex_unlock(&mutex_a);
+    }
+    return false;
+}
+
+int main(int argc __attribute__((unused)), char** argv)
+{
+    rerun_with("LOCKDEP_FREEZE_MS", "50", argv);
+
+    printf("Starting frozen order test\n");
+
+    get_mode = LOCKDEP_API(lockdep_get_mode);
+    if (!get_mode) {
+        printf("lockdep_get_mode() not found, is the interposer preloaded?\n");
+        return 1;
+    }
+
+    FILE* capture = tmpfile();
+    if (!capture) return 1;
+    int saved = capture_start(STDERR_FILENO, capture);
+
+    lock_in_order(&mutex_a, &mutex_b);
+    lock_in_order(&mutex_p, &mutex_q);
+    bool frozen = wait_for_freeze();
+
+    for (int i = 0; i < NEW_LOCKS; i++) {
+        pthread_mutex_init(&new_locks[i], NULL);
+        lock_in_order(&mutex_q, &new_locks[i]);
+    }
+    lock_in_order(&mutex_early, &mutex_a);
+    bool stayed_frozen = get_mode() == LOCKDEP_MODE_FROZEN;
+
+    lock_in_order(&mutex_b, &mutex_p);
+    bool thawed = get_mode() == LOCKDEP_MODE_FULL;
+    bool refrozen = wait_for_freeze();
+
+    capture_end(STDERR_FILENO, saved);
+
+    unsigned freezes = count_lines(capture, "[LOCKDEP] Lock graph frozen");
+    unsigned thaws = count_lines(capture, "does not fit the frozen order");
+    fclose(capture);
+
+    printf("Frozen: %d, stayed frozen: %d, thawed: %d, refrozen: %d, freezes: %u, thaws: %u\n", frozen,
+           stayed_frozen, thawed, refrozen, freezes, thaws);
+    bool ok = frozen && stayed_frozen && thawed && refrozen && freezes == 2 && thaws == 1;
+    printf("%s\n", ok ? "Test completed" : "Test failed");
+    return ok ? 0 : 1;
+}
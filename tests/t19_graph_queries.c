@@ -0,0 +1,140 @@
+#define _GNU_SOURCE
+#include "lockdep_test.h"
+
+/*
+ * The graph and ownership queries:
+ *
+ * 1. The orderings of the circular deadlock test: mutex1 -> mutex2,
+ *    mutex2 -> mutex3, then mutex3 -> mutex1, which is refused. The report
+ *    must print the whole cycle, mutex1 -> mutex2 -> mutex3 -> mutex1 in some
+ *    rotation, on its "Cycle:" line.
+ * 2. lockdep_find_path() must find mutex1 -> mutex2 -> mutex3.
+ * 3. lockdep_lock_stats() must count one ordering per mutex, the inversion
+ *    from mutex3 only, and the nested acquisition under mutex1.
+ * 4. The main thread and a second one both read-lock rwlock, each besides a
+ *    mutex of its own. lockdep_dump_held() must count two locks for each of
+ *    them, and the owner of rwlock must have two holders.
+ *
+ * The test runs itself again with LOCKDEP_OWNERS set if it was not, for the
+ * ownership table to be kept.
+ */
+
+pthread_mutex_t mutex1 = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t mutex2 = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t mutex3 = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t mutex4 = PTHREAD_MUTEX_INITIALIZER;
+pthread_rwlock_t rwlock = PTHREAD_RWLOCK_INITIALIZER;
+
+static pthread_barrier_t holding;
+static pthread_barrier_t checked;
+static pid_t reader_tid;
+
+/// Holds mutex4 and rwlock for reading until the main thread checked them.
+void* reader_func(void* arg __attribute__((unused)))
+{
+    pthread_mutex_lock(&mutex4);
+    pthread_rwlock_rdlock(&rwlock);
+    reader_tid = gettid();
+    pthread_barrier_wait(&holding);
+    pthread_barrier_wait(&checked);
+    pthread_rwlock_unlock(&rwlock);
+    pthread_mutex_unlock(&mutex4);
+    return NULL;
+}
+
+/// Tells whether each lock of the "Cycle:" line in `line` is acquired before
+/// the next in the orderings of the test, and the line comes back to its first
+/// lock after the three mutexes.
+static bool is_cycle(const char* line)
+{
+    const void* locks[4];
+    if (sscanf(line, "[LOCKDEP] Cycle: MUTEX %p -> MUTEX %p -> MUTEX %p -> MUTEX %p", &locks[0], &locks[1],
+               &locks[2], &locks[3]) != 4) {
+        return false;
+    }
+    const void* next[][2] = {{&mutex1, &mutex2}, {&mutex2, &mutex3}, {&mutex3, &mutex1}};
+    for (int i = 0; i < 3; i++) {
+        bool ordered = false;
+        for (int j = 0; j < 3; j++) ordered |= locks[i] == next[j][0] && locks[i + 1] == next[j][1];
+        if (!ordered) return false;
+    }
+    return locks[0] == locks[3];
+}
+
+int main(int argc __attribute__((unused)), char** argv)
+{
+    rerun_with("LOCKDEP_OWNERS", "1", argv);
+
+    printf("Starting graph queries test\n");
+
+    typeof(&lockdep_find_path) find_path = LOCKDEP_API(lockdep_find_path);
+    typeof(&lockdep_lock_stats) lock_stats = LOCKDEP_API(lockdep_lock_stats);
+    typeof(&lockdep_dump_held) dump_held = LOCKDEP_API(lockdep_dump_held);
+    typeof(&lockdep_lock_owner) lock_owner = LOCKDEP_API(lockdep_lock_owner);
+    if (!find_path || !lock_stats || !dump_held || !lock_owner) {
+        printf("lockdep API not found, is the interposer preloaded?\n");
+        return 1;
+    }
+
+    // The report of the refused acquisition goes to stdout.
+    FILE* capture = tmpfile();
+    if (!capture) return 1;
+    lock_in_order(&mutex1, &mutex2);
+    lock_in_order(&mutex2, &mutex3);
+    int saved = capture_start(STDOUT_FILENO, capture);
+    int refused = lock_in_order(&mutex3, &mutex1);
+    capture_end(STDOUT_FILENO, saved);
+
+    unsigned cycles = 0, whole_cycles = 0;
+    char line[1024];
+    rewind(capture);
+    while (fgets(line, sizeof(line), capture)) {
+        if (strncmp(line, "[LOCKDEP] Cycle:", 16) != 0) continue;
+        cycles++;
+        if (is_cycle(line)) whole_cycles++;
+    }
+    fclose(capture);
+    printf("Refused: %d, cycle lines: %u, whole cycles: %u\n", refused, cycles, whole_cycles);
+    bool ok = refused != 0 && cycles == 1 && whole_cycles == 1;
+
+    const void* path[4] = {NULL};
+    size_t length = find_path(&mutex1, &mutex3, path, 4);
+    printf("Path from mutex1 to mutex3: %zu locks\n", length);
+    ok = ok && length == 3 && path[0] == &mutex1 && path[1] == &mutex2 && path[2] == &mutex3;
+    ok = ok && find_path(&mutex1, &mutex1, path, 4) == 1 && find_path(&mutex1, &mutex4, path, 4) == 0;
+
+    lockdep_lock_stats_t stats1, stats2, stats3, stats4;
+    bool found = lock_stats(&mutex1, &stats1) && lock_stats(&mutex2, &stats2) && lock_stats(&mutex3, &stats3);
+    printf("Orderings: %u %u %u, inversions: %u %u %u, nested under mutex1: %llu\n", stats1.orderings,
+           stats2.orderings, stats3.orderings, stats1.inversions, stats2.inversions, stats3.inversions,
+           (unsigned long long)stats1.nested);
+    ok = ok && found && !lock_stats(&mutex4, &stats4) && stats1.type == SYNC_MUTEX && stats1.exclusive;
+    ok = ok && stats1.orderings == 1 && stats2.orderings == 1 && stats3.orderings == 1;
+    ok = ok && stats1.inversions == 0 && stats2.inversions == 0 && stats3.inversions == 1 && stats1.nested == 1;
+
+    pthread_barrier_init(&holding, NULL, 2);
+    pthread_barrier_init(&checked, NULL, 2);
+    pthread_t reader;
+    pthread_create(&reader, NULL, reader_func, NULL);
+    pthread_mutex_lock(&mutex1);
+    pthread_rwlock_rdlock(&rwlock);
+    pthread_barrier_wait(&holding);
+
+    unsigned main_held = dump_held(0);
+    unsigned reader_held = dump_held(reader_tid);
+    lockdep_owner_t owner;
+    bool owned = lock_owner(&rwlock, &owner);
+
+    pthread_barrier_wait(&checked);
+    pthread_rwlock_unlock(&rwlock);
+    pthread_mutex_unlock(&mutex1);
+    pthread_join(reader, NULL);
+    unsigned released = dump_held(0);
+
+    printf("Held by main: %u, by the reader: %u, after release: %u, rwlock holders: %u\n", main_held, reader_held,
+           released, owned ? owner.holders : 0);
+    ok = ok && main_held == 2 && reader_held == 2 && released == 0 && owned && owner.holders == 2;
+
+    printf("%s\n", ok ? "Test completed" : "Test failed");
+    return ok ? 0 : 1;
+}
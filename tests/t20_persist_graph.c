@@ -0,0 +1,68 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "lockdep_test.h"
+
+/*
+ * The lock graph is kept across runs with LOCKDEP_GRAPH_FILE:
+ *
+ * 1. A first run takes mutex1 -> mutex2 and exits, saving its graph.
+ * 2. A second run takes mutex2 -> mutex1. It never saw the other order
+ *    itself, but loaded it from the file, so the acquisition must be refused
+ *    with EDEADLK.
+ *
+ * The test runs itself twice more with the file set, the run to make being
+ * named by its first argument, and checks both exit statuses.
+ */
+
+pthread_mutex_t mutex1 = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t mutex2 = PTHREAD_MUTEX_INITIALIZER;
+
+/// Runs the test again as `run`, and returns its exit status.
+static int run_again(const char* run)
+{
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0) {
+        execl("/proc/self/exe", "t20_persist_graph", run, (char*)NULL);
+        perror("execl");
+        _exit(1);
+    }
+    int status;
+    waitpid(pid, &status, 0);
+    return WIFEXITED(status) ? WEXITSTATUS(status) : 1;
+}
+
+int main(int argc, char** argv)
+{
+    if (argc > 1 && strcmp(argv[1], "learn") == 0) {
+        int result = lock_in_order(&mutex1, &mutex2);
+        printf("First run: mutex1, then mutex2: %d\n", result);
+        return result;
+    }
+    if (argc > 1 && strcmp(argv[1], "check") == 0) {
+        int result = lock_in_order(&mutex2, &mutex1);
+        printf("Second run: mutex2, then mutex1: %d\n", result);
+        return result == EDEADLK ? 0 : 1;
+    }
+
+    printf("Starting graph persistence test\n");
+
+    char path[64];
+    snprintf(path, sizeof(path), "/tmp/lockdep_t20.%d.graph", getpid());
+    unlink(path);
+    setenv("LOCKDEP_GRAPH_FILE", path, 1);
+
+    bool learned = run_again("learn") == 0;
+    struct stat st;
+    bool saved = stat(path, &st) == 0 && st.st_size > 0;
+    bool refused = run_again("check") == 0;
+    unlink(path);
+
+    printf("Learned: %d, saved: %d, refused from the saved graph: %d\n", learned, saved, refused);
+    bool ok = learned && saved && refused;
+    printf("%s\n", ok ? "Test completed" : "Test failed");
+    return ok ? 0 : 1;
+}
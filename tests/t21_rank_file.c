@@ -0,0 +1,80 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <link.h>
+
+#include "lockdep_test.h"
+
+/*
+ * Lock ranks loaded from LOCKDEP_RANK_FILE:
+ *
+ * 1. The file ranks rank_low 10 and rank_high 20, by "<module>+<offset>".
+ *    lockdep_lock_stats() must report both ranks.
+ * 2. rank_low -> rank_high is in order. rank_high -> rank_low is refused with
+ *    EDEADLK from the rank comparison alone, never having been seen reversed.
+ * 3. unranked -> rank_low, then rank_low -> unranked: the unranked lock falls
+ *    back to the graph check, which refuses the second ordering as a cycle.
+ *
+ * The test writes the rank file, runs itself again with LOCKDEP_RANK_FILE set
+ * for lockdep to load it at startup, and checks each result.
+ */
+
+pthread_mutex_t rank_low = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t rank_high = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t unranked = PTHREAD_MUTEX_INITIALIZER;
+
+/// Stores the load address of the main program, which comes first.
+static int program_base(struct dl_phdr_info* info, size_t size __attribute__((unused)), void* data)
+{
+    *(uintptr_t*)data = info->dlpi_addr;
+    return 1;
+}
+
+/// Writes the ranks of rank_low and rank_high to `path`, as offsets into the
+/// program, which stay the same when it runs again.
+static bool write_ranks(const char* path)
+{
+    uintptr_t base = 0;
+    dl_iterate_phdr(program_base, &base);
+    FILE* file = fopen(path, "w");
+    if (!file) return false;
+    fprintf(file, "# lock rank\n");
+    fprintf(file, "%s+%lx 10\n", program_invocation_short_name, (unsigned long)((uintptr_t)&rank_low - base));
+    fprintf(file, "%s+%lx 20\n", program_invocation_short_name, (unsigned long)((uintptr_t)&rank_high - base));
+    return fclose(file) == 0;
+}
+
+int main(int argc __attribute__((unused)), char** argv)
+{
+    char path[64];
+    snprintf(path, sizeof(path), "/tmp/lockdep_t21.%d.ranks", getpid());
+    if (!getenv("LOCKDEP_RANK_FILE") && !write_ranks(path)) {
+        perror("rank file");
+        return 1;
+    }
+    rerun_with("LOCKDEP_RANK_FILE", path, argv);
+    unlink(path);
+
+    printf("Starting rank file test\n");
+
+    typeof(&lockdep_lock_stats) lock_stats = LOCKDEP_API(lockdep_lock_stats);
+    if (!lock_stats) {
+        printf("lockdep_lock_stats() not found, is the interposer preloaded?\n");
+        return 1;
+    }
+
+    int in_order = lock_in_order(&rank_low, &rank_high);
+    lockdep_lock_stats_t low, high;
+    bool ranked = lock_stats(&rank_low, &low) && lock_stats(&rank_high, &high);
+    int reversed = lock_in_order(&rank_high, &rank_low);
+    printf("Ranks: %u %u, in order: %d, reversed: %d\n", ranked ? low.rank : 0, ranked ? high.rank : 0, in_order,
+           reversed);
+    bool ok = ranked && low.rank == 10 && high.rank == 20 && in_order == 0 && reversed == EDEADLK;
+
+    int learned = lock_in_order(&unranked, &rank_low);
+    int cycle = lock_in_order(&rank_low, &unranked);
+    printf("Unranked first: %d, unranked second: %d\n", learned, cycle);
+    ok = ok && learned == 0 && cycle == EDEADLK;
+
+    printf("%s\n", ok ? "Test completed" : "Test failed");
+    return ok ? 0 : 1;
+}
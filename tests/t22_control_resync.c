@@ -0,0 +1,75 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "lockdep_test.h"
+
+/*
+ * Switching the mode over the LOCKDEP_CONTROL socket while a lock is held:
+ *
+ * 1. mutex_a is taken in full mode, then tracking is switched off and it is
+ *    released unseen.
+ * 2. Tracking is switched back to full. The thread must no longer count
+ *    mutex_a as held: mutex_b, then mutex_a must not record mutex_a -> mutex_b
+ *    on the way and be refused as a cycle.
+ *
+ * The test runs itself again with LOCKDEP_CONTROL set if it was not, and
+ * checks the replies, the acquisition and the orderings in the graph.
+ */
+
+pthread_mutex_t mutex_a = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t mutex_b = PTHREAD_MUTEX_INITIALIZER;
+
+/// Sends `command` to the control socket at `path` and checks that the reply
+/// starts with `expected`.
+static bool send_command(const char* path, const char* command, const char* expected)
+{
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        perror("control socket");
+        if (fd >= 0) close(fd);
+        return false;
+    }
+
+    char reply[64] = {0};
+    bool sent = write(fd, command, strlen(command)) == (ssize_t)strlen(command);
+    ssize_t received = sent ? read(fd, reply, sizeof(reply) - 1) : -1;
+    close(fd);
+    printf("%.*s: %s", (int)strcspn(command, "\n"), command, received > 0 ? reply : "no reply\n");
+    return received > 0 && strncmp(reply, expected, strlen(expected)) == 0;
+}
+
+int main(int argc __attribute__((unused)), char** argv)
+{
+    rerun_with("LOCKDEP_CONTROL", "/tmp/lockdep_t22.%p", argv);
+
+    printf("Starting control resync test\n");
+
+    typeof(&lockdep_find_path) find_path = LOCKDEP_API(lockdep_find_path);
+    if (!find_path) {
+        printf("lockdep_find_path() not found, is the interposer preloaded?\n");
+        return 1;
+    }
+
+    char path[64];
+    snprintf(path, sizeof(path), "/tmp/lockdep_t22.%d", getpid());
+
+    pthread_mutex_lock(&mutex_a);
+    bool switched = send_command(path, "off\n", "mode off");
+    pthread_mutex_unlock(&mutex_a);
+    switched = send_command(path, "full\n", "mode full") && switched;
+
+    int result = lock_in_order(&mutex_b, &mutex_a);
+    const void* found[2];
+    size_t stale = find_path(&mutex_a, &mutex_b, found, 2);
+    unlink(path);
+
+    printf("Switched: %d, mutex_b then mutex_a: %d, orderings from mutex_a to mutex_b: %zu\n", switched, result,
+           stale);
+    bool ok = switched && result == 0 && stale == 0;
+    printf("%s\n", ok ? "Test completed" : "Test failed");
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,77 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <time.h>
+
+#include "lockdep_test.h"
+
+/*
+ * The watchdog reports threads that are deadlocked right now, even with
+ * tracking off:
+ *
+ * 1. One thread takes mutex1 and another mutex2. Each then waits, with a
+ *    timeout, for the mutex the other holds: a real deadlock, which only the
+ *    timeout breaks. With LOCKDEP_MODE=off, nothing refuses the second
+ *    acquisition.
+ * 2. The watchdog must report the deadlock between the 2 threads, once,
+ *    before the timeouts expire.
+ *
+ * The test runs itself again with LOCKDEP_MODE and LOCKDEP_WATCHDOG_MS set if
+ * they were not, and checks the timeouts and the report on standard error.
+ */
+
+#define TIMEOUT_MS 2000
+
+pthread_mutex_t mutex1 = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t mutex2 = PTHREAD_MUTEX_INITIALIZER;
+
+static pthread_barrier_t holding;
+static int results[2];
+
+/// Takes its first mutex, then waits for the other once both are held.
+void* thread_func(void* arg)
+{
+    int index = (int)(intptr_t)arg;
+    pthread_mutex_t* first = index == 0 ? &mutex1 : &mutex2;
+    pthread_mutex_t* second = index == 0 ? &mutex2 : &mutex1;
+
+    pthread_mutex_lock(first);
+    pthread_barrier_wait(&holding);
+
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += TIMEOUT_MS / 1000;
+    results[index] = pthread_mutex_timedlock(second, &deadline);
+    if (results[index] == 0) pthread_mutex_unlock(second);
+
+    pthread_mutex_unlock(first);
+    return NULL;
+}
+
+int main(int argc __attribute__((unused)), char** argv)
+{
+    rerun_with("LOCKDEP_MODE", "off", argv);
+    rerun_with("LOCKDEP_WATCHDOG_MS", "100", argv);
+
+    printf("Starting watchdog deadlock test\n");
+
+    FILE* capture = tmpfile();
+    if (!capture) return 1;
+    int saved = capture_start(STDERR_FILENO, capture);
+
+    pthread_barrier_init(&holding, NULL, 2);
+    pthread_t threads[2];
+    for (int i = 0; i < 2; i++) pthread_create(&threads[i], NULL, thread_func, (void*)(intptr_t)i);
+    for (int i = 0; i < 2; i++) pthread_join(threads[i], NULL);
+
+    capture_end(STDERR_FILENO, saved);
+
+    unsigned reports = count_lines(capture, "[LOCKDEP] Watchdog: deadlock between 2 threads");
+    unsigned waits = count_lines(capture, "waits for lock");
+    fclose(capture);
+
+    printf("Timedlock results: %d %d, reports: %u, waits reported: %u\n", results[0], results[1], reports, waits);
+    bool timed_out = results[0] == ETIMEDOUT || results[1] == ETIMEDOUT;
+    bool ok = timed_out && reports == 1 && waits == 2;
+    printf("%s\n", ok ? "Test completed" : "Test failed");
+    return ok ? 0 : 1;
+}
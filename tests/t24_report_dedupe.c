@@ -0,0 +1,116 @@
+#define _GNU_SOURCE
+#include <errno.h>
+
+#include "lockdep_test.h"
+
+/*
+ * Each problem is reported once, its repeats are counted and reported at most
+ * once per second, and every report goes to LOCKDEP_REPORT_FILE as a JSON line:
+ *
+ * 1. mutex1 -> mutex2 is learned, then mutex2 -> mutex1 is refused REFUSALS
+ *    times in a row: a single "Cycle detected" report and a single "cycle"
+ *    event, and no "repeat" event within the second.
+ * 2. PAIRS other pairs are inverted twice each: one report and one event per
+ *    pair, which takes the indexes of the reports past their first size.
+ * 3. rank_high, then rank_low is a rank violation, taken twice: one
+ *    "rank_violation" event.
+ * 4. After more than a second, mutex2 -> mutex1 once more reports the count
+ *    of the first cycle, on standard error and as a "repeat" event.
+ *
+ * The test runs itself again with LOCKDEP_REPORT_FILE set if it was not, and
+ * counts the reports on standard output and the lines of the file.
+ */
+
+#define REFUSALS 1000
+#define PAIRS 100
+
+pthread_mutex_t mutex1 = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t mutex2 = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t rank_low = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t rank_high = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t pairs[PAIRS][2];
+
+/// Tells whether every line of `file` is a JSON object with an event name.
+static bool json_lines(FILE* file)
+{
+    char line[4096];
+    rewind(file);
+    while (fgets(line, sizeof(line), file)) {
+        size_t length = strlen(line);
+        if (strncmp(line, "{\"event\":\"", 10) != 0 || length < 3 || strcmp(line + length - 2, "}\n") != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+int main(int argc __attribute__((unused)), char** argv)
+{
+    char path[64];
+    snprintf(path, sizeof(path), "/tmp/lockdep_t24.%d.json", getpid());
+    if (!getenv("LOCKDEP_REPORT_FILE")) unlink(path);
+    rerun_with("LOCKDEP_REPORT_FILE", path, argv);
+
+    printf("Starting report deduplication test\n");
+
+    typeof(&lockdep_set_rank) set_rank = LOCKDEP_API(lockdep_set_rank);
+    if (!set_rank) {
+        printf("lockdep_set_rank() not found, is the interposer preloaded?\n");
+        return 1;
+    }
+    set_rank(&rank_low, 10);
+    set_rank(&rank_high, 20);
+
+    FILE* output = tmpfile();
+    FILE* errors = tmpfile();
+    if (!output || !errors) return 1;
+    int saved_output = capture_start(STDOUT_FILENO, output);
+    int saved_errors = capture_start(STDERR_FILENO, errors);
+
+    lock_in_order(&mutex1, &mutex2);
+    unsigned refused = 0;
+    for (int i = 0; i < REFUSALS; i++) refused += lock_in_order(&mutex2, &mutex1) == EDEADLK;
+
+    for (int i = 0; i < PAIRS; i++) {
+        pthread_mutex_init(&pairs[i][0], NULL);
+        pthread_mutex_init(&pairs[i][1], NULL);
+        lock_in_order(&pairs[i][0], &pairs[i][1]);
+        for (int j = 0; j < 2; j++) refused += lock_in_order(&pairs[i][1], &pairs[i][0]) == EDEADLK;
+    }
+
+    for (int i = 0; i < 2; i++) refused += lock_in_order(&rank_high, &rank_low) == EDEADLK;
+
+    usleep(1100 * 1000);
+    refused += lock_in_order(&mutex2, &mutex1) == EDEADLK;
+
+    capture_end(STDERR_FILENO, saved_errors);
+    capture_end(STDOUT_FILENO, saved_output);
+
+    unsigned cycle_reports = count_lines(output, "[LOCKDEP] Cycle detected");
+    unsigned rank_reports = count_lines(output, "[LOCKDEP] Rank violation");
+    unsigned counted = count_lines(errors, "[LOCKDEP] Cycle 1 seen 1001 times");
+    fclose(output);
+    fclose(errors);
+
+    FILE* json = fopen(path, "r");
+    if (!json) return 1;
+    unsigned cycles = count_lines(json, "{\"event\":\"cycle\",");
+    unsigned ranks = count_lines(json, "{\"event\":\"rank_violation\",");
+    unsigned repeats = count_lines(json, "{\"event\":\"repeat\",");
+    unsigned first_repeat = count_lines(json, "{\"event\":\"repeat\",\"id\":1,");
+    unsigned first_count = count_lines(json, "\"count\":1001}");
+    bool well_formed = json_lines(json);
+    fclose(json);
+    unlink(path);
+
+    unsigned expected = REFUSALS + 2 * PAIRS + 2 + 1;
+    printf("Refused: %u of %u, cycle reports: %u, rank reports: %u, count reports: %u\n", refused, expected,
+           cycle_reports, rank_reports, counted);
+    printf("JSON: %u cycles, %u rank violations, %u repeats (%u of cycle 1 with its count: %u), well formed: %d\n",
+           cycles, ranks, repeats, first_repeat, first_count, well_formed);
+    bool ok = refused == expected && cycle_reports == 1 + PAIRS && rank_reports == 1 && counted == 1;
+    ok = ok && cycles == 1 + PAIRS && ranks == 1 && repeats == 1 && first_repeat == 1 && first_count == 1;
+    ok = ok && well_formed;
+    printf("%s\n", ok ? "Test completed" : "Test failed");
+    return ok ? 0 : 1;
+}